@@ -57,6 +57,27 @@ typedef unsigned long long uint8;
 extern "C" {
 #endif
 
+/* Value types for hgetv() and hputv() */
+typedef enum {
+    HKV_I4,     /* int */
+    HKV_U4,     /* unsigned int */
+    HKV_I8,     /* int8 */
+    HKV_U8,     /* uint8 */
+    HKV_R4,     /* float */
+    HKV_R8,     /* double */
+    HKV_L,      /* int (logical, 0=F, else T) */
+    HKV_S       /* char string (quoted) */
+} hkv_type_t;
+
+/* Keyword/value descriptor for hgetv(), hputv(), and hkvsearch() */
+typedef struct {
+    const char *keyword; /* FITS keyword */
+    hkv_type_t type;     /* Type of value pointed to by val */
+    void *val;           /* Value (returned by hgetv, implanted by hputv) */
+    int lstr;            /* Size of string buffer for HKV_S with hgetv */
+    char *card;          /* Header line for keyword (set by hkvsearch) */
+} hkv_t;
+
 
 #ifdef __STDC__   /* Full ANSI prototypes */
 
@@ -148,9 +169,44 @@ extern "C" {
         const char* keyword,    /* FITS keyword */
         char *value_buffer);    /* output buffer, should be VLENGTH+1 long */
 
+    int hview(                  /* Find value for FITS keyword (no copy) */
+        const char* hstring,    /* FITS header string */
+        const char* keyword,    /* FITS keyword */
+        const char** value,     /* start of value in hstring (returned) */
+        int* lvalue);           /* length of value (returned) */
+    int hviewi4(                /* Reentrant hgeti4() built on hview() */
+        const char* hstring,    /* FITS header string */
+        const char* keyword,    /* FITS keyword */
+        int* ival);             /* integer value (returned) */
+    int hviewi8(                /* Reentrant hgeti8() built on hview() */
+        const char* hstring,    /* FITS header string */
+        const char* keyword,    /* FITS keyword */
+        int8* ival);            /* integer*8 value (returned) */
+    int hviewu8(                /* Reentrant hgetu8() built on hview() */
+        const char* hstring,    /* FITS header string */
+        const char* keyword,    /* FITS keyword */
+        uint8* ival);           /* unsigned integer*8 value (returned) */
+    int hviewr8(                /* Reentrant hgetr8() built on hview() */
+        const char* hstring,    /* FITS header string */
+        const char* keyword,    /* FITS keyword */
+        double* dval);          /* real*8 value (returned) */
+    int hviewl(                 /* Reentrant hgetl() built on hview() */
+        const char* hstring,    /* FITS header string */
+        const char* keyword,    /* FITS keyword */
+        int* ival);             /* logical value, 0 or 1 (returned) */
+
+    int hgetv(                  /* Extract values for several keywords */
+        const char* hstring,    /* FITS header string */
+        hkv_t* kv,              /* Keyword/value descriptors */
+        const int nkv);         /* Number of keyword/value descriptors */
+
     char* ksearch(              /* Return pointer to keyword in FITS header */
         const char* hstring,    /* FITS header string */
         const char* keyword);   /* FITS keyword */
+    int hkvsearch(              /* Find lines for several keywords at once */
+        const char* hstring,    /* FITS header string */
+        hkv_t* kv,              /* Keyword/value descriptors (card set) */
+        const int nkv);         /* Number of keyword/value descriptors */
     char *blsearch (
         const char* hstring,    /* FITS header string */
         const char* keyword);   /* FITS keyword */
@@ -299,6 +355,10 @@ extern "C" {
         char* hstring,          /* FITS header string (modified) */
         const char* keyword,    /* FITS keyword */
         const char* cval);      /* Character string value */
+    int hputv(                  /* Implant values for several keywords */
+        char* hstring,          /* FITS header string (modified) */
+        hkv_t* kv,              /* Keyword/value descriptors */
+        const int nkv);         /* Number of keyword/value descriptors */
 
     int hdel(                   /* Delete a keyword line from a FITS header */
         char* hstring,          /* FITS header string (modified) */
@@ -360,7 +420,14 @@ extern int hgetsc();    /* Previously allocated string (Multiple WCS) */
 extern char *hgetc()    /* Return pointer to string */
     __attribute__ ((deprecated));  /* Use hgetc_thread_safe() instead */
 extern char *hgetc_thread_safe();  /* Copy value for FITS keyword to buffer */
+extern int hview();     /* Find value for FITS keyword without copying */
+extern int hviewi4();   /* Reentrant hgeti4() built on hview() */
+extern int hviewi8();   /* Reentrant hgeti8() built on hview() */
+extern int hviewu8();   /* Reentrant hgetu8() built on hview() */
+extern int hviewr8();   /* Reentrant hgetr8() built on hview() */
+extern int hviewl();    /* Reentrant hgetl() built on hview() */
 extern int hgetndec();  /* Number of decimal places in keyword value */
+extern int hgetv();     /* Values for several keywords in one pass */
 
 /* Subroutines to convert strings to RA and Dec in degrees */
 extern double str2ra();
@@ -374,6 +441,9 @@ extern int decnum();
 /* Find given keyword entry in FITS header */
 extern char *ksearch();
 
+/* Find entries for several keywords in FITS header */
+extern int hkvsearch();
+
 /* Find beginning of fillable blank line before FITS header keyword */
 extern char *blsearch();
 
@@ -420,6 +490,7 @@ extern int hputs();     /* Quoted character string */
 extern int hputm();     /* Quoted character string into mutiple keywords */
 extern int hputc();     /* Character string without quotes (returns 0 if OK) */
 extern int hputcom();   /* Comment after keyword=value (returns 0 if OK) */
+extern int hputv();     /* Values for several keywords (returns 0 if OK) */
 
 extern int hdel();      /* Delete a keyword line from a FITS header */
 extern int hadd();      /* Add a keyword line to a FITS header */
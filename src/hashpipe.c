@@ -8,6 +8,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
+#include <math.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -18,9 +20,18 @@
 #include <errno.h>
 #include <dlfcn.h>
 #include <sys/resource.h> 
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
 
 #include "hashpipe.h"
+#include "hashpipe_history.h"
+#include "hashpipe_cmdq.h"
 #include "hashpipe_thread_args.h"
+#include "hashpipe_graph.h"
+#include "hashpipe_watchdog.h"
 
 // Functions defined in hashpipe_thread.c, but not declared/exposed in public
 // hashpipe_thread.h.
@@ -36,20 +47,264 @@ void usage(const char *argv0) {
       "  -l,   --list          List all known threads\n"
       "  -K KEY, --shmkey=K    Specify key for shared memory\n"
       "  -I N, --instance=N    Set instance ID of this pipeline\n"
-      "  -c N, --cpu=N         Set CPU number for subsequent threads\n"
+      "  -c L, --cpu=L         Set CPUs for subsequent threads, where L is\n"
+      "                        a CPU list (e.g. 3 or 64-71,192) or node:N\n"
       "  -m N, --mask=N        Set CPU mask for subsequent threads\n"
+      "  -w N, --workers=N     Run next thread as a pool of N workers\n"
+      "  -b N, --buffer=N      Use databufs N and N+1 for next thread\n"
+      "        --in=L          Use input databuf(s) L for next thread\n"
+      "        --out=L         Use output databuf(s) L for next thread\n"
+      "        --databuf=NAME=ID[,node=N]\n"
+      "                        Name databuf ID for --in/--out (and place\n"
+      "                        it on NUMA node N)\n"
+      "  -g F, --graph=F       Read pipeline graph (options) from file F\n"
+      "        --perf          Publish performance counters of threads\n"
+      "        --latency       Publish block latencies of threads\n"
+      "        --sched=P[:N]   Set scheduling policy P (fifo, rr, other,\n"
+      "                        batch, or idle) and real-time priority or\n"
+      "                        nice level N of next thread\n"
+      "        --isolated      Require CPUs of next thread to be isolated\n"
+      "        --mlockall      Lock all memory of the pipeline into RAM\n"
+      "        --restart=P[:N] Restart next thread when it exits (P=always)\n"
+      "                        or fails (P=on-failure) up to N times [10]\n"
+      "        --watchdog=T[,dump][,abort]\n"
+      "                        Report threads that make no progress for T\n"
+      "                        seconds (and log their trace events/abort)\n"
       "  -o K=V, --option=K=V  Store K=V in status buffer\n"
       "  -p P, --plugin=P      Load plugin P\n"
+      "  -H K[,K...], --history=K[,K...]\n"
+      "                        Keep history of numeric status keys K\n"
+      "        --history-rate=R  Sample history keys R times per second [10]\n"
       "  -V,   --version       Show version\n"
-//    "  -b N, --buffer=N        Jump to input buffer B, output buffer B+1\n"
       , argv0
     );
 }
 
-// Control-C handler
+// Set by the first SIGINT/SIGTERM or by a thread returning THREAD_OK to have
+// main drain the pipeline
+static int shutdown_requested = 0;
+
+// SIGINT and SIGTERM are blocked in all threads and read by main from
+// signal_fd.  Pipeline threads write to thread_done_fd when they finish.
+static int signal_fd = -1;
+static int thread_done_fd = -1;
+
+// Signals caught by threads that were created (e.g. by plugin init functions)
+// before SIGINT and SIGTERM were blocked
+static volatile sig_atomic_t stray_signals = 0;
+
+// Restart policies of threads (see --restart)
+#define RESTART_NEVER      0
+#define RESTART_ON_FAILURE 1
+#define RESTART_ALWAYS     2
+
+// How long draining the pipeline may take (0 to stop all threads at once)
+static double drain_timeout = 10.0;
+
+// Whether threads open performance counters (see --perf)
+static int perf_enabled = 0;
+// Whether threads record block latencies (see --latency)
+static int latency_enabled = 0;
+
+// Returns seconds since the (monotonic) time t0
+static double elapsed(const struct timespec *t0)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t0->tv_sec) + 1e-9 * (now.tv_nsec - t0->tv_nsec);
+}
+
+// Handler for SIGINT/SIGTERM delivered to threads that do not block them.
+// Passes them on to main.
 static void cc(int sig)
 {
-    clear_run_threads();
+    uint64_t one = 1;
+    stray_signals++;
+    if(write(thread_done_fd, &one, sizeof(one)) < 0) {
+        // Nothing to be done
+    }
+}
+
+// Handler for the signal used to interrupt blocking system calls of threads
+// at shutdown
+static void interrupt(int sig)
+{
+}
+
+// Handles SIGINT/SIGTERM (if any) pending on signal_fd.  The first one starts
+// draining the pipeline, the second one (or the first one if draining is
+// disabled) stops all threads at once.  Signals within 100 ms of the first one
+// (e.g. from "timeout", which signals both us and our process group) count as
+// the first one.  Returns the number of signals handled.
+static int
+handle_signals()
+{
+    static struct timespec first = {0, 0};
+    struct signalfd_siginfo si;
+    int n = 0;
+
+    while(read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+        n++;
+    }
+    if(stray_signals) {
+        n += stray_signals;
+        stray_signals = 0;
+    }
+    if(n > 0) {
+        if(drain_timeout <= 0 || (shutdown_requested && elapsed(&first) > 0.1)) {
+            clear_run_threads();
+        } else if(!shutdown_requested) {
+            clock_gettime(CLOCK_MONOTONIC, &first);
+        }
+        shutdown_requested = 1;
+    }
+    return n;
+}
+
+// Waits 10 ms while draining, but returns right away on another signal
+static void
+drain_poll()
+{
+    struct pollfd pfd = {.fd = signal_fd, .events = POLLIN};
+    if(poll(&pfd, 1, 10) > 0) {
+        handle_signals();
+    }
+}
+
+// Returns non-zero if args' thread writes to databuf id
+static int
+writes_databuf(const hashpipe_thread_args_t *args, int id)
+{
+    int j;
+    for(j=0; j<args->num_output_buffers; j++) {
+        if(args->output_buffers[j] == id) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Stops threads in pipeline order (producers before consumers, i.e. the
+// reverse of start_order), waiting before stopping each thread until the
+// already stopped threads that feed its input databufs have finished (so that
+// the blocks they were still working on are not missed) and the blocks in its
+// input databufs have been consumed.  Gives up after drain_timeout seconds,
+// leaving the remaining threads to be cancelled.
+static void
+drain_threads(hashpipe_thread_args_t *args, int n, const int *start_order)
+{
+    struct timespec t0;
+    hashpipe_databuf_t *db;
+    int i, j, k, f, id;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for(k=n-1; k>=0; k--) {
+        i = start_order[k];
+        for(j=0; j<args[i].num_input_buffers; j++) {
+            id = args[i].input_buffers[j];
+            if(id < 1) {
+                continue;
+            }
+            // Threads stopped before this one are later in start_order
+            for(f=n-1; f>k; f--) {
+                if(!writes_databuf(&args[start_order[f]], id)) {
+                    continue;
+                }
+                while(run_threads() && !args[i].finished
+                && !args[start_order[f]].finished
+                && elapsed(&t0) < drain_timeout) {
+                    drain_poll();
+                }
+            }
+            db = hashpipe_databuf_attach(args[i].instance_id, id);
+            if(!db) {
+                continue;
+            }
+            while(run_threads() && !args[i].finished
+            && elapsed(&t0) < drain_timeout
+            && hashpipe_databuf_total_status(db) > 0) {
+                drain_poll();
+            }
+            hashpipe_databuf_detach(db);
+        }
+        if(!run_threads()) {
+            return;
+        }
+        if(elapsed(&t0) >= drain_timeout) {
+            fprintf(stderr, "Timed out draining pipeline at thread '%s'.\n",
+                    args[i].thread_desc->name);
+            return;
+        }
+        hashpipe_thread_stop(&args[i]);
+    }
+
+    // Give stopped threads a moment to return
+    for(i=0; i<n; i++) {
+        hashpipe_thread_finished(&args[i], 0.25);
+    }
+}
+
+// Parameters of the status history sampling thread (see --history)
+struct history_args {
+    int instance_id;
+    int nkeys;
+    const char *keys[HASHPIPE_HISTORY_MAX_KEYS];
+    double rate;
+};
+
+// Unmaps and removes the status history ring when the history thread exits
+// (or is cancelled by main at shutdown) so that stale history of a pipeline
+// that is no longer running is not mistaken for current history.
+static void
+history_cleanup(void *h)
+{
+    hashpipe_history_detach((hashpipe_history_t *)h, 1);
+}
+
+// Status history sampling thread.  Samples the history keys at a fixed
+// cadence until run_threads() returns false.
+static void *
+history_thread_run(void *vp_args)
+{
+    struct history_args *args = (struct history_args *)vp_args;
+    hashpipe_status_t st;
+    hashpipe_history_t h;
+    struct timespec next;
+    long period_ns = 1e9 / args->rate;
+
+    if(hashpipe_status_attach(args->instance_id, &st) != HASHPIPE_OK) {
+        hashpipe_error(__FUNCTION__,
+                "Error attaching to status shared memory.");
+        return THREAD_ERROR;
+    }
+    if(hashpipe_history_create(args->instance_id, &h, args->keys,
+                args->nkeys, 1.0 / args->rate,
+                HASHPIPE_HISTORY_SECONDS * args->rate + 1) != HASHPIPE_OK) {
+        hashpipe_error(__FUNCTION__, "Error creating status history.");
+        hashpipe_status_detach(&st);
+        return THREAD_ERROR;
+    }
+
+    pthread_cleanup_push((void (*)(void *))hashpipe_status_detach, &st);
+    pthread_cleanup_push(history_cleanup, &h);
+
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    while(run_threads()) {
+        hashpipe_history_sample(&h, &st);
+
+        // Sleep until time of next sample
+        next.tv_nsec += period_ns;
+        while(next.tv_nsec >= 1000000000) {
+            next.tv_nsec -= 1000000000;
+            next.tv_sec++;
+        }
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+    }
+
+    pthread_cleanup_pop(1);
+    pthread_cleanup_pop(1);
+
+    return THREAD_OK;
 }
 
 /* Exit handler that updates status buffer */
@@ -61,23 +316,14 @@ static void set_exit_status(hashpipe_thread_args_t *args) {
     }
 }
 
-// Function to set cpu affinity
-int
-set_cpu_affinity(unsigned int mask)
+// Function to set cpu affinity (an empty set means leave it alone)
+static int
+set_cpu_affinity(const cpu_set_t *cpuset)
 {
-    int i, rv;
-
-    if(mask != 0) {
-        cpu_set_t cpuset;
-        CPU_ZERO(&cpuset);
-        // Only handle 32 cores (for now)
-        for(i=0; i<32; i++) {
-            if(mask&1) {
-              CPU_SET(i, &cpuset);
-            }
-            mask >>= 1;
-        }
-        rv = sched_setaffinity(0, sizeof(cpu_set_t), &cpuset);
+    int rv;
+
+    if(CPU_COUNT(cpuset) != 0) {
+        rv = sched_setaffinity(0, sizeof(cpu_set_t), cpuset);
         if (rv<0) {
             hashpipe_error(__FUNCTION__, "Error setting cpu affinity.");
             return rv;
@@ -86,11 +332,83 @@ set_cpu_affinity(unsigned int mask)
     return 0;
 }
 
-// General init function called for all threads.
+// Function to set scheduling policy and priority (or nice level) of the
+// calling thread (a negative policy means leave it alone)
 static int
-hashpipe_thread_init(hashpipe_thread_args_t *args)
+set_scheduling(int policy, int priority)
+{
+    struct sched_param param = {.sched_priority = 0};
+
+    if(policy < 0) {
+        return 0;
+    }
+    if(policy == SCHED_FIFO || policy == SCHED_RR) {
+        param.sched_priority = priority;
+    }
+    // On Linux these affect only the calling thread
+    if(sched_setscheduler(0, policy, &param)) {
+        hashpipe_error(__FUNCTION__, "Error setting scheduling policy.");
+        return -1;
+    }
+    if(policy != SCHED_FIFO && policy != SCHED_RR && policy != SCHED_IDLE
+    && setpriority(PRIO_PROCESS, 0, priority)) {
+        hashpipe_error(__FUNCTION__, "Error setting nice level.");
+        return -1;
+    }
+    return 0;
+}
+
+// Creates databuf id using create, placing its memory on the NUMA node given
+// for it by --databuf (if any).
+static hashpipe_databuf_t *
+create_databuf(databuf_createfunc_t create, int instance_id, int id)
+{
+    hashpipe_databuf_t *db;
+    int node = hashpipe_graph_databuf_node(id);
+
+    if(node >= 0 && hashpipe_graph_set_mempolicy(node)) {
+        hashpipe_warn(__FUNCTION__,
+                "cannot place databuf %d on NUMA node %d", id, node);
+    }
+    db = create(instance_id, id);
+    if(node >= 0) {
+        hashpipe_graph_set_mempolicy(-1);
+    }
+    return db;
+}
+
+// Returns non-zero (after logging an error) if the workers of args' thread
+// cannot share databuf id (db), i.e. if its number of blocks is not a multiple
+// of the number of workers.  Otherwise block sequence numbers s and
+// s + n_block would be handled by different workers, which would then wait
+// for the same block (see hashpipe_worker_next_seq()).
+static int
+check_worker_blocks(hashpipe_thread_args_t *args, hashpipe_databuf_t *db,
+        int id)
+{
+    if(db && args->num_workers > 1 && db->n_block % args->num_workers) {
+        errno = 0; // Not a system error
+        hashpipe_error(__FUNCTION__,
+                "databuf %d has %d blocks, which %d workers of %s cannot share"
+                " (must be a multiple of %d)", id, db->n_block,
+                args->num_workers, args->thread_desc->name, args->num_workers);
+        return 1;
+    }
+    return 0;
+}
+
+// General init function called for all threads.  Databufs are created if
+// create is non-zero (when the pipeline starts), otherwise (when a thread is
+// restarted) the existing databufs are attached to, because (re)creating them
+// would reset their semaphores under the running threads.
+static int
+hashpipe_thread_init(hashpipe_thread_args_t *args, int create)
 {
     int rv = 1;
+    int i;
+    // Only the first worker of a pool creates the databufs, the others just
+    // attach
+    create = create && args->worker_index == 0;
     args->ibuf = NULL;
     args->obuf = NULL;
 
@@ -109,9 +427,12 @@ hashpipe_thread_init(hashpipe_thread_args_t *args)
         hashpipe_status_unlock_safe(&args->st);
     }
 
-    // Create databufs
+    // Create (or attach to) databufs
     if(args->thread_desc->ibuf_desc.create) {
-        args->ibuf = args->thread_desc->ibuf_desc.create(args->instance_id, args->input_buffer);
+        args->ibuf = create
+            ? create_databuf(args->thread_desc->ibuf_desc.create,
+                    args->instance_id, args->input_buffer)
+            : hashpipe_databuf_attach(args->instance_id, args->input_buffer);
         if(!args->ibuf) {
             hashpipe_error(__FUNCTION__,
                     "Error creating/attaching to databuf %d for %s input",
@@ -122,7 +443,10 @@ hashpipe_thread_init(hashpipe_thread_args_t *args)
         }
     }
     if(args->thread_desc->obuf_desc.create) {
-        args->obuf = args->thread_desc->obuf_desc.create(args->instance_id, args->output_buffer);
+        args->obuf = create
+            ? create_databuf(args->thread_desc->obuf_desc.create,
+                    args->instance_id, args->output_buffer)
+            : hashpipe_databuf_attach(args->instance_id, args->output_buffer);
         if(!args->obuf) {
             hashpipe_error(__FUNCTION__,
                     "Error creating/attaching to databuf %d for %s output",
@@ -132,12 +456,63 @@ hashpipe_thread_init(hashpipe_thread_args_t *args)
             goto obuf_error;
         }
     }
+    if(check_worker_blocks(args, args->ibuf, args->input_buffer)
+    || check_worker_blocks(args, args->obuf, args->output_buffer)) {
+        rv = HASHPIPE_ERR_PARAM;
+        goto extra_error;
+    }
+
+    // Create any additional input/output databufs (see --in and --out)
+    for(i=1; i<args->num_input_buffers && create; i++) {
+        hashpipe_databuf_t *db;
+        if(!args->thread_desc->ibuf_desc.create) {
+            break;
+        }
+        db = create_databuf(args->thread_desc->ibuf_desc.create,
+                args->instance_id, args->input_buffers[i]);
+        if(!db) {
+            hashpipe_error(__FUNCTION__,
+                    "Error creating databuf %d for %s input",
+                    args->input_buffers[i], args->thread_desc->name);
+            rv = HASHPIPE_ERR_GEN;
+            goto extra_error;
+        }
+        if(check_worker_blocks(args, db, args->input_buffers[i])) {
+            hashpipe_databuf_detach(db);
+            rv = HASHPIPE_ERR_PARAM;
+            goto extra_error;
+        }
+        hashpipe_databuf_detach(db);
+    }
+    for(i=1; i<args->num_output_buffers && create; i++) {
+        hashpipe_databuf_t *db;
+        if(!args->thread_desc->obuf_desc.create) {
+            break;
+        }
+        db = create_databuf(args->thread_desc->obuf_desc.create,
+                args->instance_id, args->output_buffers[i]);
+        if(!db) {
+            hashpipe_error(__FUNCTION__,
+                    "Error creating databuf %d for %s output",
+                    args->output_buffers[i], args->thread_desc->name);
+            rv = HASHPIPE_ERR_GEN;
+            goto extra_error;
+        }
+        if(check_worker_blocks(args, db, args->output_buffers[i])) {
+            hashpipe_databuf_detach(db);
+            rv = HASHPIPE_ERR_PARAM;
+            goto extra_error;
+        }
+        hashpipe_databuf_detach(db);
+    }
 
     // Call user init function, if it exists
     if(args->thread_desc->init) {
         rv = args->thread_desc->init(args);
     }
 
+extra_error:
+
     // Detach from output buffer
     if(hashpipe_databuf_detach(args->obuf)) {
         hashpipe_error(__FUNCTION__, "Error detaching from output databuf.");
@@ -176,14 +551,41 @@ hashpipe_thread_run(void *vp_args)
     // Cast void pointer to hashpipe_thread_run_t
     hashpipe_thread_args_t *args = (hashpipe_thread_args_t *)vp_args;
     void * rv = THREAD_OK;
+    char thread_name[16];
+
+    // Name thread after its hashpipe thread (for top, trace, etc.)
+    strncpy(thread_name, args->thread_desc->name, sizeof(thread_name)-1);
+    thread_name[sizeof(thread_name)-1] = '\0';
+    pthread_setname_np(pthread_self(), thread_name);
+
+    // Let run_threads() know who we are so it can signal our readiness
+    hashpipe_thread_set_args(args);
+    // Linux thread ID (used by the watchdog to find our trace ring)
+    args->tid = syscall(SYS_gettid);
 
     // Set CPU affinity
-    if(set_cpu_affinity(args->cpu_mask) < 0) {
+    if(set_cpu_affinity(&args->cpu_set) < 0) {
         perror("set_cpu_affinity");
         rv = THREAD_ERROR;
         goto done;
     }
 
+    // Set scheduling policy and priority
+    if(set_scheduling(args->sched_policy, args->sched_priority) < 0) {
+        rv = THREAD_ERROR;
+        goto done;
+    }
+
+    // Open performance counters (closed by main after joining us, since it
+    // reads them)
+    if(perf_enabled && hashpipe_perf_open(&args->perf) == 0) {
+        hashpipe_warn(__FUNCTION__,
+                "no performance counters for %s", args->thread_desc->name);
+    }
+
+    // Record block latencies (NULL unless --latency)
+    hashpipe_latency_set_thread(args->latency);
+
     // Attach to status buffer
     if(hashpipe_status_attach(args->instance_id, &args->st) != HASHPIPE_OK) {
         hashpipe_error(__FUNCTION__,
@@ -194,7 +596,7 @@ hashpipe_thread_run(void *vp_args)
 
     // No more goto statements now that we're using pthread_cleanup_push!
     pthread_cleanup_push((void (*)(void *))hashpipe_status_detach, &args->st);
-    pthread_cleanup_push((void (*)(void *))set_exit_status, &args->st);
+    pthread_cleanup_push((void (*)(void *))set_exit_status, args);
 
     // Attach to data buffers
     if(args->thread_desc->ibuf_desc.create) {
@@ -231,9 +633,6 @@ hashpipe_thread_run(void *vp_args)
     hashpipe_thread_set_finished(args);
     pthread_cleanup_pop(0);
 
-    // User thread returned (or was not run), stop other threads
-    clear_run_threads();
-
     // Detach from output buffer
     if(hashpipe_databuf_detach(args->obuf)) {
         hashpipe_error(__FUNCTION__, "Error detaching from output databuf.");
@@ -259,10 +658,141 @@ hashpipe_thread_run(void *vp_args)
     pthread_cleanup_pop(0); // detach status
 
 done:
+    // Make sure launcher does not wait for us if we failed early
+    hashpipe_thread_set_finished(args);
+
+    // Let main decide what to do now that we are done (drain the pipeline,
+    // stop all threads, or restart us)
+    uint64_t one = 1;
+    if(write(thread_done_fd, &one, sizeof(one)) < 0) {
+        hashpipe_error(__FUNCTION__, "Error notifying main.");
+    }
 
     return rv;
 }
 
+// Restarts the thread of args (which has been joined)
+static int
+restart_thread(hashpipe_thread_args_t *args, pthread_t *thread)
+{
+    pthread_mutex_lock(&args->finished_m);
+    args->finished = 0;
+    args->ready = 0;
+    args->stop = 0;
+    pthread_mutex_unlock(&args->finished_m);
+    hashpipe_perf_close(&args->perf);
+
+    if(hashpipe_thread_init(args, 0)) {
+        return -1;
+    }
+    return pthread_create(thread, NULL, hashpipe_thread_run, (void *)args);
+}
+
+// Publishes the performance counter rates of each thread (see hashpipe_perf.h)
+// that changed at the precision they are published with
+static void
+publish_perf(hashpipe_status_t *st, hashpipe_thread_args_t *args, int n)
+{
+    static double published[MAX_HASHPIPE_THREADS][5];
+    static int have_published[MAX_HASHPIPE_THREADS];
+    hashpipe_perf_rates_t r;
+    double v[5];
+    char key[16];
+    int i;
+
+    for(i=0; i<n; i++) {
+        if(hashpipe_perf_sample(&args[i].perf, &r)) {
+            continue;
+        }
+#define ROUND(val, prec) ((val) >= 0 ? round((val) * 1e##prec) / 1e##prec : -1)
+        v[0] = ROUND(r.ipc, 3);
+        v[1] = ROUND(r.ghz, 3);
+        v[2] = ROUND(r.llc_mpki, 3);
+        v[3] = ROUND(r.csw_per_sec, 1);
+        v[4] = ROUND(r.cpu, 3);
+#undef ROUND
+        if(have_published[i] && !memcmp(v, published[i], sizeof(v))) {
+            continue;
+        }
+        memcpy(published[i], v, sizeof(v));
+        have_published[i] = 1;
+
+        hashpipe_status_lock_safe(st);
+#define PUT(name, val, prec) \
+        if((val) >= 0) { \
+            snprintf(key, sizeof(key), name "%d", i); \
+            hputnr8(st->buf, key, prec, val); \
+        }
+        PUT("PIPC", v[0], 3);
+        PUT("PGHZ", v[1], 3);
+        PUT("PMPK", v[2], 3);
+        PUT("PCSW", v[3], 1);
+        PUT("PCPU", v[4], 3);
+#undef PUT
+        hashpipe_status_unlock_safe(st);
+    }
+}
+
+// Publishes the block latencies of each thread and the end-to-end latency of
+// the pipeline recorded since the previous call (see hashpipe_latency.h)
+static void
+publish_latency(hashpipe_status_t *st, hashpipe_thread_args_t *args, int n)
+{
+    static uint64_t delta[HASHPIPE_LATENCY_NUM_BUCKETS];
+    static uint64_t e2e[HASHPIPE_LATENCY_NUM_BUCKETS];
+    hashpipe_latency_stats_t s;
+    uint64_t max, e2e_max = 0;
+    char key[24];
+    int i, b;
+
+    memset(e2e, 0, sizeof(e2e));
+    for(i=0; i<n; i++) {
+        if(!args[i].latency) {
+            continue;
+        }
+        hashpipe_status_lock_safe(st);
+#define PUT(name, val) \
+        snprintf(key, sizeof(key), name "%d", i); \
+        hputnr8(st->buf, key, 1, val);
+        memset(delta, 0, sizeof(delta));
+        max = 0;
+        hashpipe_latency_delta(&args[i].latency->stage, delta, &max);
+        if(hashpipe_latency_stats(delta, max, &s)) {
+            PUT("LS50", s.p50);
+            PUT("LS99", s.p99);
+            PUT("LSMX", s.max);
+        }
+        memset(delta, 0, sizeof(delta));
+        max = 0;
+        hashpipe_latency_delta(&args[i].latency->total, delta, &max);
+        if(hashpipe_latency_stats(delta, max, &s)) {
+            PUT("LT50", s.p50);
+            PUT("LT99", s.p99);
+            PUT("LTMX", s.max);
+        }
+#undef PUT
+        hashpipe_status_unlock_safe(st);
+
+        // Total latency of the last stages of the pipeline is end-to-end
+        if(args[i].num_output_buffers == 0) {
+            for(b=0; b<HASHPIPE_LATENCY_NUM_BUCKETS; b++) {
+                e2e[b] += delta[b];
+            }
+            if(max > e2e_max) {
+                e2e_max = max;
+            }
+        }
+    }
+
+    if(hashpipe_latency_stats(e2e, e2e_max, &s)) {
+        hashpipe_status_lock_safe(st);
+        hputnr8(st->buf, "LE2E50", 1, s.p50);
+        hputnr8(st->buf, "LE2E99", 1, s.p99);
+        hputnr8(st->buf, "LE2EMX", 1, s.max);
+        hashpipe_status_unlock_safe(st);
+    }
+}
+
 #define MAX_PLUGIN_NAME (1024)
 #define MAX_PLUGIN_EXT  (7)
 #define PLUGIN_EXT ".so"
@@ -280,6 +810,41 @@ int main(int argc, char *argv[])
     pthread_t threads[MAX_HASHPIPE_THREADS];
     struct hashpipe_thread_args args[MAX_HASHPIPE_THREADS];
     char plugin_name[MAX_PLUGIN_NAME+MAX_PLUGIN_EXT+1];
+    pthread_t history_thread;
+    pthread_t watchdog_thread;
+    hashpipe_watchdog_args_t watchdog_args = {.timeout = 0};
+    hashpipe_cmdq_t cmdq = {.shm = NULL};
+    const char *cmdq_names[MAX_HASHPIPE_THREADS];
+    unsigned long long log_dropped = 0;
+    double ready_timeout = 10.0;
+    int num_workers, w;
+    cpu_set_t stage_cpus;
+    int require_isolated = 0;
+    int lock_memory = 0;
+    int max_rtprio = 0;
+    cpu_set_t isolated_cpus;
+    int restart = RESTART_NEVER, max_restarts = 0;
+    int restart_policy[MAX_HASHPIPE_THREADS];
+    int restart_max[MAX_HASHPIPE_THREADS];
+    int restarts[MAX_HASHPIPE_THREADS];
+    int restart_pending[MAX_HASHPIPE_THREADS];
+    int joined[MAX_HASHPIPE_THREADS];
+    void *thread_rv;
+    sigset_t sigs;
+    struct sigaction sa;
+    struct itimerspec period = {{1, 0}, {1, 0}};
+    struct pollfd pfd[3];
+    uint64_t count;
+    int timer_fd;
+    char key[16];
+    int start_order[MAX_HASHPIPE_THREADS];
+    // Databufs given by --in/--out for the next thread
+    int in_ids[HASHPIPE_MAX_THREAD_DATABUFS], num_in = 0;
+    int out_ids[HASHPIPE_MAX_THREAD_DATABUFS], num_out = 0;
+    struct history_args history_args = {
+      .nkeys = 0,
+      .rate = 10
+    };
 
     static struct option long_opts[] = {
       {"help",     0, NULL, 'h'},
@@ -288,10 +853,24 @@ int main(int argc, char *argv[])
       {"instance", 1, NULL, 'I'},
       {"cpu",      1, NULL, 'c'},
       {"mask",     1, NULL, 'm'},
+      {"workers",  1, NULL, 'w'},
       {"option",   1, NULL, 'o'},
       {"plugin",   1, NULL, 'p'},
       {"version",  0, NULL, 'V'},
-//    {"buffer",   1, NULL, 'b'},
+      {"history",  1, NULL, 'H'},
+      {"history-rate", 1, NULL, 2},
+      {"buffer",   1, NULL, 'b'},
+      {"graph",    1, NULL, 'g'},
+      {"databuf",  1, NULL, 3},
+      {"in",       1, NULL, 4},
+      {"out",      1, NULL, 5},
+      {"perf",     0, NULL, 6},
+      {"latency",  0, NULL, 12},
+      {"sched",    1, NULL, 7},
+      {"isolated", 0, NULL, 8},
+      {"mlockall", 0, NULL, 9},
+      {"restart",  1, NULL, 10},
+      {"watchdog", 1, NULL, 11},
       {0,0,0,0}
     };
 
@@ -333,9 +912,14 @@ int main(int argc, char *argv[])
     args[num_threads].output_buffer = output_buffer;
     args[num_threads].user_data     = NULL;
 
+    // Splice the contents of pipeline graph files (-g) into the command line
+    if(!(argv = hashpipe_graph_expand_args(&argc, argv))) {
+      exit(1);
+    }
+
     // Parse command line.  Leading '-' means treat non-option arguments as if
     // it were the argument of an option with character code 1.
-    while((opt=getopt_long(argc,argv,"-hlK:I:m:c:b:o:p:V",long_opts,NULL))!=-1) {
+    while((opt=getopt_long(argc,argv,"-hlK:I:m:c:b:o:p:VH:w:",long_opts,NULL))!=-1) {
       switch (opt) {
         case 1:
           // optarg is name of thread
@@ -346,27 +930,131 @@ int main(int argc, char *argv[])
               exit(1);
           }
 
-          // Init thread
-          printf("initing  thread '%s' with databufs %d and %d\n",
-              args[num_threads].thread_desc->name, args[num_threads].input_buffer,
-              args[num_threads].output_buffer);
-
-          rv = hashpipe_thread_init(&args[num_threads]);
+          // Set databufs from --in/--out (if given)
+          if(num_in > 0) {
+            input_buffer = in_ids[0];
+            output_buffer = input_buffer + 1;
+          } else {
+            in_ids[num_in++] = input_buffer;
+          }
+          if(num_out > 0) {
+            output_buffer = out_ids[0];
+          } else if(args[num_threads].thread_desc->obuf_desc.create) {
+            out_ids[num_out++] = output_buffer;
+          }
+          args[num_threads].input_buffer  = input_buffer;
+          args[num_threads].output_buffer = output_buffer;
+          args[num_threads].num_input_buffers = num_in;
+          memcpy(args[num_threads].input_buffers, in_ids, sizeof(in_ids));
+          args[num_threads].num_output_buffers = num_out;
+          memcpy(args[num_threads].output_buffers, out_ids, sizeof(out_ids));
+          num_in = num_out = 0;
+
+          // Make sure CPUs are isolated if required
+          if(require_isolated) {
+            char cpulist[72];
+            if(hashpipe_isolated_cpus(&isolated_cpus)) {
+              fprintf(stderr, "Error getting isolated CPUs.\n");
+              exit(1);
+            }
+            CPU_AND(&isolated_cpus, &isolated_cpus, &args[num_threads].cpu_set);
+            if(CPU_COUNT(&args[num_threads].cpu_set) == 0
+            || !CPU_EQUAL(&isolated_cpus, &args[num_threads].cpu_set)) {
+              hashpipe_cpulist_format(&args[num_threads].cpu_set,
+                  cpulist, sizeof(cpulist));
+              fprintf(stderr, "CPUs '%s' of thread '%s' are not isolated.\n",
+                  cpulist, args[num_threads].thread_desc->name);
+              exit(1);
+            }
+            require_isolated = 0;
+          }
 
-          if (rv) {
-              fprintf(stderr, "Error initializing thread for '%s'.\n",
-                  args[num_threads].thread_desc->name);
-              fprintf(stderr, "Exiting.\n");
+          num_workers = args[num_threads].num_workers;
+          if(num_workers > 1 && !(args[num_threads].thread_desc->flags
+                & HASHPIPE_THREAD_WORKERS)) {
+            fprintf(stderr, "Thread '%s' cannot run as a pool of workers.\n",
+                args[num_threads].thread_desc->name);
+            exit(1);
+          }
+          if (num_threads + num_workers >= MAX_HASHPIPE_THREADS) {
+              fprintf(stderr, "Too many threads.\n");
               exit(1);
           }
 
-          printf("inited   thread '%s'\n",
-              args[num_threads].thread_desc->name);
+          // Each worker of the stage gets its own args (and pthread), but
+          // all of them share the stage's input and output databufs.  Workers
+          // may each get one of the CPUs given for the whole stage.
+          stage_cpus = args[num_threads].cpu_set;
+          for(w=0; w<num_workers; w++) {
+            if(w > 0) {
+              hashpipe_thread_args_init(&args[num_threads]);
+              args[num_threads].thread_desc   = args[num_threads-1].thread_desc;
+              args[num_threads].instance_id   = instance_id;
+              args[num_threads].input_buffer  = input_buffer;
+              args[num_threads].output_buffer = output_buffer;
+              args[num_threads].user_data     = NULL;
+              args[num_threads].num_workers   = num_workers;
+              args[num_threads].cpu_set       = stage_cpus;
+              args[num_threads].sched_policy  = args[num_threads-1].sched_policy;
+              args[num_threads].sched_priority = args[num_threads-1].sched_priority;
+              args[num_threads].num_input_buffers =
+                args[num_threads-1].num_input_buffers;
+              memcpy(args[num_threads].input_buffers,
+                  args[num_threads-1].input_buffers, sizeof(in_ids));
+              args[num_threads].num_output_buffers =
+                args[num_threads-1].num_output_buffers;
+              memcpy(args[num_threads].output_buffers,
+                  args[num_threads-1].output_buffers, sizeof(out_ids));
+            }
+            args[num_threads].worker_index = w;
+            restart_policy[num_threads] = restart;
+            restart_max[num_threads] = max_restarts;
+            restarts[num_threads] = 0;
+            restart_pending[num_threads] = 0;
+            joined[num_threads] = 0;
+
+            // Spread workers over CPUs if there are enough of them
+            if(num_workers > 1 && CPU_COUNT(&args[num_threads].cpu_set)
+                >= num_workers) {
+              cpu_set_t *cpus = &args[num_threads].cpu_set;
+              int cpu, n = 0;
+              for(cpu=0; cpu<CPU_SETSIZE; cpu++) {
+                if(CPU_ISSET(cpu, cpus) && n++ != w) {
+                  CPU_CLR(cpu, cpus);
+                }
+              }
+            }
+
+            // Init thread
+            printf("initing  thread '%s' with databufs %d and %d",
+                args[num_threads].thread_desc->name, args[num_threads].input_buffer,
+                args[num_threads].output_buffer);
+            if(num_workers > 1) {
+              printf(" (worker %d of %d)", w, num_workers);
+            }
+            printf("\n");
+
+            rv = hashpipe_thread_init(&args[num_threads], 1);
+
+            if (rv) {
+                fprintf(stderr, "Error initializing thread for '%s'.\n",
+                    args[num_threads].thread_desc->name);
+                fprintf(stderr, "Exiting.\n");
+                exit(1);
+            }
 
-          // Setup for next thread
-          num_threads++;
-          input_buffer++;
-          output_buffer++;
+            printf("inited   thread '%s'\n",
+                args[num_threads].thread_desc->name);
+
+            num_threads++;
+          }
+
+          restart = RESTART_NEVER;
+
+          // Setup for next thread (which by default reads this thread's
+          // first output databuf)
+          input_buffer = output_buffer;
+          output_buffer = input_buffer + 1;
           hashpipe_thread_args_init(&args[num_threads]);
           args[num_threads].instance_id   = instance_id;
           args[num_threads].input_buffer  = input_buffer;
@@ -374,6 +1062,14 @@ int main(int argc, char *argv[])
           args[num_threads].user_data     = NULL;
           break;
 
+        case 'w': // Number of workers for next thread
+          args[num_threads].num_workers = strtol(optarg, NULL, 0);
+          if(args[num_threads].num_workers < 1) {
+            fprintf(stderr, "Invalid number of workers '%s'.\n", optarg);
+            exit(1);
+          }
+          break;
+
         case 'h': // Help
           usage(argv[0]);
           return 0;
@@ -451,12 +1147,17 @@ int main(int argc, char *argv[])
           break;
 
         case 'm': // CPU mask
-          args[num_threads].cpu_mask = strtoul(optarg, NULL, 0);
+          if(hashpipe_cpumask_parse(optarg, &args[num_threads].cpu_set)) {
+            fprintf(stderr, "Invalid CPU mask '%s'.\n", optarg);
+            exit(1);
+          }
           break;
 
-        case 'c': // CPU number
-          i = strtol(optarg, NULL, 0);
-          args[num_threads].cpu_mask = (1<<i);
+        case 'c': // CPU number, list, or NUMA node
+          if(hashpipe_cpulist_parse(optarg, &args[num_threads].cpu_set)) {
+            fprintf(stderr, "Invalid CPU list '%s'.\n", optarg);
+            exit(1);
+          }
           break;
 
         case 'p': // Load plugin
@@ -494,6 +1195,87 @@ int main(int argc, char *argv[])
           }
           break;
 
+        case 'H': // History keys
+          // Keys are comma separated.  Modifies argv strings in place.
+          for(cp = strtok(optarg, ","); cp; cp = strtok(NULL, ",")) {
+            if(history_args.nkeys == HASHPIPE_HISTORY_MAX_KEYS) {
+              fprintf(stderr, "Too many history keys (max %d)\n",
+                  HASHPIPE_HISTORY_MAX_KEYS);
+              exit(1);
+            }
+            history_args.keys[history_args.nkeys++] = cp;
+          }
+          break;
+
+        case 2: // History sample rate
+          history_args.rate = strtod(optarg, NULL);
+          if(history_args.rate <= 0 || history_args.rate > 1000) {
+            fprintf(stderr, "Invalid history rate '%s'\n", optarg);
+            exit(1);
+          }
+          break;
+
+        case 6: // Performance counters
+          perf_enabled = 1;
+          break;
+
+        case 12: // Block latencies
+          latency_enabled = 1;
+          break;
+
+        case 7: // Scheduling policy and priority of next thread
+          if(hashpipe_sched_parse(optarg, &args[num_threads].sched_policy,
+                &args[num_threads].sched_priority)) {
+            fprintf(stderr, "Invalid scheduling policy '%s'.\n", optarg);
+            exit(1);
+          }
+          if((args[num_threads].sched_policy == SCHED_FIFO
+              || args[num_threads].sched_policy == SCHED_RR)
+          && args[num_threads].sched_priority > max_rtprio) {
+            max_rtprio = args[num_threads].sched_priority;
+          }
+          break;
+
+        case 8: // Require isolated CPUs for next thread
+          require_isolated = 1;
+          break;
+
+        case 9: // Lock memory
+          lock_memory = 1;
+          break;
+
+        case 10: // Restart policy of next thread
+          max_restarts = 10;
+          cp = strchr(optarg, ':');
+          if(cp) {
+            max_restarts = strtol(cp+1, &errptr, 0);
+            if(cp[1] == '\0' || *errptr || max_restarts < 1) {
+              fprintf(stderr, "Invalid restart count '%s'.\n", cp+1);
+              exit(1);
+            }
+          } else {
+            cp = optarg + strlen(optarg);
+          }
+          if(!strncmp(optarg, "always", cp-optarg) && cp-optarg == 6) {
+            restart = RESTART_ALWAYS;
+          } else if(!strncmp(optarg, "on-failure", cp-optarg)
+              && cp-optarg == 10) {
+            restart = RESTART_ON_FAILURE;
+          } else if(!strncmp(optarg, "never", cp-optarg) && cp-optarg == 5) {
+            restart = RESTART_NEVER;
+          } else {
+            fprintf(stderr, "Invalid restart policy '%s'.\n", optarg);
+            exit(1);
+          }
+          break;
+
+        case 11: // Watchdog
+          if(hashpipe_watchdog_parse(optarg, &watchdog_args)) {
+            fprintf(stderr, "Invalid watchdog '%s'.\n", optarg);
+            exit(1);
+          }
+          break;
+
         case 'V': // Show version
           printf("%s\n", HASHPIPE_VERSION);
           return 0;
@@ -501,7 +1283,40 @@ int main(int argc, char *argv[])
 
         case 'b': // Set buffer
           // "-b B" jumps to input buffer B, output buffer B+1
-          // TODO
+          input_buffer = strtol(optarg, &errptr, 0);
+          if(*errptr || input_buffer < 0
+          || input_buffer >= HASHPIPE_GRAPH_MAX_DATABUF) {
+            fprintf(stderr, "Invalid databuf '%s'.\n", optarg);
+            exit(1);
+          }
+          output_buffer = input_buffer + 1;
+          args[num_threads].input_buffer  = input_buffer;
+          args[num_threads].output_buffer = output_buffer;
+          break;
+
+        case 'g': // Graph files are read by hashpipe_graph_expand_args()
+          break;
+
+        case 3: // Databuf name (and NUMA node)
+          if(hashpipe_graph_define_databuf(optarg)) {
+            exit(1);
+          }
+          break;
+
+        case 4: // Input databufs of next thread
+          num_in = hashpipe_graph_parse_databufs(optarg, in_ids,
+              HASHPIPE_MAX_THREAD_DATABUFS);
+          if(num_in < 0) {
+            exit(1);
+          }
+          break;
+
+        case 5: // Output databufs of next thread
+          num_out = hashpipe_graph_parse_databufs(optarg, out_ids,
+              HASHPIPE_MAX_THREAD_DATABUFS);
+          if(num_out < 0) {
+            exit(1);
+          }
           break;
 
         case '?': // Command line parsing error
@@ -511,6 +1326,28 @@ int main(int argc, char *argv[])
       }
     }
 
+    // Allow the requested real-time priorities (raising the hard limit works
+    // only while we still have setuid privileges)
+    if(max_rtprio > 0) {
+      getrlimit(RLIMIT_RTPRIO, &rlim);
+      if(rlim.rlim_max != RLIM_INFINITY && rlim.rlim_max < max_rtprio) {
+        rlim.rlim_max = max_rtprio;
+      }
+      rlim.rlim_cur = rlim.rlim_max;
+      if(setrlimit(RLIMIT_RTPRIO, &rlim)) {
+        getrlimit(RLIMIT_RTPRIO, &rlim);
+        rlim.rlim_cur = rlim.rlim_max;
+        setrlimit(RLIMIT_RTPRIO, &rlim);
+      }
+    }
+
+    // Lock current (e.g. databufs) and future (e.g. thread stacks) memory
+    if(lock_memory && mlockall(MCL_CURRENT | MCL_FUTURE)) {
+      hashpipe_error(__FILE__, "Error locking memory (mlockall): %s",
+          strerror(errno));
+      exit(1);
+    }
+
     // Drop setuid privileges permanently
     if(setuid(getuid())) {
       hashpipe_error(__FILE__,
@@ -525,6 +1362,16 @@ int main(int argc, char *argv[])
       return 1;
     }
 
+    // Make sure every databuf has one producer and one consumer (pool)
+    if(hashpipe_graph_check(args, num_threads)) {
+      exit(1);
+    }
+    // Start consumers before their producers
+    if(hashpipe_graph_start_order(args, num_threads, start_order)) {
+      fprintf(stderr,
+          "Pipeline graph has a cycle, starting threads in reverse order.\n");
+    }
+
     setvbuf(stdout, NULL, _IOLBF, 0);
     setvbuf(stderr, NULL, _IONBF, 0);
 
@@ -532,13 +1379,79 @@ int main(int argc, char *argv[])
     fprintf(stderr, "sed '\n");
 #endif
 
-    // Catch INT and TERM signals
-    signal(SIGINT, cc);
-    signal(SIGTERM, cc);
+    // Create command queue with one ring per thread (in pipeline order)
+    if(num_threads <= HASHPIPE_CMDQ_MAX_RINGS) {
+      for(i=0; i<num_threads; i++) {
+        cmdq_names[i] = args[i].thread_desc->name;
+      }
+      if(hashpipe_cmdq_create(instance_id, &cmdq, cmdq_names, num_threads)) {
+        fprintf(stderr, "Error creating command queue (continuing).\n");
+      } else {
+        for(i=0; i<num_threads; i++) {
+          args[i].cmdq_ring = i;
+        }
+      }
+    }
+
+    // Record events of all threads for post-mortem analysis (the trace
+    // segment is left behind when we exit)
+    if(hashpipe_trace_create(instance_id, 0)) {
+      fprintf(stderr, "Error creating event trace (continuing).\n");
+    }
+
+    // How long to wait for the pipeline to drain on shutdown
+    if((cp = getenv("HASHPIPE_DRAIN_TIMEOUT"))) {
+      drain_timeout = strtod(cp, NULL);
+    }
+
+    // Handle INT and TERM signals in main via signal_fd.  Block them before
+    // starting threads so that every pipeline thread inherits the blocked
+    // signals.  Threads created earlier pass the signals on via cc().
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    signal_fd = signalfd(-1, &sigs, SFD_NONBLOCK | SFD_CLOEXEC);
+    thread_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(signal_fd < 0 || thread_done_fd < 0 || timer_fd < 0) {
+      perror("signalfd/eventfd/timerfd");
+      exit(1);
+    }
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = cc;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    // Interrupts blocking calls (no SA_RESTART) of threads at shutdown
+    sa.sa_handler = interrupt;
+    sigaction(SIGRTMIN, &sa, NULL);
+
+    // Keep logging from stalling pipeline threads (unless told otherwise)
+    if(!getenv("HASHPIPE_LOG_SYNC") && hashpipe_log_async(1)) {
+      fprintf(stderr, "Error starting asynchronous logging (using stderr).\n");
+    }
     set_run_threads();
 
-    // Start threads in reverse order
-    for(i=num_threads-1; i >= 0; i--) {
+    // How long to wait for each thread to become ready
+    if((cp = getenv("HASHPIPE_READY_TIMEOUT"))) {
+      ready_timeout = strtod(cp, NULL);
+    }
+
+    // Allocate block latency histograms (freed after joining threads)
+    if(latency_enabled) {
+      for(i=0; i<num_threads; i++) {
+        args[i].latency = calloc(1, sizeof(hashpipe_latency_t));
+        if(!args[i].latency) {
+          fprintf(stderr, "Error allocating latency histograms.\n");
+          exit(1);
+        }
+      }
+    }
+
+    // Start threads downstream first (i.e. in reverse order for a linear
+    // pipeline)
+    for(w=0; w < num_threads; w++) {
+      i = start_order[w];
 
       // Launch thread
       printf("starting thread '%s' with databufs %d and %d\n",
@@ -552,28 +1465,211 @@ int main(int argc, char *argv[])
           exit(1);
       }
 
-      sleep(3);
+      // Wait for thread to be ready before starting its upstream neighbor
+      rv = hashpipe_thread_wait_ready(&args[i], ready_timeout);
+      if(rv == 0) {
+        fprintf(stderr, "Thread '%s' not ready after %g seconds (continuing).\n",
+            args[i].thread_desc->name, ready_timeout);
+      } else if(rv < 0) {
+        fprintf(stderr, "Thread '%s' exited during startup.\n",
+            args[i].thread_desc->name);
+      }
+    }
+
+    // Start status history thread, if requested
+    if(history_args.nkeys > 0) {
+      history_args.instance_id = instance_id;
+      rv = pthread_create(&history_thread, NULL,
+          history_thread_run, (void *)&history_args);
+      if (rv) {
+          fprintf(stderr, "Error creating status history thread.\n");
+          exit(1);
+      }
+    }
+
+    // Start watchdog thread, if requested
+    if(watchdog_args.timeout > 0) {
+      watchdog_args.args = args;
+      watchdog_args.num_threads = num_threads;
+      rv = pthread_create(&watchdog_thread, NULL,
+          hashpipe_watchdog_run, (void *)&watchdog_args);
+      if (rv) {
+          fprintf(stderr, "Error creating watchdog thread.\n");
+          exit(1);
+      }
+    }
+
+    // Attach to status buffer for publishing lock statistics
+    if(hashpipe_status_attach(instance_id, &st) != HASHPIPE_OK) {
+      fprintf(stderr,
+          "Error connecting to status buffer instance %d.\n", instance_id);
+      exit(1);
     }
 
-    /* Wait for SIGINT (i.e. control-c) or SIGTERM (aka "kill <pid>") */
-    while (run_threads()) {
-        sleep(1);
+    // Report effective CPU affinity of each thread (in command line order)
+    for(i=0; i<num_threads; i++) {
+      cpu_set_t cpuset;
+      char key[16];
+      char cpulist[72];
+      if(pthread_getaffinity_np(threads[i], sizeof(cpuset), &cpuset) == 0) {
+        hashpipe_cpulist_format(&cpuset, cpulist, sizeof(cpulist));
+        snprintf(key, sizeof(key), "CPUS%d", i);
+        hashpipe_status_lock_safe(&st);
+        hputs(st.buf, key, cpulist);
+        hashpipe_status_unlock_safe(&st);
+      }
+    }
+
+    // Supervise threads until SIGINT (i.e. control-c) or SIGTERM (aka "kill
+    // <pid>") or until a thread finishes (and is not restarted)
+    pfd[0].fd = signal_fd;
+    pfd[1].fd = thread_done_fd;
+    pfd[2].fd = timer_fd;
+    for(i=0; i<3; i++) {
+      pfd[i].events = POLLIN;
+    }
+    timerfd_settime(timer_fd, 0, &period, NULL);
+    while (run_threads() && !shutdown_requested) {
+      if(poll(pfd, 3, -1) < 0) {
+        if(errno == EINTR) {
+          continue;
+        }
+        perror("poll");
+        clear_run_threads();
+        break;
+      }
+
+      if(pfd[0].revents & POLLIN) {
+        handle_signals();
+      }
+
+      if(pfd[1].revents & POLLIN) {
+        // Some thread(s) finished (or a stray signal arrived)
+        if(read(thread_done_fd, &count, sizeof(count)) < 0) {
+          // Reading just resets the counter
+        }
+        if(handle_signals()) {
+          continue;
+        }
+        for(i=0; i<num_threads && run_threads(); i++) {
+          if(joined[i] || !hashpipe_thread_finished(&args[i], 0)) {
+            continue;
+          }
+          pthread_join(threads[i], &thread_rv);
+          joined[i] = 1;
+          if(restart_policy[i] == RESTART_ALWAYS
+          || (restart_policy[i] == RESTART_ON_FAILURE
+              && thread_rv != THREAD_OK)) {
+            if(restarts[i] < restart_max[i]) {
+              // Restart on next tick (so failing threads restart at most
+              // once per second)
+              hashpipe_warn(__FILE__, "thread '%s' %s, restarting it",
+                  args[i].thread_desc->name,
+                  thread_rv == THREAD_OK ? "exited" : "failed");
+              restart_pending[i] = 1;
+              continue;
+            }
+            errno = 0;
+            hashpipe_error(__FILE__, "thread '%s' restarted too often",
+                args[i].thread_desc->name);
+          }
+          if(thread_rv == THREAD_OK && drain_timeout > 0) {
+            // Thread is done, let the others finish
+            shutdown_requested = 1;
+          } else {
+            // Thread failed (or draining is disabled), stop all threads
+            clear_run_threads();
+          }
+        }
+      }
+
+      if(!(pfd[2].revents & POLLIN)) {
+        continue;
+      }
+      if(read(timer_fd, &count, sizeof(count)) < 0) {
+        // Reading just resets the timer
+      }
+
+      // Restart threads
+      for(i=0; i<num_threads && run_threads() && !shutdown_requested; i++) {
+        if(!restart_pending[i]) {
+          continue;
+        }
+        restart_pending[i] = 0;
+        restarts[i]++;
+        if(restart_thread(&args[i], &threads[i])) {
+          hashpipe_error(__FILE__, "Error restarting thread '%s'",
+              args[i].thread_desc->name);
+          clear_run_threads();
+          break;
+        }
+        joined[i] = 0;
+        snprintf(key, sizeof(key), "REST%d", i);
+        hashpipe_status_lock_safe(&st);
+        hputi4(st.buf, key, restarts[i]);
+        hashpipe_status_unlock_safe(&st);
+      }
+
+      // Publish statistics
+      hashpipe_status_publish_lock_stats(&st);
+      hashpipe_trace_calibrate();
+      if(perf_enabled) {
+        publish_perf(&st, args, num_threads);
+      }
+      if(latency_enabled) {
+        publish_latency(&st, args, num_threads);
+      }
+      if(log_dropped != hashpipe_log_dropped()) {
+        log_dropped = hashpipe_log_dropped();
+        hashpipe_status_lock_safe(&st);
+        hputu8(st.buf, "LOGDROP", log_dropped);
+        hashpipe_status_unlock_safe(&st);
+      }
+    }
+
+    if(history_args.nkeys > 0) {
+      pthread_cancel(history_thread);
+      pthread_join(history_thread, NULL);
+    }
+
+    // Threads stop one by one while draining, so stop watching them
+    if(watchdog_args.timeout > 0) {
+      pthread_cancel(watchdog_thread);
+      pthread_join(watchdog_thread, NULL);
+    }
+
+    // Let in-flight blocks make their way through the pipeline
+    if(run_threads()) {
+      drain_threads(args, num_threads, start_order);
+      clear_run_threads();
     }
 
     for(i=num_threads-1; i>=0; i--) {
-      pthread_cancel(threads[i]);
+      if(!joined[i]) {
+        pthread_cancel(threads[i]);
+      }
     }
     for(i=num_threads-1; i>=0; i--) {
-      pthread_kill(threads[i], SIGINT);
+      if(!joined[i]) {
+        pthread_kill(threads[i], SIGRTMIN);
+      }
     }
     for(i=num_threads-1; i>=0; i--) {
-      pthread_join(threads[i], NULL);
+      if(!joined[i]) {
+        pthread_join(threads[i], NULL);
+      }
       printf("Joined thread '%s'\n", args[i].thread_desc->name);
       fflush(stdout);
     }
     for(i=num_threads; i>=0; i--) {
+      hashpipe_perf_close(&args[i].perf);
+      free(args[i].latency);
       hashpipe_thread_args_destroy(&args[i]);
     }
 
+    if(cmdq.shm) {
+      hashpipe_cmdq_detach(&cmdq, 1);
+    }
+
     exit(0);
 }
@@ -2,10 +2,15 @@
 #define _HASHPIPE_H
 
 #include <stdio.h>
+#include <sched.h>
 
 #include "hashpipe_error.h"
 #include "hashpipe_databuf.h"
 #include "hashpipe_status.h"
+#include "hashpipe_cmdq.h"
+#include "hashpipe_trace.h"
+#include "hashpipe_perf.h"
+#include "hashpipe_latency.h"
 #include "hashpipe_pktsock.h"
 #include "hashpipe_udp.h"
 
@@ -72,6 +77,7 @@ typedef struct hashpipe_thread_desc hashpipe_thread_desc_t;
 //   run  - A pointer to the thread's run function
 //   ibuf - A structure describing the thread's input data buffer (if any)
 //   obuf - A structure describing the thread's output data buffer (if any)
+//   flags - HASHPIPE_THREAD_* flags (0 if none)
 //
 // "name" is used to match command line thread spcifiers to thread metadata so
 // that the pipeline can be constructed as specified on the command line.
@@ -105,6 +111,14 @@ typedef struct hashpipe_thread_desc hashpipe_thread_desc_t;
 // The create function must have the following signature:
 //
 //   hashpipe_databuf_t * my_create_function(int instance_id, int databuf_id)
+//
+// "flags" is a bitwise OR of these flags:
+//
+//   HASHPIPE_THREAD_WORKERS - The thread can run as a pool of workers (see
+//                             hashpipe_worker_first_seq()).  hashpipe refuses
+//                             "-w N" with N > 1 for threads without it.
+//
+// Plugins compiled against headers without the flags field must be rebuilt.
 
 // These typedefs are used to declare pointers to a pipeline thread's init and
 // run functions.
@@ -129,8 +143,15 @@ struct hashpipe_thread_desc {
   runfunc_t run;
   databuf_desc_t ibuf_desc;
   databuf_desc_t obuf_desc;
+  unsigned int flags;
 };
 
+// Flags of hashpipe_thread_desc
+#define HASHPIPE_THREAD_WORKERS 0x1 // Thread can run as a pool of workers
+
+// Maximum number of input (or output) databufs of one thread
+#define HASHPIPE_MAX_THREAD_DATABUFS 8
+
 // This structure passed (via a pointer) to the application's thread
 // initialization and run functions.  The `user_data` field can be used to pass
 // info from the init function to the run function.
@@ -139,13 +160,32 @@ struct hashpipe_thread_args {
     int instance_id;
     int input_buffer;
     int output_buffer;
-    unsigned int cpu_mask; // 0 means use inherited
+    cpu_set_t cpu_set; // Empty means use inherited
+    int sched_policy;   // Scheduling policy (-1 means use inherited)
+    int sched_priority; // Real-time priority or nice level (see --sched)
+    int worker_index;  // Index of this worker (0 to num_workers-1)
+    int num_workers;   // Number of workers running this thread (see -w)
+    // All input/output databufs of this thread (the first ones are
+    // input_buffer and output_buffer).  Threads have more than one only when
+    // given by --in/--out (e.g. in a pipeline graph file).
+    int num_input_buffers;
+    int input_buffers[HASHPIPE_MAX_THREAD_DATABUFS];
+    int num_output_buffers;
+    int output_buffers[HASHPIPE_MAX_THREAD_DATABUFS];
     int finished;
+    int ready; // Set by hashpipe_thread_ready()
+    int stop;  // Set by hashpipe_thread_stop() (makes run_threads() false)
+    int tid;   // Linux thread ID
+    uint64_t heartbeat; // Incremented by hashpipe_thread_heartbeat()
+    int waiting;        // Non-zero while waiting for a databuf block
     pthread_cond_t finished_c;
     pthread_mutex_t finished_m;
     hashpipe_status_t st;
     hashpipe_databuf_t *ibuf;
     hashpipe_databuf_t *obuf;
+    hashpipe_perf_t perf; // Performance counters (see hashpipe --perf)
+    hashpipe_latency_t *latency; // Block latencies (see hashpipe --latency)
+    int cmdq_ring; // This thread's command queue ring (-1 if none)
     void *user_data;
 };
 
@@ -156,9 +196,69 @@ struct hashpipe_thread_args {
 // Maximum number of threads that be defined by plugins
 #define MAX_HASHPIPE_THREADS 1024
 
-// Function threads use to determine whether to keep running.
+// Function threads use to determine whether to keep running.  The first call
+// from a pipeline thread also signals that the thread is ready (see
+// hashpipe_thread_ready()).
+//
+// On SIGINT/SIGTERM (or when a thread returns THREAD_OK) the pipeline is
+// drained: hashpipe makes run_threads() return false for the threads without
+// upstream neighbors first, then for each downstream thread once the blocks
+// in its input databufs have been consumed (i.e. marked free), and finally
+// cancels any threads still running.  Threads that wait for filled blocks in
+// a loop should therefore check run_threads() when the wait times out.  The
+// whole drain takes at most HASHPIPE_DRAIN_TIMEOUT seconds (environment
+// variable, default 10, 0 to stop all threads at once as older versions did).
+// A second SIGINT stops all threads immediately.  Threads run with the
+// "--restart" option are restarted (i.e. their init and run functions are
+// called again) instead of ending the pipeline when they exit or fail.
 int run_threads();
 
+// Pipeline threads are started one at a time, in reverse order, and the next
+// thread is started as soon as the current one is ready (or has exited, or
+// has not become ready after HASHPIPE_READY_TIMEOUT seconds).  A thread is
+// ready once its run function has finished its setup (e.g. opening sockets),
+// which is assumed to be when it first calls run_threads().  Run functions
+// that do lengthy work before (or without) calling run_threads() can call
+// hashpipe_thread_ready() to signal readiness explicitly.  Calling it more
+// than once, or from non-pipeline threads, is harmless.
+void hashpipe_thread_ready();
+
+// A thread that sets HASHPIPE_THREAD_WORKERS in its hashpipe_thread_desc
+// flags can be run as a pool of workers (hashpipe "-w N" option).  Each
+// worker is a separate pthread with its own args (and user_data), but all
+// workers share the thread's input and output databufs.  Blocks are handed
+// out round-robin by sequence number: the worker with worker_index i handles
+// blocks with sequence numbers i, i+N, i+2N, ..., where block sequence number
+// s lives in block s % n_block of a databuf (so the number of blocks of each
+// of the thread's databufs must be a multiple of N).  A worker that writes
+// block s of its output databuf for block s of its input databuf keeps blocks
+// in order for the downstream thread, which waits for the blocks in sequence
+// no matter which worker finishes first.  A worker aware thread loops like this:
+//
+//   uint64_t seq;
+//   for(seq = hashpipe_worker_first_seq(args); run_threads();
+//       seq = hashpipe_worker_next_seq(args, seq)) {
+//     int block = seq % db->n_block;
+//     ...
+//   }
+//
+// Threads that are not run with -w have worker_index 0 and num_workers 1, so
+// the loop above visits every block.
+uint64_t hashpipe_worker_first_seq(const hashpipe_thread_args_t *args);
+uint64_t hashpipe_worker_next_seq(const hashpipe_thread_args_t *args,
+        uint64_t seq);
+
+// Lets the hashpipe watchdog (see hashpipe --watchdog) know that the calling
+// pipeline thread is alive.  run_threads() and the databuf wait and set
+// functions call it (with waiting non-zero while waiting for a block), so
+// threads only need to call it themselves during work that takes longer than
+// the watchdog timeout without calling those.
+void hashpipe_thread_heartbeat(int waiting);
+
+// Tells the hashpipe_thread_ready() machinery which pipeline thread the
+// calling thread is.  Used by the hashpipe executable.
+void hashpipe_thread_set_args(hashpipe_thread_args_t *args);
+
 // This function is used by pipeline plugins to register threads with the
 // pipeline executable.
 int register_hashpipe_thread(hashpipe_thread_desc_t * ptm);
@@ -174,10 +274,39 @@ hashpipe_thread_desc_t * find_hashpipe_thread(char *name);
 // List all known hashpipe threads to FILE f.
 void list_hashpipe_threads(FILE * f);
 
-// Get CPU affinity of calling thread
+// Get CPU affinity of calling thread as a mask of CPUs 0 to 31
 // Returns 0 on error
 unsigned int get_cpu_affinity();
 
+// Parse a CPU list like "0-3,8,64-71", "0-15:2" (every other CPU), or
+// "node:1" (all CPUs of NUMA node 1) into set.  List elements can be mixed
+// (e.g. "node:0,192").  Returns 0 on success, -1 on a syntax error or
+// unknown node.
+int hashpipe_cpulist_parse(const char *s, cpu_set_t *set);
+
+// Parse a CPU mask into set.  Masks starting with "0x" can be any number of
+// hex digits long (commas are ignored, so /proc style masks work), others are
+// taken as a decimal (or octal) number.  Returns 0 on success, -1 on error.
+int hashpipe_cpumask_parse(const char *s, cpu_set_t *set);
+
+// Store the CPUs of NUMA node in set.  Returns 0 on success, -1 if there is
+// no such node.
+int hashpipe_node_cpus(int node, cpu_set_t *set);
+
+// Format set as a CPU list (e.g. "0-3,8") into buf of length size.  Returns
+// buf.
+char *hashpipe_cpulist_format(const cpu_set_t *set, char *buf, size_t size);
+
+// Store the CPUs isolated from the scheduler (isolcpus kernel parameter) in
+// set.  Returns 0 on success (even if no CPUs are isolated), -1 on error.
+int hashpipe_isolated_cpus(cpu_set_t *set);
+
+// Parse a scheduling policy like "fifo:50" into policy and priority.  Policies
+// are "fifo" and "rr" (real-time, with optional priority that defaults to the
+// lowest), "other" and "batch" (with optional nice level that defaults to 0),
+// and "idle".  Returns 0 on success, -1 on error.
+int hashpipe_sched_parse(const char *s, int *policy, int *priority);
+
 #ifdef __cplusplus
 }
 #endif
@@ -4,16 +4,22 @@
  */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
 #include <getopt.h>
 
 #include "fitshead.h"
 #include "hashpipe_error.h"
 #include "hashpipe_status.h"
+#include "hashpipe_history.h"
+#include "hashpipe_cmdq.h"
 #include "hashpipe_ipckey.h"
 
 static void usage() { 
     printf(
-        "Usage: hashpipe_check_status [options]\n"
+        "Usage: hashpipe_check_status [options] [KEY ...]\n"
         "General options:\n"
         "  -h,     --help         Show this message\n"
         "  -K KEY, --shmkey=KEY   Specify key for shared memory\n"
@@ -24,12 +30,27 @@ static void usage() {
         "Query options:\n"
         "  -Q KEY, --query=KEY    Query string value of KEY\n"
         "  -g KEY, --get=KEY      Query double value of KEY\n"
+        "  -w KEY, --watch=KEY    Print string value of KEY whenever it changes\n"
+        "  -r KEY, --rate=KEY     Print rate, min, and max of KEY from history\n"
+        "                         (needs hashpipe --history=KEY)\n"
+        "  -t SEC, --window=SEC   Time window for subsequent -r options [1]\n"
+        "  -o FMT, --dump=FMT     Dump all keys (or just the KEYs given as\n"
+        "                         non-option arguments) in FMT format, either\n"
+        "                         \"json\" or \"kv\" (KEY=VALUE lines)\n"
+        "  -F SEC, --follow=SEC   After dumping, check for changes every SEC\n"
+        "                         seconds and dump only the changed keys\n"
         "Update options:\n"
         "  -k KEY, --key=KEY      Specify KEY to be updated\n"
         "  -s VAL, --string=VAL   Update key with string value VAL\n"
         "  -f VAL, --float=VAL    Update key with float value VAL\n"
         "  -d VAL, --double=VAL   Update key with double value VAL\n"
         "  -i VAL, --int=VAL      Update key with int value VAL\n"
+        "Command options:\n"
+        "  -T THR, --thread=THR   Specify thread (name or index) for commands\n"
+        "  -a SEQ, --at=SEQ       Apply subsequent commands at sequence SEQ\n"
+        "                         (meaning defined by thread) [0 = ASAP]\n"
+        "  -x CMD, --command=CMD  Send CMD to thread's command queue\n"
+        "                         (needs to follow -T THR)\n"
         "Delete options:\n"
         "  -C,     --clear        Remove all key/value pairs\n"
         "  -D,     --del          Delete KEY and its value\n"
@@ -59,6 +80,275 @@ static hashpipe_status_t *get_status_buffer(int instance_id)
     return &s;
 }
 
+/* Prints the string value of key every time it changes.  Runs until killed. */
+static void watch_key(hashpipe_status_t *s, const char *key)
+{
+    int rv;
+    int found;
+    int last_found = -1;
+    char value[81];
+    char last_value[81] = {0};
+    uint32_t gen = hashpipe_status_key_generation(s, key);
+    // Wake up periodically (mainly to allow for polling if s has no control
+    // block)
+    const struct timespec timeout = {0, 250000000};
+
+    while(1) {
+        memset(value, 0, sizeof(value));
+        hashpipe_status_lock(s);
+        found = hgets(s->buf, key, 80, value);
+        hashpipe_status_unlock(s);
+
+        // Keys that hash to the same generation counter can cause spurious
+        // wakeups, so only print if something really changed.
+        if(found != last_found || strcmp(value, last_value)) {
+            if(found) {
+                printf("%s\n", value);
+            } else {
+                printf("%s not found\n", key);
+            }
+            fflush(stdout);
+            last_found = found;
+            strcpy(last_value, value);
+        }
+
+        rv = hashpipe_status_wait_key_change(s, key, &gen, &timeout);
+        if(rv == HASHPIPE_ERR_GEN) {
+            // No control block, fall back to polling
+            nanosleep(&timeout, NULL);
+        } else if(rv != HASHPIPE_OK && rv != HASHPIPE_TIMEOUT) {
+            break;
+        }
+    }
+}
+
+/* Send cmd to command queue ring of thread at sequence number seq */
+static int send_command(int instance_id, const char *thread, const char *cmd,
+        uint64_t seq)
+{
+    hashpipe_cmdq_t q;
+    int ring, rv;
+
+    if(hashpipe_cmdq_attach(instance_id, &q) != HASHPIPE_OK) {
+        fprintf(stderr, "no command queue for instance %d\n", instance_id);
+        return 1;
+    }
+    if((ring = hashpipe_cmdq_find(&q, thread)) < 0) {
+        fprintf(stderr, "no command queue for thread %s\n", thread);
+        hashpipe_cmdq_detach(&q, 0);
+        return 1;
+    }
+    rv = hashpipe_cmdq_send(&q, ring, cmd, seq);
+    hashpipe_cmdq_detach(&q, 0);
+    if(rv == HASHPIPE_TIMEOUT) {
+        fprintf(stderr, "command queue for thread %s is full\n", thread);
+        return 1;
+    } else if(rv != HASHPIPE_OK) {
+        fprintf(stderr, "invalid command '%s'\n", cmd);
+        return 1;
+    }
+    return 0;
+}
+
+/* Print rate, min, and max of key over the last window seconds */
+static int print_history_stats(int instance_id, const char *key,
+        double window)
+{
+    hashpipe_history_t h;
+    double rate, min, max;
+    int n;
+
+    if(hashpipe_history_attach(instance_id, &h) != HASHPIPE_OK) {
+        fprintf(stderr, "no status history for instance %d\n", instance_id);
+        return 1;
+    }
+    n = hashpipe_history_stats(&h, key, window, &rate, &min, &max);
+    hashpipe_history_detach(&h, 0);
+    if(n == HASHPIPE_ERR_KEY) {
+        fprintf(stderr, "no status history for key %s\n", key);
+        return 1;
+    } else if(n < 2) {
+        fprintf(stderr, "not enough status history for key %s\n", key);
+        return 1;
+    }
+    printf("%g %g %g\n", rate, min, max);
+    return 0;
+}
+
+enum dump_format {DUMP_NONE, DUMP_JSON, DUMP_KV};
+
+/* Returns non-zero if s is a valid JSON number */
+static int is_json_number(const char *s)
+{
+    if(*s == '-') s++;
+    if(*s == '0') {
+        s++;
+    } else if(isdigit(*s)) {
+        while(isdigit(*s)) s++;
+    } else {
+        return 0;
+    }
+    if(*s == '.') {
+        if(!isdigit(*++s)) return 0;
+        while(isdigit(*s)) s++;
+    }
+    if(*s == 'e' || *s == 'E') {
+        s++;
+        if(*s == '+' || *s == '-') s++;
+        if(!isdigit(*s)) return 0;
+        while(isdigit(*s)) s++;
+    }
+    return *s == '\0';
+}
+
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for(; *s; s++) {
+        if(*s == '"' || *s == '\\') {
+            printf("\\%c", *s);
+        } else if((unsigned char)*s < 0x20) {
+            printf("\\u%04x", *s);
+        } else {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+/* Prints one key/value pair.  A NULL card means the key was deleted. */
+static void dump_card(enum dump_format fmt, int first, const char *key,
+        const char *card)
+{
+    char value[81];
+    int is_string = card ? hashpipe_status_card_value(card, value) : 0;
+
+    if(fmt == DUMP_KV) {
+        if(card) {
+            printf("%s=%s\n", key, value);
+        } else {
+            printf("%s\n", key);
+        }
+        return;
+    }
+
+    printf("%s", first ? "{" : ", ");
+    print_json_string(key);
+    printf(": ");
+    if(!card) {
+        printf("null");
+    } else if(is_string) {
+        print_json_string(value);
+    } else if(!strcmp(value, "T") || !strcmp(value, "F")) {
+        printf("%s", value[0] == 'T' ? "true" : "false");
+    } else if(is_json_number(value)) {
+        printf("%s", value);
+    } else {
+        print_json_string(value);
+    }
+}
+
+/* Returns non-zero if key should be dumped */
+static int dump_selected(const char *key, char **keys, int nkeys)
+{
+    int i;
+    if(nkeys == 0) {
+        return 1;
+    }
+    for(i=0; i<nkeys; i++) {
+        if(!strncasecmp(key, keys[i], 8)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* State passed to dump_change() */
+struct dump_state {
+    enum dump_format fmt;
+    char **keys;
+    int nkeys;
+    int n;
+};
+
+/* hashpipe_status_snapshot_changes() callback */
+static void dump_change(const char *key, const char *card, void *data)
+{
+    struct dump_state *d = (struct dump_state *)data;
+    if(dump_selected(key, d->keys, d->nkeys)) {
+        dump_card(d->fmt, d->n++ == 0, key, card);
+    }
+}
+
+/* Dumps the selected keys of cur (all keys if nkeys is 0) that differ from
+ * prev (all of them if prev is NULL).  Returns the number of keys dumped.
+ */
+static int dump_changes(enum dump_format fmt, char **keys, int nkeys,
+        const hashpipe_status_snapshot_t *cur,
+        const hashpipe_status_snapshot_t *prev)
+{
+    struct dump_state d = {fmt, keys, nkeys, 0};
+
+    hashpipe_status_snapshot_changes(cur, prev, dump_change, &d);
+
+    if(fmt == DUMP_JSON && (d.n > 0 || !prev)) {
+        printf("%s\n", d.n > 0 ? "}" : "{}");
+    } else if(fmt == DUMP_KV && d.n > 0 && prev) {
+        // Blank line ends each batch of changes
+        printf("\n");
+    }
+    fflush(stdout);
+
+    return d.n;
+}
+
+/* Dumps the selected keys (all keys if nkeys is 0) from a single snapshot of
+ * the status buffer.  If follow > 0, then takes a new snapshot every follow
+ * seconds and dumps keys that have been added, changed, or deleted (deleted
+ * keys are dumped as null in JSON format or as just KEY in KV format).  Runs
+ * until killed when following.
+ */
+static int dump_status(hashpipe_status_t *s, enum dump_format fmt,
+        char **keys, int nkeys, double follow)
+{
+    hashpipe_status_snapshot_t snap[2];
+    struct timespec interval;
+    uint32_t gen;
+    int cur = 0;
+
+    memset(snap, 0, sizeof(snap));
+    if(hashpipe_status_snapshot(s, &snap[cur]) != HASHPIPE_OK) {
+        return 1;
+    }
+    dump_changes(fmt, keys, nkeys, &snap[cur], NULL);
+
+    if(follow > 0) {
+        interval.tv_sec = (time_t)follow;
+        interval.tv_nsec = (long)((follow - interval.tv_sec) * 1e9);
+        while(1) {
+            nanosleep(&interval, NULL);
+            // Start the next snapshot from the same generation as the current
+            // one so that it is only copied if something changed.
+            gen = snap[cur].generation;
+            cur ^= 1;
+            snap[cur].generation = gen;
+            if(hashpipe_status_snapshot(s, &snap[cur]) != HASHPIPE_OK) {
+                break;
+            }
+            if(snap[cur].generation == gen && s->ctrl) {
+                // Nothing changed, keep the current snapshot
+                cur ^= 1;
+                continue;
+            }
+            dump_changes(fmt, keys, nkeys, &snap[cur], &snap[cur^1]);
+        }
+    }
+
+    hashpipe_status_snapshot_free(&snap[0]);
+    hashpipe_status_snapshot_free(&snap[1]);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
 
     int instance_id = 0;
@@ -80,6 +370,14 @@ int main(int argc, char *argv[]) {
         {"clear",  0, NULL, 'C'},
         {"del",    0, NULL, 'D'},
         {"query",  1, NULL, 'Q'},
+        {"watch",  1, NULL, 'w'},
+        {"rate",   1, NULL, 'r'},
+        {"window", 1, NULL, 't'},
+        {"dump",   1, NULL, 'o'},
+        {"follow", 1, NULL, 'F'},
+        {"thread", 1, NULL, 'T'},
+        {"at",     1, NULL, 'a'},
+        {"command",1, NULL, 'x'},
         {"instance", 1, NULL, 'I'},
         {0,0,0,0}
     };
@@ -90,12 +388,17 @@ int main(int argc, char *argv[]) {
     double dbltmp;
     int inttmp;
     int verbose=0, clear=0;
+    double window=1.0;
+    enum dump_format dump=DUMP_NONE;
+    double follow=0.0;
+    char *thread=NULL;
+    uint64_t seq=HASHPIPE_CMDQ_NOW;
     int show_lock=0;
     int lock_value=0;
     int show_skmkey=0;
     key_t shmkey = 0;
     char keyfile[1000];
-    while ((opt=getopt_long(argc,argv,"hk:g:s:f:d:i:vCDQ:K:LSI:",long_opts,&opti))!=-1) {
+    while ((opt=getopt_long(argc,argv,"hk:g:s:f:d:i:vCDQ:w:r:t:o:F:T:a:x:K:LSI:",long_opts,&opti))!=-1) {
         switch (opt) {
             case 'K': // Keyfile
                 snprintf(keyfile, sizeof(keyfile), "HASHPIPE_KEYFILE=%s", optarg);
@@ -123,6 +426,46 @@ int main(int argc, char *argv[]) {
                 hashpipe_status_unlock(s);
                 printf("%g\n", dbltmp);
                 break;
+            case 'w':
+                s = get_status_buffer(instance_id);
+                watch_key(s, optarg);
+                break;
+            case 'r':
+                if(print_history_stats(instance_id, optarg, window)) {
+                    exit(1);
+                }
+                break;
+            case 't':
+                window = atof(optarg);
+                break;
+            case 'o':
+                if(!strcasecmp(optarg, "json")) {
+                    dump = DUMP_JSON;
+                } else if(!strcasecmp(optarg, "kv")) {
+                    dump = DUMP_KV;
+                } else {
+                    fprintf(stderr, "unknown dump format '%s'\n", optarg);
+                    exit(1);
+                }
+                break;
+            case 'F':
+                follow = atof(optarg);
+                break;
+            case 'T':
+                thread = optarg;
+                break;
+            case 'a':
+                seq = strtoull(optarg, NULL, 0);
+                break;
+            case 'x':
+                if (thread) {
+                    if(send_command(instance_id, thread, optarg, seq)) {
+                        exit(1);
+                    }
+                } else {
+                    fprintf(stderr, "no thread specified\n");
+                }
+                break;
             case 'L':
                 show_lock = 1;
                 break;
@@ -230,14 +573,38 @@ int main(int argc, char *argv[]) {
               shmkey, -lock_value);
         }
       }
+      if(s->ctrl) {
+        if(lock_value < 1) {
+          if(s->ctrl->holder_pid) {
+            printf("held by '%s' pid %u tid %u\n", s->ctrl->last_name,
+                s->ctrl->holder_pid, s->ctrl->last_tid);
+          } else {
+            printf("held by unknown process\n");
+          }
+        }
+        printf("last holder '%s' pid %u tid %u\n", s->ctrl->last_name,
+            s->ctrl->last_pid, s->ctrl->last_tid);
+        printf("acquisitions %llu, total wait %.6f s, max wait %.6f s, "
+            "max hold %.6f s, timeouts %u, recoveries %u\n",
+            (unsigned long long)s->ctrl->lock_count,
+            s->ctrl->lock_wait_ns / 1e9, s->ctrl->lock_wait_max_ns / 1e9,
+            s->ctrl->lock_hold_max_ns / 1e9, s->ctrl->lock_timeouts,
+            s->ctrl->lock_recoveries);
+      }
       return 0;
     }
 
+    if (dump != DUMP_NONE) {
+        return dump_status(s, dump, argv+optind, argc-optind, follow);
+    }
+
     /* If verbose, print out buffer */
     if (verbose) { 
-        hashpipe_status_lock(s);
-        printf("%s\n", s->buf);
-        hashpipe_status_unlock(s);
+        hashpipe_status_snapshot_t snap = {0};
+        if(hashpipe_status_snapshot(s, &snap) == HASHPIPE_OK) {
+            printf("%s\n", snap.buf);
+        }
+        hashpipe_status_snapshot_free(&snap);
     }
 
     if (clear) 
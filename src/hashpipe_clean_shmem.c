@@ -14,6 +14,9 @@
 
 #include "hashpipe_error.h"
 #include "hashpipe_status.h"
+#include "hashpipe_history.h"
+#include "hashpipe_cmdq.h"
+#include "hashpipe_trace.h"
 #include "hashpipe_databuf.h"
 
 void usage() {
@@ -106,6 +109,14 @@ int main(int argc, char *argv[]) {
           perror("sem_unlink");
           ex|=2;
       }
+      // Delete status history (if any)
+      hashpipe_history_t h = {.instance_id = instance_id, .ring = NULL};
+      hashpipe_history_detach(&h, 1);
+      // Delete command queue (if any)
+      hashpipe_cmdq_t q = {.instance_id = instance_id, .shm = NULL};
+      hashpipe_cmdq_detach(&q, 1);
+      // Delete event trace (if any)
+      hashpipe_trace_unlink(instance_id);
       switch(ex) {
         case 0:
           printf("Deleted status shared memory and semaphore.\n");
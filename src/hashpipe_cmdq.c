@@ -0,0 +1,334 @@
+/* hashpipe_cmdq.c
+ *
+ * Implementation of the command queue routines described
+ * in hashpipe_cmdq.h
+ */
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "hashpipe_cmdq.h"
+#include "hashpipe_status.h"
+#include "hashpipe_error.h"
+#include "hashpipe_futex.h"
+
+// How long producers wait for a full ring or a busy producer lock
+#define HASHPIPE_CMDQ_SEND_TIMEOUT_NS 100000000LL
+
+int hashpipe_cmdq_name(int instance_id, char * name, size_t size)
+{
+    if(hashpipe_status_semname(instance_id, name, size)) {
+        return 1;
+    }
+    if(strlen(name) + strlen("_cmdq") + 1 > size) {
+        return 1;
+    }
+    strcat(name, "_cmdq");
+    return 0;
+}
+
+static size_t hashpipe_cmdq_size(int nrings)
+{
+    return sizeof(hashpipe_cmdq_shm_t) + nrings * sizeof(hashpipe_cmdq_ring_t);
+}
+
+int hashpipe_cmdq_create(int instance_id, hashpipe_cmdq_t *q,
+        const char **names, int nrings)
+{
+    char name[NAME_MAX] = {'\0'};
+    int i, fd;
+
+    if(nrings < 1 || nrings > HASHPIPE_CMDQ_MAX_RINGS) {
+        hashpipe_error(__FUNCTION__, "invalid number of rings %d", nrings);
+        return HASHPIPE_ERR_PARAM;
+    }
+
+    instance_id &= 0x3f;
+    q->instance_id = instance_id;
+    q->size = hashpipe_cmdq_size(nrings);
+    q->shm = NULL;
+
+    if(hashpipe_cmdq_name(instance_id, name, NAME_MAX)) {
+        hashpipe_error(__FUNCTION__, "command queue name truncated");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    // Start from scratch so that stale commands from a previous run are not
+    // delivered to the new threads.
+    shm_unlink(name);
+    mode_t old_umask = umask(0);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    umask(old_umask);
+    if(fd == -1) {
+        hashpipe_error(__FUNCTION__, "shm_open %s", name);
+        return HASHPIPE_ERR_SYS;
+    }
+    if(ftruncate(fd, q->size)) {
+        hashpipe_error(__FUNCTION__, "ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return HASHPIPE_ERR_SYS;
+    }
+    q->shm = mmap(NULL, q->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(q->shm == MAP_FAILED) {
+        hashpipe_error(__FUNCTION__, "mmap");
+        q->shm = NULL;
+        shm_unlink(name);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    // New shared memory objects are zero filled
+    q->shm->version = HASHPIPE_CMDQ_VERSION;
+    q->shm->nrings = nrings;
+    for(i=0; i<nrings; i++) {
+        strncpy(q->shm->ring[i].name, names[i],
+                sizeof(q->shm->ring[i].name)-1);
+    }
+    __atomic_store_n(&q->shm->magic, HASHPIPE_CMDQ_MAGIC, __ATOMIC_RELEASE);
+
+    return HASHPIPE_OK;
+}
+
+int hashpipe_cmdq_attach(int instance_id, hashpipe_cmdq_t *q)
+{
+    char name[NAME_MAX] = {'\0'};
+    struct stat st;
+    int fd;
+
+    instance_id &= 0x3f;
+    q->instance_id = instance_id;
+    q->size = 0;
+    q->shm = NULL;
+
+    if(hashpipe_cmdq_name(instance_id, name, NAME_MAX)) {
+        hashpipe_error(__FUNCTION__, "command queue name truncated");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    fd = shm_open(name, O_RDWR, 0);
+    if(fd == -1) {
+        return errno == ENOENT ? HASHPIPE_ERR_KEY : HASHPIPE_ERR_SYS;
+    }
+    if(fstat(fd, &st) || st.st_size < sizeof(hashpipe_cmdq_shm_t)) {
+        close(fd);
+        return HASHPIPE_ERR_KEY;
+    }
+    q->size = st.st_size;
+    q->shm = mmap(NULL, q->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(q->shm == MAP_FAILED) {
+        hashpipe_error(__FUNCTION__, "mmap");
+        q->shm = NULL;
+        return HASHPIPE_ERR_SYS;
+    }
+
+    // Make sure the queue is initialized and matches our idea of its layout
+    if(__atomic_load_n(&q->shm->magic, __ATOMIC_ACQUIRE) != HASHPIPE_CMDQ_MAGIC
+    || q->shm->version != HASHPIPE_CMDQ_VERSION
+    || q->size < hashpipe_cmdq_size(q->shm->nrings)) {
+        hashpipe_cmdq_detach(q, 0);
+        return HASHPIPE_ERR_KEY;
+    }
+
+    return HASHPIPE_OK;
+}
+
+int hashpipe_cmdq_detach(hashpipe_cmdq_t *q, int unlink)
+{
+    char name[NAME_MAX] = {'\0'};
+
+    if(q->shm) {
+        munmap(q->shm, q->size);
+        q->shm = NULL;
+    }
+    if(unlink) {
+        hashpipe_cmdq_name(q->instance_id, name, NAME_MAX);
+        if(shm_unlink(name) && errno != ENOENT) {
+            hashpipe_error(__FUNCTION__, "shm_unlink %s", name);
+            return HASHPIPE_ERR_SYS;
+        }
+    }
+    return HASHPIPE_OK;
+}
+
+int hashpipe_cmdq_find(hashpipe_cmdq_t *q, const char *name)
+{
+    char *end;
+    long i;
+
+    if(!q->shm) {
+        return -1;
+    }
+    i = strtol(name, &end, 10);
+    if(*name && !*end) {
+        return i >= 0 && i < q->shm->nrings ? i : -1;
+    }
+    for(i=0; i<q->shm->nrings; i++) {
+        if(!strncmp(q->shm->ring[i].name, name,
+                    sizeof(q->shm->ring[i].name))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Returns ring of q or NULL if ring is invalid */
+static hashpipe_cmdq_ring_t *get_ring(hashpipe_cmdq_t *q, int ring)
+{
+    if(!q->shm || ring < 0 || ring >= q->shm->nrings) {
+        return NULL;
+    }
+    return &q->shm->ring[ring];
+}
+
+/* Acquire producer lock of r.  A lock held by a process that no longer
+ * exists is taken over.  Returns 0 on success.
+ */
+static int producer_lock(hashpipe_cmdq_ring_t *r, int64_t deadline)
+{
+    const struct timespec ts = {0, 100000};
+    uint32_t me = getpid();
+    uint32_t holder;
+
+    while(1) {
+        holder = 0;
+        if(__atomic_compare_exchange_n(&r->producer_lock, &holder, me, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+        if(kill(holder, 0) == -1 && errno == ESRCH
+        && __atomic_compare_exchange_n(&r->producer_lock, &holder, me, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return 0;
+        }
+        if(monotonic_ns() > deadline) {
+            return -1;
+        }
+        nanosleep(&ts, NULL);
+    }
+}
+
+int hashpipe_cmdq_send(hashpipe_cmdq_t *q, int ring, const char *cmd,
+        uint64_t seq)
+{
+    const struct timespec ts = {0, 1000000};
+    hashpipe_cmdq_ring_t *r = get_ring(q, ring);
+    int64_t deadline = monotonic_ns() + HASHPIPE_CMDQ_SEND_TIMEOUT_NS;
+    struct timespec now;
+    hashpipe_cmd_t *c;
+    uint32_t tail;
+
+    if(!r || !cmd || strlen(cmd) >= HASHPIPE_CMDQ_CMD_SIZE) {
+        return HASHPIPE_ERR_PARAM;
+    }
+
+    if(producer_lock(r, deadline)) {
+        return HASHPIPE_TIMEOUT;
+    }
+
+    // Wait (briefly) for room
+    tail = r->tail;
+    while(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE)
+            >= HASHPIPE_CMDQ_DEPTH) {
+        if(monotonic_ns() > deadline) {
+            __atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->producer_lock, 0, __ATOMIC_RELEASE);
+            return HASHPIPE_TIMEOUT;
+        }
+        nanosleep(&ts, NULL);
+    }
+
+    // Fill in command, then publish it
+    c = &r->cmd[tail % HASHPIPE_CMDQ_DEPTH];
+    clock_gettime(CLOCK_REALTIME, &now);
+    c->seq = seq;
+    c->time_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    strcpy(c->cmd, cmd);
+    __atomic_store_n(&r->tail, tail+1, __ATOMIC_RELEASE);
+    __atomic_store_n(&r->producer_lock, 0, __ATOMIC_RELEASE);
+
+    futex_wake_all(&r->tail);
+
+    return HASHPIPE_OK;
+}
+
+int hashpipe_cmdq_next(hashpipe_cmdq_t *q, int ring, uint64_t seq,
+        hashpipe_cmd_t *cmd)
+{
+    hashpipe_cmdq_ring_t *r = get_ring(q, ring);
+    hashpipe_cmd_t *c;
+    uint32_t head;
+
+    if(!r) {
+        return 0;
+    }
+    head = r->head;
+    if(head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    c = &r->cmd[head % HASHPIPE_CMDQ_DEPTH];
+    if(c->seq != HASHPIPE_CMDQ_NOW && c->seq > seq) {
+        return 0;
+    }
+    memcpy(cmd, c, sizeof(hashpipe_cmd_t));
+    __atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+int hashpipe_cmdq_pending(hashpipe_cmdq_t *q, int ring)
+{
+    hashpipe_cmdq_ring_t *r = get_ring(q, ring);
+    if(!r) {
+        return 0;
+    }
+    return __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - r->head;
+}
+
+int hashpipe_cmdq_wait(hashpipe_cmdq_t *q, int ring,
+        const struct timespec *timeout)
+{
+    hashpipe_cmdq_ring_t *r = get_ring(q, ring);
+    int64_t deadline = 0, remaining;
+    struct timespec ts;
+    uint32_t tail;
+
+    if(!r) {
+        return HASHPIPE_ERR_PARAM;
+    }
+    if(timeout) {
+        deadline = monotonic_ns()
+            + timeout->tv_sec * 1000000000LL + timeout->tv_nsec;
+    }
+
+    while((tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) == r->head) {
+        if(timeout) {
+            remaining = deadline - monotonic_ns();
+            if(remaining <= 0) {
+                return HASHPIPE_TIMEOUT;
+            }
+            ts.tv_sec = remaining / 1000000000LL;
+            ts.tv_nsec = remaining % 1000000000LL;
+        }
+        if(futex_wait(&r->tail, tail, timeout ? &ts : NULL) == -1) {
+            if(errno == EINTR) {
+                return HASHPIPE_ERR_SYS;
+            } else if(errno != EAGAIN && errno != ETIMEDOUT) {
+                hashpipe_error(__FUNCTION__, "futex wait error");
+                return HASHPIPE_ERR_SYS;
+            }
+        }
+    }
+
+    return HASHPIPE_OK;
+}
@@ -0,0 +1,155 @@
+/* hashpipe_cmdq.h
+ *
+ * Routines dealing with the hashpipe command queue shared memory segment.
+ * The command queue segment holds one ring of commands per pipeline thread.
+ * Commands are short strings (e.g. "KEY=VALUE") that are delivered to a
+ * thread in order.  Each command can be tagged with the sequence number
+ * (e.g. block or packet sequence number, as defined by the receiving thread)
+ * at which it is to be applied.  Threads drain their ring at convenient
+ * points (e.g. block boundaries) without locking anything, and can
+ * optionally sleep until a command arrives.
+ *
+ * The hashpipe executable creates one ring per thread (in command line
+ * order) before starting the threads and passes the index of a thread's ring
+ * in its args->cmdq_ring (-1 if there is no command queue).  Each worker of
+ * a thread run with "-w" has its own ring (hashpipe_cmdq_find() finds the
+ * first worker's ring).  A thread typically does this:
+ *
+ *   hashpipe_cmdq_t q;
+ *   hashpipe_cmd_t cmd;
+ *   int ring = -1;
+ *   if(args->cmdq_ring >= 0
+ *   && hashpipe_cmdq_attach(args->instance_id, &q) == HASHPIPE_OK) {
+ *       ring = args->cmdq_ring;
+ *   }
+ *   ...
+ *   // Once per block
+ *   while(hashpipe_cmdq_next(&q, ring, block_seq, &cmd)) {
+ *       // Apply cmd.cmd
+ *   }
+ *
+ * The rings are single-consumer, multi-producer rings, not lock-free SPSC
+ * rings: each ring has a single consumer (its thread), which never locks, but
+ * producers (e.g. "hashpipe_check_status -T THREAD -x CMD") serialize among
+ * themselves with a per-ring producer lock that the consumer never touches.
+ */
+#ifndef _HASHPIPE_CMDQ_H
+#define _HASHPIPE_CMDQ_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define HASHPIPE_CMDQ_MAGIC 0x48504351 // "HPCQ"
+#define HASHPIPE_CMDQ_VERSION 1
+#define HASHPIPE_CMDQ_DEPTH 64       // Commands per ring (power of 2)
+#define HASHPIPE_CMDQ_MAX_RINGS 64   // Maximum number of rings
+#define HASHPIPE_CMDQ_CMD_SIZE 112   // Maximum command length plus NUL
+#define HASHPIPE_CMDQ_NOW 0          // Sequence number meaning "ASAP"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Structure describes one command (lives in shared memory) */
+typedef struct {
+    uint64_t seq;      /* Apply at sequence number (or HASHPIPE_CMDQ_NOW) */
+    int64_t time_ns;   /* CLOCK_REALTIME time command was sent */
+    char cmd[HASHPIPE_CMDQ_CMD_SIZE]; /* NUL terminated command string */
+} hashpipe_cmd_t;
+
+/* Structure describes one command ring (lives in shared memory).  Commands
+ * head through tail-1 (modulo HASHPIPE_CMDQ_DEPTH) are pending.  Only the
+ * consumer writes head, only producers holding producer_lock write tail.
+ */
+typedef struct {
+    char name[32];          /* Name of thread that consumes this ring */
+    uint32_t head __attribute__((aligned(64))); /* Next command to consume */
+    uint32_t tail __attribute__((aligned(64))); /* Next free slot (futex) */
+    uint32_t producer_lock; /* PID of producer holding lock (0 if none) */
+    uint32_t dropped;       /* Number of commands rejected (ring full) */
+    hashpipe_cmd_t cmd[HASHPIPE_CMDQ_DEPTH];
+} hashpipe_cmdq_ring_t;
+
+/* Structure describes command queue segment header (lives in shared
+ * memory).  The rings follow the header.
+ */
+typedef struct {
+    uint32_t magic;   /* HASHPIPE_CMDQ_MAGIC once initialized */
+    uint32_t version; /* HASHPIPE_CMDQ_VERSION */
+    uint32_t nrings;  /* Number of rings */
+    uint32_t pad;
+    hashpipe_cmdq_ring_t ring[];
+} hashpipe_cmdq_shm_t;
+
+/* Structure describes command queue shared memory area */
+typedef struct {
+    int instance_id;  /* Instance ID of this command queue */
+    size_t size;      /* Size of mapping in bytes */
+    hashpipe_cmdq_shm_t *shm; /* Pointer to mapping */
+} hashpipe_cmdq_t;
+
+/*
+ * Stores the hashpipe command queue (POSIX) shared memory object name in name
+ * buffer of length size.  The name is the hashpipe status semaphore name (see
+ * hashpipe_status_semname()) with "_cmdq" appended.  Returns 0 (no error) if
+ * the name fit in given size, returns 1 if the name is truncated.
+ */
+int hashpipe_cmdq_name(int instance_id, char * name, size_t size);
+
+/* Create (or re-create) the command queue for instance_id with one ring for
+ * each of the nrings thread names in names.  Any existing command queue for
+ * instance_id is discarded.  Returns HASHPIPE_OK on success.
+ */
+int hashpipe_cmdq_create(int instance_id, hashpipe_cmdq_t *q,
+        const char **names, int nrings);
+
+/* Attach to an existing command queue.  Returns HASHPIPE_OK on success or
+ * HASHPIPE_ERR_KEY if there is no command queue for instance_id.
+ */
+int hashpipe_cmdq_attach(int instance_id, hashpipe_cmdq_t *q);
+
+/* Detach from (and, if unlink is non-zero, remove) the command queue */
+int hashpipe_cmdq_detach(hashpipe_cmdq_t *q, int unlink);
+
+/* Returns the index of the ring for thread name, or -1 if there is none.  If
+ * name is a decimal number less than the number of rings, it is taken as the
+ * ring index (useful when a pipeline has several threads of the same name).
+ */
+int hashpipe_cmdq_find(hashpipe_cmdq_t *q, const char *name);
+
+/* Send command cmd to ring, to be applied at sequence number seq (or
+ * HASHPIPE_CMDQ_NOW).  Wakes up the consumer if it is waiting.  Returns
+ * HASHPIPE_OK on success, HASHPIPE_TIMEOUT if the ring is full or another
+ * producer holds the ring's producer lock for too long, or HASHPIPE_ERR_PARAM
+ * if ring or cmd is invalid.
+ */
+int hashpipe_cmdq_send(hashpipe_cmdq_t *q, int ring, const char *cmd,
+        uint64_t seq);
+
+/* Consumer functions.  Only the thread that owns ring may call these.
+ *
+ * hashpipe_cmdq_next() copies the oldest pending command of ring to *cmd and
+ * removes it from the ring if it is due at sequence number seq (i.e. its seq
+ * is HASHPIPE_CMDQ_NOW or less than or equal to seq).  Returns 1 if a command
+ * was copied, 0 if none is due.  Commands are always delivered in the order
+ * they were sent, so a command that is not yet due holds back the ones
+ * behind it.  This is cheap enough to call once per block or packet.
+ *
+ * hashpipe_cmdq_pending() returns the number of pending commands of ring.
+ *
+ * hashpipe_cmdq_wait() sleeps until ring has at least one pending command or
+ * timeout (NULL means forever) expires.  Returns HASHPIPE_OK if a command is
+ * pending, HASHPIPE_TIMEOUT on timeout, or HASHPIPE_ERR_SYS if interrupted by
+ * a signal.
+ */
+int hashpipe_cmdq_next(hashpipe_cmdq_t *q, int ring, uint64_t seq,
+        hashpipe_cmd_t *cmd);
+int hashpipe_cmdq_pending(hashpipe_cmdq_t *q, int ring);
+int hashpipe_cmdq_wait(hashpipe_cmdq_t *q, int ring,
+        const struct timespec *timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _HASHPIPE_CMDQ_H
@@ -20,6 +20,12 @@
 #include "hashpipe_status.h"
 #include "hashpipe_databuf.h"
 #include "hashpipe_error.h"
+#include "hashpipe_trace.h"
+#include "hashpipe_latency.h"
+#include "hashpipe.h"
+
+// Number of blocks of each databuf (by id) marked free by this process
+static uint64_t blocks_freed[HASHPIPE_TRACE_MAX_DATABUFS];
 
 /* These defines are missing in Ubuntu 16.04 <sys/shm.h>, but can be found in
  * /usr/src/linux-headers-4.4.0-67/include/linux/shm.h
@@ -179,6 +185,8 @@ hashpipe_databuf_t *hashpipe_databuf_create(int instance_id,
     }
     free(arg.array);
 
+    hashpipe_trace_databuf(databuf_id, d->semid);
+
     return d;
 }
 
@@ -236,6 +244,8 @@ hashpipe_databuf_t *hashpipe_databuf_attach(int instance_id, int databuf_id)
         return NULL;
     }
 
+    hashpipe_trace_databuf(databuf_id, d->semid);
+
     return d;
 
 }
@@ -284,12 +294,18 @@ uint64_t hashpipe_databuf_total_mask(hashpipe_databuf_t *d)
 int hashpipe_databuf_wait_free_timeout(hashpipe_databuf_t *d, int block_id,
     struct timespec *timeout)
 {
-    int rv;
+    int rv, id;
     struct sembuf op;
     op.sem_num = block_id;
     op.sem_op = 0;
     op.sem_flg = 0;
+    id = hashpipe_trace_databuf_id(d->semid);
+    hashpipe_trace(HASHPIPE_TRACE_WAIT_FREE_BEGIN, id, block_id);
+    hashpipe_thread_heartbeat(1);
     rv = semtimedop(d->semid, &op, 1, timeout);
+    hashpipe_thread_heartbeat(0);
+    hashpipe_trace(HASHPIPE_TRACE_WAIT_FREE_END, id,
+            rv ? block_id | HASHPIPE_TRACE_FAILED : block_id);
     if (rv==-1) {
         if (errno==EAGAIN) {
 #ifdef HASHPIPE_TRACE
@@ -304,6 +320,7 @@ int hashpipe_databuf_wait_free_timeout(hashpipe_databuf_t *d, int block_id,
         perror("semop");
         return HASHPIPE_ERR_SYS;
     }
+    hashpipe_latency_got_free(d, id, block_id);
     return 0;
 }
 
@@ -317,7 +334,7 @@ int hashpipe_databuf_wait_free(hashpipe_databuf_t *d, int block_id)
 
 int hashpipe_databuf_busywait_free(hashpipe_databuf_t *d, int block_id)
 {
-    int rv;
+    int rv, id;
     struct sembuf op;
     op.sem_num = block_id;
     op.sem_op = 0;
@@ -325,9 +342,15 @@ int hashpipe_databuf_busywait_free(hashpipe_databuf_t *d, int block_id)
     //struct timespec timeout;
     //timeout.tv_sec = 0;
     //timeout.tv_nsec = 250000000;
+    id = hashpipe_trace_databuf_id(d->semid);
+    hashpipe_trace(HASHPIPE_TRACE_WAIT_FREE_BEGIN, id, block_id);
+    hashpipe_thread_heartbeat(1);
     do {
       rv = semop(d->semid, &op, 1);
     } while(rv == -1 && errno == EAGAIN);
+    hashpipe_thread_heartbeat(0);
+    hashpipe_trace(HASHPIPE_TRACE_WAIT_FREE_END, id,
+            rv ? block_id | HASHPIPE_TRACE_FAILED : block_id);
     if (rv==-1) { 
         // Don't complain on a signal interruption
         if (errno==EINTR) return HASHPIPE_ERR_SYS;
@@ -335,6 +358,7 @@ int hashpipe_databuf_busywait_free(hashpipe_databuf_t *d, int block_id)
         perror("semop");
         return HASHPIPE_ERR_SYS;
     }
+    hashpipe_latency_got_free(d, id, block_id);
     return 0;
 }
 
@@ -348,13 +372,19 @@ int hashpipe_databuf_wait_filled_timeout(hashpipe_databuf_t *d, int block_id,
      * step 1: wait for val=1 then decrement (semop=-1)
      * step 2: increment by 1 (semop=1)
      */
-    int rv;
+    int rv, id;
     struct sembuf op[2];
     op[0].sem_num = op[1].sem_num = block_id;
     op[0].sem_flg = op[1].sem_flg = 0;
     op[0].sem_op = -1;
     op[1].sem_op = 1;
+    id = hashpipe_trace_databuf_id(d->semid);
+    hashpipe_trace(HASHPIPE_TRACE_WAIT_FILLED_BEGIN, id, block_id);
+    hashpipe_thread_heartbeat(1);
     rv = semtimedop(d->semid, op, 2, timeout);
+    hashpipe_thread_heartbeat(0);
+    hashpipe_trace(HASHPIPE_TRACE_WAIT_FILLED_END, id,
+            rv ? block_id | HASHPIPE_TRACE_FAILED : block_id);
     if (rv==-1) {
         if (errno==EAGAIN) return HASHPIPE_TIMEOUT;
         // Don't complain on a signal interruption
@@ -363,6 +393,7 @@ int hashpipe_databuf_wait_filled_timeout(hashpipe_databuf_t *d, int block_id,
         perror("semop");
         return HASHPIPE_ERR_SYS;
     }
+    hashpipe_latency_got_filled(d, id, block_id);
     return 0;
 }
 
@@ -385,7 +416,7 @@ int hashpipe_databuf_busywait_filled(hashpipe_databuf_t *d, int block_id)
      * step 1: wait for val=1 then decrement (semop=-1)
      * step 2: increment by 1 (semop=1)
      */
-    int rv;
+    int rv, id;
     struct sembuf op[2];
     op[0].sem_num = op[1].sem_num = block_id;
     op[0].sem_flg = IPC_NOWAIT;
@@ -395,9 +426,15 @@ int hashpipe_databuf_busywait_filled(hashpipe_databuf_t *d, int block_id)
     //struct timespec timeout;
     //timeout.tv_sec = 0;
     //timeout.tv_nsec = 250000000;
+    id = hashpipe_trace_databuf_id(d->semid);
+    hashpipe_trace(HASHPIPE_TRACE_WAIT_FILLED_BEGIN, id, block_id);
+    hashpipe_thread_heartbeat(1);
     do {
       rv = semop(d->semid, op, 2);
     } while(rv == -1 && errno == EAGAIN);
+    hashpipe_thread_heartbeat(0);
+    hashpipe_trace(HASHPIPE_TRACE_WAIT_FILLED_END, id,
+            rv ? block_id | HASHPIPE_TRACE_FAILED : block_id);
     if (rv==-1) { 
         // Don't complain on a signal interruption
         if (errno==EINTR) return HASHPIPE_ERR_SYS;
@@ -405,19 +442,36 @@ int hashpipe_databuf_busywait_filled(hashpipe_databuf_t *d, int block_id)
         perror("semop");
         return HASHPIPE_ERR_SYS;
     }
+    hashpipe_latency_got_filled(d, id, block_id);
     return 0;
 }
 
+uint64_t hashpipe_databuf_freed(int databuf_id)
+{
+    if(databuf_id <= 0 || databuf_id >= HASHPIPE_TRACE_MAX_DATABUFS) {
+        return 0;
+    }
+    return __atomic_load_n(&blocks_freed[databuf_id], __ATOMIC_RELAXED);
+}
+
 int hashpipe_databuf_set_free(hashpipe_databuf_t *d, int block_id)
 {
     /* This function should always succeed regardless of the current
      * state of the specified databuf.  So we use semctl (not semop) to set
      * the value to zero.
      */
-    int rv;
+    int rv, id;
     union semun arg;
     arg.val = 0;
+    id = hashpipe_trace_databuf_id(d->semid);
+    // Before the block can be reused
+    hashpipe_latency_set_free(d, id, block_id);
     rv = semctl(d->semid, block_id, SETVAL, arg);
+    hashpipe_trace(HASHPIPE_TRACE_SET_FREE, id, block_id);
+    hashpipe_thread_heartbeat(0);
+    if(id > 0) {
+        __atomic_add_fetch(&blocks_freed[id], 1, __ATOMIC_RELAXED);
+    }
 #ifdef HASHPIPE_TRACE
     printf("after %s(%p, %d) %016lx\n",
         __FUNCTION__, d, block_id, hashpipe_databuf_total_mask(d));
@@ -435,10 +489,15 @@ int hashpipe_databuf_set_filled(hashpipe_databuf_t *d, int block_id)
      * state of the specified databuf.  So we use semctl (not semop) to set
      * the value to one.
      */
-    int rv;
+    int rv, id;
     union semun arg;
     arg.val = 1;
+    id = hashpipe_trace_databuf_id(d->semid);
+    // Before the block can be consumed
+    hashpipe_latency_set_filled(d, id, block_id);
     rv = semctl(d->semid, block_id, SETVAL, arg);
+    hashpipe_trace(HASHPIPE_TRACE_SET_FILLED, id, block_id);
+    hashpipe_thread_heartbeat(0);
 #ifdef HASHPIPE_TRACE
     printf("after %s(%p, %d) %016lx\n",
         __FUNCTION__, d, block_id, hashpipe_databuf_total_mask(d));
@@ -90,6 +90,12 @@ int hashpipe_databuf_wait_free(hashpipe_databuf_t *d, int block_id);
 int hashpipe_databuf_busywait_free(hashpipe_databuf_t *d, int block_id);
 int hashpipe_databuf_set_free(hashpipe_databuf_t *d, int block_id);
 
+/* Returns the number of blocks of databuf_id that threads of this process have
+ * marked free (a measure of the databuf's progress used by the hashpipe
+ * watchdog).  Only databuf IDs below HASHPIPE_TRACE_MAX_DATABUFS are counted.
+ */
+uint64_t hashpipe_databuf_freed(int databuf_id);
+
 #ifdef __cplusplus
 }
 #endif
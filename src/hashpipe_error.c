@@ -2,13 +2,81 @@
  *
  * Error handling routine
  */
+#define _GNU_SOURCE 1
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <errno.h>
 #include <string.h>
 #include <time.h>
+#include <pthread.h>
 #include "hashpipe_error.h"
 
+#define LOG_ERROR 0
+#define LOG_WARN  1
+#define LOG_INFO  2
+
+static const char *log_level_name[] = {"Error", "Warning", "Info"};
+
+// Number of records per thread's ring (power of 2)
+#define LOG_RING_SIZE 256
+// Maximum length of formatted asynchronous message (longer messages are
+// truncated)
+#define LOG_MSG_SIZE 200
+// How often the drain thread checks the rings
+#define LOG_DRAIN_PERIOD_NS 20000000
+// Number of call sites tracked for rate limiting (power of 2)
+#define LOG_SITES 256
+// Default maximum number of messages per second per call site when logging
+// asynchronously
+#define LOG_DEFAULT_RATE 10
+
+// One log message.  Everything except the message text is stored in binary
+// form and only formatted by the drain thread.  The message text itself must
+// be formatted by the caller because the types of the variable arguments are
+// only known to the format string.
+typedef struct {
+    int64_t time_ns; // CLOCK_REALTIME time of message
+    int32_t level;   // LOG_ERROR, LOG_WARN, or LOG_INFO
+    int32_t err;     // errno at time of message (LOG_ERROR only)
+    char name[32];
+    char msg[LOG_MSG_SIZE];
+} log_record_t;
+
+// Per-thread single producer single consumer ring of log records.  Rings are
+// never freed.  The ring of an exited thread is reused by a new thread.
+typedef struct log_ring {
+    struct log_ring *next; // Next ring in list of all rings
+    int owned;             // Non-zero while a thread owns this ring
+    uint32_t head;         // Next record to drain (written by drain thread)
+    uint32_t tail;         // Next record to fill (written by owner)
+    log_record_t rec[LOG_RING_SIZE];
+} log_ring_t;
+
+// Rate limiting state for one call site
+typedef struct {
+    const char *msg;     // Format string identifying call site
+    int64_t window;      // Current one second window
+    uint32_t count;      // Messages in current window
+    uint32_t suppressed; // Messages suppressed in current window
+} log_site_t;
+
+static log_ring_t *log_rings = NULL;
+static __thread log_ring_t *my_ring = NULL;
+static pthread_key_t my_ring_key;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static int log_async = 0;
+// Value of HASHPIPE_LOG_RATE (-1 if not set)
+static int log_rate = -1;
+static pthread_t log_thread;
+static int log_thread_running = 0;
+static pthread_mutex_t log_control_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Serializes log_drain() calls of drain thread and hashpipe_log_drain()
+static pthread_mutex_t log_drain_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t log_dropped = 0;
+static log_site_t log_sites[LOG_SITES];
+
 void log_timestamp(char * timestamp) {
     time_t now;
     time(&now);
@@ -16,56 +84,329 @@ void log_timestamp(char * timestamp) {
     timestamp[strlen(timestamp)-1] = '\0';  // strip the newline
 }
 
-/* For now just put it all to stderr.
- * Maybe do something clever like a stack in the future?
- */
-void hashpipe_error(const char *name, const char *msg, ...) {
+// Formats and writes one record to stderr
+static void log_write(const log_record_t *r)
+{
+    char timestamp[256];
+    time_t t = r->time_ns / 1000000000LL;
+    ctime_r(&t, timestamp);
+    timestamp[strlen(timestamp)-1] = '\0';  // strip the newline
+    if(r->err) {
+        fprintf(stderr, "%s : %s (%s)%s%s [%s]\n", timestamp,
+                log_level_name[r->level], r->name, r->msg[0] ? ": " : "",
+                r->msg, strerror(r->err));
+    } else {
+        fprintf(stderr, "%s : %s (%s)%s%s\n", timestamp,
+                log_level_name[r->level], r->name, r->msg[0] ? ": " : "",
+                r->msg);
+    }
+}
+
+// Writes one message to stderr as it is formatted (i.e. without truncating
+// it), for synchronous logging
+static void log_write_va(int level, const char *name, int err,
+        uint32_t suppressed, const char *msg, va_list ap)
+{
     char timestamp[256];
     log_timestamp(timestamp);
     fprintf(stderr, "%s : ", timestamp);
-    fprintf(stderr, "Error (%s)", name);
+    fprintf(stderr, "%s (%s)", log_level_name[level], name);
     if(msg) {
-        va_list ap;
-        va_start(ap, msg);
         fprintf(stderr, ": ");
         vfprintf(stderr, msg, ap);
-        va_end(ap);
     }
-    if(errno) {
-        fprintf(stderr, " [%s]", strerror(errno));
+    if(suppressed) {
+        fprintf(stderr, " (%u similar messages suppressed)", suppressed);
+    }
+    if(err) {
+        fprintf(stderr, " [%s]", strerror(err));
     }
     fprintf(stderr, "\n");
     fflush(stderr);
 }
 
-void hashpipe_warn(const char *name, const char *msg, ...) {
-    char timestamp[256];
-    log_timestamp(timestamp);
-    fprintf(stderr, "%s : ", timestamp);
-    fprintf(stderr, "Warning (%s)", name);
+// Writes all pending records of all rings, oldest first.  Only the drain
+// thread and hashpipe_log_drain() (holding log_drain_mutex), or a flush while
+// the drain thread is not running, call this.
+static int log_drain()
+{
+    log_ring_t *r, *oldest;
+    log_record_t *rec;
+    int n = 0;
+
+    while(1) {
+        // Find ring with oldest pending record
+        oldest = NULL;
+        for(r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+            if(r->head == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+            if(!oldest || r->rec[r->head % LOG_RING_SIZE].time_ns
+                    < oldest->rec[oldest->head % LOG_RING_SIZE].time_ns) {
+                oldest = r;
+            }
+        }
+        if(!oldest) {
+            break;
+        }
+        rec = &oldest->rec[oldest->head % LOG_RING_SIZE];
+        log_write(rec);
+        __atomic_store_n(&oldest->head, oldest->head+1, __ATOMIC_RELEASE);
+        n++;
+    }
+    if(n > 0) {
+        fflush(stderr);
+    }
+    return n;
+}
+
+static void *log_thread_run(void *arg)
+{
+    const struct timespec ts = {0, LOG_DRAIN_PERIOD_NS};
+    uint64_t reported = 0, dropped;
+    log_record_t rec;
+    int oldstate;
+
+    while(1) {
+        nanosleep(&ts, NULL);
+        pthread_testcancel();
+        // Do not get cancelled (in stdio) while holding log_drain_mutex
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &oldstate);
+        pthread_mutex_lock(&log_drain_mutex);
+        log_drain();
+        pthread_mutex_unlock(&log_drain_mutex);
+        pthread_setcancelstate(oldstate, NULL);
+        // Report dropped messages (once per change)
+        dropped = __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
+        if(dropped != reported) {
+            memset(&rec, 0, sizeof(rec));
+            rec.time_ns = time(NULL) * 1000000000LL;
+            rec.level = LOG_WARN;
+            strcpy(rec.name, __FUNCTION__);
+            snprintf(rec.msg, sizeof(rec.msg),
+                    "%llu log messages dropped (%llu total)",
+                    (unsigned long long)(dropped - reported),
+                    (unsigned long long)dropped);
+            log_write(&rec);
+            fflush(stderr);
+            reported = dropped;
+        }
+    }
+    return NULL;
+}
+
+// Releases calling thread's ring for reuse when the thread exits
+static void log_release_ring(void *ring)
+{
+    __atomic_store_n(&((log_ring_t *)ring)->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void log_init()
+{
+    char *s = getenv("HASHPIPE_LOG_RATE");
+    if(s) {
+        log_rate = atoi(s);
+    }
+    pthread_key_create(&my_ring_key, log_release_ring);
+    atexit(hashpipe_log_flush);
+}
+
+// Returns calling thread's ring (or NULL if none could be allocated)
+static log_ring_t *log_get_ring()
+{
+    log_ring_t *r;
+    int owned;
+
+    if(my_ring) {
+        return my_ring;
+    }
+
+    // Reuse ring of an exited thread if possible (and already drained)
+    for(r = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+        owned = 0;
+        if(__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == r->tail
+        && __atomic_compare_exchange_n(&r->owned, &owned, 1, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    // Otherwise add new ring to list
+    if(!r) {
+        if(!(r = calloc(1, sizeof(log_ring_t)))) {
+            return NULL;
+        }
+        r->owned = 1;
+        r->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+        while(!__atomic_compare_exchange_n(&log_rings, &r->next, r, 0,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+
+    my_ring = r;
+    pthread_setspecific(my_ring_key, r);
+    return r;
+}
+
+// Returns non-zero if the message from call site msg should be logged.  If
+// messages from this call site were suppressed in the previous window, their
+// number is stored in *suppressed.
+// Messages are only rate limited by default when logging asynchronously.
+static int log_rate_ok(const char *msg, int64_t now_ns, int async,
+        uint32_t *suppressed)
+{
+    log_site_t *site;
+    int64_t window = now_ns / 1000000000LL;
+    int64_t site_window;
+    int rate = log_rate >= 0 ? log_rate : async ? LOG_DEFAULT_RATE : 0;
+
+    *suppressed = 0;
+    if(rate <= 0 || !msg) {
+        return 1;
+    }
+
+    // Call sites are identified by the address of their format string.
+    // Sites that collide share a slot (and a budget).
+    site = &log_sites[((uintptr_t)msg >> 3) % LOG_SITES];
+    site_window = __atomic_load_n(&site->window, __ATOMIC_ACQUIRE);
+    if(site_window != window
+    && __atomic_compare_exchange_n(&site->window, &site_window, window, 0,
+                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        // First message of a new window
+        site->msg = msg;
+        __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+        *suppressed = __atomic_exchange_n(&site->suppressed, 0,
+                __ATOMIC_RELAXED);
+    }
+    if(__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED) > rate) {
+        __atomic_add_fetch(&site->suppressed, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
+}
+
+static void hashpipe_log(int level, const char *name, const char *msg,
+        va_list ap)
+{
+    int saved_errno = errno;
+    struct timespec now;
+    int64_t now_ns;
+    log_record_t *rec;
+    log_ring_t *r;
+    uint32_t tail, suppressed;
+    size_t len;
+    int async;
+
+    pthread_once(&log_once, log_init);
+    clock_gettime(CLOCK_REALTIME, &now);
+    now_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+    async = __atomic_load_n(&log_async, __ATOMIC_ACQUIRE);
+
+    if(!log_rate_ok(msg, now_ns, async, &suppressed)) {
+        errno = saved_errno;
+        return;
+    }
+
+    // Write message right away if logging synchronously
+    if(!async || !(r = log_get_ring())) {
+        log_write_va(level, name, level == LOG_ERROR ? saved_errno : 0,
+                suppressed, msg, ap);
+        errno = saved_errno;
+        return;
+    }
+
+    // Otherwise use a slot in calling thread's ring
+    tail = r->tail;
+    if(tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= LOG_RING_SIZE) {
+        // Ring is full, drop message rather than stall caller
+        __atomic_add_fetch(&log_dropped, 1, __ATOMIC_RELAXED);
+        errno = saved_errno;
+        return;
+    }
+    rec = &r->rec[tail % LOG_RING_SIZE];
+    rec->time_ns = now_ns;
+    rec->level = level;
+    rec->err = level == LOG_ERROR ? saved_errno : 0;
+    strncpy(rec->name, name ? name : "", sizeof(rec->name)-1);
+    rec->name[sizeof(rec->name)-1] = '\0';
+    rec->msg[0] = '\0';
     if(msg) {
-        va_list ap;
-        va_start(ap, msg);
-        fprintf(stderr, ": ");
-        vfprintf(stderr, msg, ap);
-        va_end(ap);
+        vsnprintf(rec->msg, sizeof(rec->msg), msg, ap);
     }
-    fprintf(stderr, "\n");
-    fflush(stderr);
+    if(suppressed) {
+        len = strlen(rec->msg);
+        snprintf(rec->msg+len, sizeof(rec->msg)-len,
+                " (%u similar messages suppressed)", suppressed);
+    }
+    __atomic_store_n(&r->tail, tail+1, __ATOMIC_RELEASE);
+
+    errno = saved_errno;
+}
+
+/* For now just put it all to stderr.
+ * Maybe do something clever like a stack in the future?
+ */
+void hashpipe_error(const char *name, const char *msg, ...) {
+    va_list ap;
+    va_start(ap, msg);
+    hashpipe_log(LOG_ERROR, name, msg, ap);
+    va_end(ap);
+}
+
+void hashpipe_warn(const char *name, const char *msg, ...) {
+    va_list ap;
+    va_start(ap, msg);
+    hashpipe_log(LOG_WARN, name, msg, ap);
+    va_end(ap);
 }
 
 void hashpipe_info(const char *name, const char *msg, ...) {
-    char timestamp[256];
-    log_timestamp(timestamp);
-    fprintf(stderr, "%s : ", timestamp);
-    fprintf(stderr, "Info (%s)", name);
-    if(msg) {
-        va_list ap;
-        va_start(ap, msg);
-        fprintf(stderr, ": ");
-        vfprintf(stderr, msg, ap);
-        va_end(ap);
+    va_list ap;
+    va_start(ap, msg);
+    hashpipe_log(LOG_INFO, name, msg, ap);
+    va_end(ap);
+}
+
+int hashpipe_log_async(int enable)
+{
+    int rv = 0;
+
+    pthread_once(&log_once, log_init);
+    pthread_mutex_lock(&log_control_mutex);
+    if(enable && !log_thread_running) {
+        if(pthread_create(&log_thread, NULL, log_thread_run, NULL) == 0) {
+            log_thread_running = 1;
+            __atomic_store_n(&log_async, 1, __ATOMIC_RELEASE);
+        } else {
+            rv = -1;
+        }
+    } else if(!enable && log_thread_running) {
+        __atomic_store_n(&log_async, 0, __ATOMIC_RELEASE);
+        pthread_cancel(log_thread);
+        pthread_join(log_thread, NULL);
+        log_thread_running = 0;
+        hashpipe_log_drain();
     }
-    fprintf(stderr, "\n");
-    fflush(stderr);
+    pthread_mutex_unlock(&log_control_mutex);
+    return rv;
+}
+
+void hashpipe_log_flush()
+{
+    // Stopping the drain thread drains everything that is left
+    if(__atomic_load_n(&log_async, __ATOMIC_ACQUIRE)) {
+        hashpipe_log_async(0);
+    }
+}
+
+void hashpipe_log_drain()
+{
+    pthread_mutex_lock(&log_drain_mutex);
+    log_drain();
+    pthread_mutex_unlock(&log_drain_mutex);
+}
+
+unsigned long long hashpipe_log_dropped()
+{
+    return __atomic_load_n(&log_dropped, __ATOMIC_RELAXED);
 }
@@ -29,6 +29,36 @@ void hashpipe_warn(const char *name, const char *msg, ...);
 /* Call this to log an informational message */
 void hashpipe_info(const char *name, const char *msg, ...);
 
+/* By default the functions above write their message to stderr before
+ * returning.  hashpipe_log_async(1) switches to asynchronous logging: each
+ * thread then only copies its message (with a binary timestamp) into a
+ * lock-free ring of its own and a background thread writes the messages, in
+ * time order, to stderr.  Logging never blocks the caller; messages that do
+ * not fit in a full ring are dropped and counted.  hashpipe_log_async(0)
+ * writes any pending messages and switches back to synchronous logging.
+ * Returns 0 on success.  Pending messages are also written at exit().
+ *
+ * Asynchronous messages are truncated to 200 characters.
+ *
+ * When logging asynchronously, each call site (i.e. format string) may log at
+ * most HASHPIPE_LOG_RATE (environment variable, default 10, 0 for no limit)
+ * messages per second.  Synchronous logging is only rate limited if
+ * HASHPIPE_LOG_RATE is set.  The number of suppressed messages is appended to
+ * the next message logged from the same call site.
+ */
+int hashpipe_log_async(int enable);
+
+/* Write any pending asynchronous log messages and stop asynchronous logging */
+void hashpipe_log_flush();
+
+/* Write any pending asynchronous log messages now (e.g. before writing
+ * directly to stderr), but keep logging asynchronously
+ */
+void hashpipe_log_drain();
+
+/* Returns the number of messages dropped so far (full ring or rate limit) */
+unsigned long long hashpipe_log_dropped();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,40 @@
+/* hashpipe_futex.h
+ *
+ * Futex and clock helpers shared by the shared memory routines (status buffer
+ * lock and generation, command queues) and built-in threads.  Not installed.
+ */
+#ifndef _HASHPIPE_FUTEX_H
+#define _HASHPIPE_FUTEX_H
+
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/* Waits (up to the relative timeout, if not NULL) for a wake-up of *uaddr if
+ * it still contains val.  Returns 0 or -1 with errno set (e.g. to EAGAIN if
+ * *uaddr did not contain val or ETIMEDOUT).
+ */
+static inline int futex_wait(uint32_t *uaddr, uint32_t val,
+        const struct timespec *timeout)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAIT, val, timeout, NULL, 0);
+}
+
+/* Wakes all waiters of *uaddr */
+static inline int futex_wake_all(uint32_t *uaddr)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Returns the current time in ns of CLOCK_MONOTONIC */
+static inline int64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+#endif // _HASHPIPE_FUTEX_H
@@ -0,0 +1,382 @@
+/* hashpipe_graph.c
+ *
+ * Implementation of the pipeline graph helpers described
+ * in hashpipe_graph.h
+ */
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "hashpipe_graph.h"
+
+// From <numaif.h> (not needed otherwise)
+#ifndef MPOL_DEFAULT
+#define MPOL_DEFAULT   0
+#define MPOL_PREFERRED 1
+#endif
+
+#define MAX_NAMES 64
+
+static struct {
+    char name[32];
+    int id;
+} databuf_names[MAX_NAMES];
+static int num_databuf_names = 0;
+
+static int databuf_nodes[HASHPIPE_GRAPH_MAX_DATABUF+1];
+static int databuf_nodes_init = 0;
+
+// Appends the arguments in graph file filename to *pargv (of length *pargc)
+static int read_graph_file(const char *filename, char ***pargv, int *pargc)
+{
+    FILE *f;
+    char *buf = NULL;
+    size_t len = 0;
+    char *p, *tok, *q;
+    int quoted;
+
+    if(!(f = fopen(filename, "r"))) {
+        fprintf(stderr, "Error opening graph file '%s': %s\n",
+                filename, strerror(errno));
+        return -1;
+    }
+    if(getdelim(&buf, &len, '\0', f) == -1) {
+        // Empty file
+        fclose(f);
+        free(buf);
+        return 0;
+    }
+    fclose(f);
+
+    for(p = buf; *p; ) {
+        if(isspace((unsigned char)*p)) {
+            p++;
+            continue;
+        }
+        if(*p == '#') {
+            p += strcspn(p, "\n");
+            continue;
+        }
+        // Collect one argument, removing quotes in place
+        tok = q = p;
+        quoted = 0;
+        while(*p && (quoted || !isspace((unsigned char)*p))) {
+            if(*p == '"') {
+                quoted = !quoted;
+                p++;
+            } else {
+                *q++ = *p++;
+            }
+        }
+        if(quoted) {
+            fprintf(stderr, "Unterminated quote in graph file '%s'\n",
+                    filename);
+            free(buf);
+            return -1;
+        }
+        if(*p) {
+            p++;
+        }
+        *q = '\0';
+        if(!strcmp(tok, "-g") || !strncmp(tok, "--graph", 7)) {
+            fprintf(stderr, "Graph file '%s' cannot include other graph "
+                    "files\n", filename);
+            free(buf);
+            return -1;
+        }
+        *pargv = realloc(*pargv, (*pargc + 2) * sizeof(char *));
+        (*pargv)[(*pargc)++] = strdup(tok);
+    }
+    free(buf);
+    return 0;
+}
+
+char **hashpipe_graph_expand_args(int *argc, char **argv)
+{
+    char **new_argv = NULL;
+    int new_argc = 0;
+    const char *filename;
+    int i;
+
+    for(i=0; i<*argc; i++) {
+        filename = NULL;
+        if(!strcmp(argv[i], "-g") || !strcmp(argv[i], "--graph")) {
+            if(i+1 >= *argc) {
+                fprintf(stderr, "Option %s requires a file name\n", argv[i]);
+                return NULL;
+            }
+            filename = argv[++i];
+        } else if(!strncmp(argv[i], "--graph=", 8)) {
+            filename = argv[i] + 8;
+        } else if(!strncmp(argv[i], "-g", 2) && i > 0) {
+            filename = argv[i] + 2;
+        }
+
+        if(filename) {
+            if(read_graph_file(filename, &new_argv, &new_argc)) {
+                return NULL;
+            }
+        } else {
+            new_argv = realloc(new_argv, (new_argc + 2) * sizeof(char *));
+            new_argv[new_argc++] = argv[i];
+        }
+    }
+    new_argv[new_argc] = NULL;
+    *argc = new_argc;
+    return new_argv;
+}
+
+// Returns the id of databuf name (which may be a number), or -1
+static int databuf_id(const char *name)
+{
+    char *end;
+    long id;
+    int i;
+
+    id = strtol(name, &end, 10);
+    if(end != name && !*end) {
+        return id >= 1 && id <= HASHPIPE_GRAPH_MAX_DATABUF ? id : -1;
+    }
+    for(i=0; i<num_databuf_names; i++) {
+        if(!strcmp(databuf_names[i].name, name)) {
+            return databuf_names[i].id;
+        }
+    }
+    return -1;
+}
+
+int hashpipe_graph_define_databuf(const char *spec)
+{
+    char name[32];
+    const char *eq, *p;
+    char *end;
+    long id, node = -1;
+    int i;
+
+    if(!databuf_nodes_init) {
+        for(i=0; i<=HASHPIPE_GRAPH_MAX_DATABUF; i++) {
+            databuf_nodes[i] = -1;
+        }
+        databuf_nodes_init = 1;
+    }
+
+    eq = strchr(spec, '=');
+    if(!eq || eq == spec || eq - spec >= sizeof(name)
+    || isdigit((unsigned char)spec[0])) {
+        fprintf(stderr, "Invalid databuf definition '%s'\n", spec);
+        return -1;
+    }
+    memcpy(name, spec, eq - spec);
+    name[eq - spec] = '\0';
+
+    id = strtol(eq+1, &end, 10);
+    if(end == eq+1 || id < 1 || id > HASHPIPE_GRAPH_MAX_DATABUF) {
+        fprintf(stderr, "Invalid databuf ID in '%s'\n", spec);
+        return -1;
+    }
+    for(p = end; *p == ','; p = end) {
+        if(!strncmp(p, ",node=", 6)) {
+            node = strtol(p+6, &end, 10);
+            if(end == p+6 || node < 0) {
+                fprintf(stderr, "Invalid NUMA node in '%s'\n", spec);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "Invalid databuf attribute in '%s'\n", spec);
+            return -1;
+        }
+    }
+    if(*p) {
+        fprintf(stderr, "Invalid databuf definition '%s'\n", spec);
+        return -1;
+    }
+
+    for(i=0; i<num_databuf_names; i++) {
+        if(!strcmp(databuf_names[i].name, name)) {
+            break;
+        }
+    }
+    if(i == MAX_NAMES) {
+        fprintf(stderr, "Too many databuf names\n");
+        return -1;
+    }
+    strcpy(databuf_names[i].name, name);
+    databuf_names[i].id = id;
+    if(i == num_databuf_names) {
+        num_databuf_names++;
+    }
+    databuf_nodes[id] = node;
+    return 0;
+}
+
+int hashpipe_graph_parse_databufs(const char *list, int *ids, int max)
+{
+    char name[32];
+    size_t len;
+    int n = 0;
+
+    while(*list) {
+        len = strcspn(list, ",");
+        if(len == 0 || len >= sizeof(name) || n == max) {
+            fprintf(stderr, "Invalid databuf list '%s'\n", list);
+            return -1;
+        }
+        memcpy(name, list, len);
+        name[len] = '\0';
+        if((ids[n++] = databuf_id(name)) < 0) {
+            fprintf(stderr, "Unknown databuf '%s'\n", name);
+            return -1;
+        }
+        list += len;
+        if(*list == ',') {
+            list++;
+        }
+    }
+    return n > 0 ? n : -1;
+}
+
+int hashpipe_graph_databuf_node(int id)
+{
+    if(!databuf_nodes_init || id < 0 || id > HASHPIPE_GRAPH_MAX_DATABUF) {
+        return -1;
+    }
+    return databuf_nodes[id];
+}
+
+int hashpipe_graph_set_mempolicy(int node)
+{
+    unsigned long mask[16] = {0};
+    int bits = 8 * sizeof(mask);
+
+    if(node < 0) {
+        return syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0);
+    }
+    if(node >= bits) {
+        errno = EINVAL;
+        return -1;
+    }
+    mask[node / (8*sizeof(long))] |= 1UL << (node % (8*sizeof(long)));
+    return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask, bits + 1);
+}
+
+// Returns non-zero if thread a is another worker of the same pool as b
+static int same_pool(hashpipe_thread_args_t *a, hashpipe_thread_args_t *b)
+{
+    return a->worker_index > 0 && a->thread_desc == b->thread_desc
+        && a->input_buffer == b->input_buffer
+        && a->output_buffer == b->output_buffer;
+}
+
+int hashpipe_graph_check(hashpipe_thread_args_t *args, int n)
+{
+    int consumer[HASHPIPE_GRAPH_MAX_DATABUF+1];
+    int producer[HASHPIPE_GRAPH_MAX_DATABUF+1];
+    int i, j, id, rv = 0;
+
+    for(i=0; i<=HASHPIPE_GRAPH_MAX_DATABUF; i++) {
+        consumer[i] = producer[i] = -1;
+    }
+
+    for(i=0; i<n; i++) {
+        if(args[i].worker_index > 0) {
+            continue;
+        }
+        for(j=0; j<args[i].num_input_buffers; j++) {
+            id = args[i].input_buffers[j];
+            if(id < 1 || id > HASHPIPE_GRAPH_MAX_DATABUF) {
+                continue;
+            }
+            if(consumer[id] >= 0 && !same_pool(&args[i], &args[consumer[id]])) {
+                fprintf(stderr, "Databuf %d is input to both '%s' and '%s' "
+                        "(fan-out needs a thread with several outputs)\n", id,
+                        args[consumer[id]].thread_desc->name,
+                        args[i].thread_desc->name);
+                rv = -1;
+            }
+            consumer[id] = i;
+        }
+        for(j=0; j<args[i].num_output_buffers; j++) {
+            id = args[i].output_buffers[j];
+            if(id < 1 || id > HASHPIPE_GRAPH_MAX_DATABUF) {
+                continue;
+            }
+            if(producer[id] >= 0) {
+                fprintf(stderr, "Databuf %d is output of both '%s' and '%s' "
+                        "(fan-in needs a thread with several inputs)\n", id,
+                        args[producer[id]].thread_desc->name,
+                        args[i].thread_desc->name);
+                rv = -1;
+            }
+            producer[id] = i;
+        }
+    }
+    return rv;
+}
+
+// Returns non-zero if thread a produces a databuf that thread b consumes
+static int feeds(hashpipe_thread_args_t *a, hashpipe_thread_args_t *b)
+{
+    int i, j;
+    for(i=0; i<a->num_output_buffers; i++) {
+        for(j=0; j<b->num_input_buffers; j++) {
+            if(a->output_buffers[i] == b->input_buffers[j]) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+int hashpipe_graph_start_order(hashpipe_thread_args_t *args, int n,
+        int *order)
+{
+    int *npending = calloc(n, sizeof(int));
+    int *started = calloc(n, sizeof(int));
+    int i, j, k;
+
+    // Count the consumers of each thread that have to be started first
+    for(i=0; i<n; i++) {
+        for(j=0; j<n; j++) {
+            if(i != j && feeds(&args[i], &args[j])) {
+                npending[i]++;
+            }
+        }
+    }
+
+    // Repeatedly start the last thread (in command line order) whose
+    // consumers have all been started
+    for(k=0; k<n; k++) {
+        for(i=n-1; i>=0; i--) {
+            if(!started[i] && npending[i] == 0) {
+                break;
+            }
+        }
+        if(i < 0) {
+            break;
+        }
+        started[i] = 1;
+        order[k] = i;
+        for(j=0; j<n; j++) {
+            if(j != i && feeds(&args[j], &args[i])) {
+                npending[j]--;
+            }
+        }
+    }
+
+    free(npending);
+    free(started);
+
+    if(k < n) {
+        // Cycle
+        for(k=0; k<n; k++) {
+            order[k] = n-1-k;
+        }
+        return -1;
+    }
+    return 0;
+}
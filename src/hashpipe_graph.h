@@ -0,0 +1,79 @@
+/* hashpipe_graph.h
+ *
+ * Helpers the hashpipe executable uses to build non-linear pipelines.
+ *
+ * A pipeline graph file ("-g FILE") holds hashpipe command line arguments,
+ * separated by white space (including newlines), with '#' starting a comment
+ * that runs to the end of the line and double quotes grouping words into one
+ * argument.  The arguments are inserted into the command line in place of the
+ * -g option.  In addition to the usual options, these describe the graph:
+ *
+ *   --databuf=NAME=ID[,node=N]  Name databuf ID (optionally placing its
+ *                               memory on NUMA node N)
+ *   --in=LIST                   Input databuf(s) of next thread
+ *   --out=LIST                  Output databuf(s) of next thread
+ *
+ * where LIST is a comma separated list of databuf names or IDs.  For example:
+ *
+ *   # Two beams from one capture thread
+ *   -p myplugin
+ *   --databuf=raw0=1,node=0 --databuf=raw1=2,node=1
+ *   --out=raw0,raw1 -c 2 capture_thread
+ *   --in=raw0 --out=3 -c node:0 -w 4 beam_thread
+ *   --in=raw1 --out=4 -c node:1 -w 4 beam_thread
+ *   --in=3,4 -c 5 output_thread
+ *
+ * A thread's first input and output databufs are its input_buffer and
+ * output_buffer (i.e. ibuf and obuf).  Threads with more than one input or
+ * output databuf find the others in the input_buffers and output_buffers
+ * fields of their args.
+ */
+#ifndef _HASHPIPE_GRAPH_H
+#define _HASHPIPE_GRAPH_H
+
+#include "hashpipe.h"
+
+// Largest databuf ID usable in a graph
+#define HASHPIPE_GRAPH_MAX_DATABUF 255
+
+/* Returns a new argument vector (and count in *argc) with every "-g FILE",
+ * "--graph=FILE", and "--graph FILE" replaced by the arguments in FILE.
+ * Graph files cannot include other graph files.  Returns NULL (after printing
+ * a message) on error.
+ */
+char **hashpipe_graph_expand_args(int *argc, char **argv);
+
+/* Defines a databuf name from spec "NAME=ID[,node=N]".  Returns 0 on success
+ * or -1 on error.
+ */
+int hashpipe_graph_define_databuf(const char *spec);
+
+/* Parses list of databuf names or IDs into ids (up to max).  Returns the
+ * number of databufs or -1 on error.
+ */
+int hashpipe_graph_parse_databufs(const char *list, int *ids, int max);
+
+/* Returns the NUMA node requested for databuf id, or -1 if none */
+int hashpipe_graph_databuf_node(int id);
+
+/* Sets the memory policy of the calling thread so that memory it touches
+ * from now on is placed on NUMA node (or anywhere if node is negative).
+ * Returns 0 on success.
+ */
+int hashpipe_graph_set_mempolicy(int node);
+
+/* Checks that no databuf is the input of more than one thread (other than the
+ * workers of a pool) or the output of more than one thread.  Returns 0 if the
+ * graph is OK, otherwise prints a message and returns -1.
+ */
+int hashpipe_graph_check(hashpipe_thread_args_t *args, int n);
+
+/* Stores the order in which to start the n threads of args in order:
+ * consumers before their producers, ties broken by command line order.
+ * Returns 0 on success or -1 (with order set to reverse command line order)
+ * if the graph has a cycle.
+ */
+int hashpipe_graph_start_order(hashpipe_thread_args_t *args, int n,
+        int *order);
+
+#endif // _HASHPIPE_GRAPH_H
@@ -0,0 +1,328 @@
+/* hashpipe_history.c
+ *
+ * Implementation of the status history routines described
+ * in hashpipe_history.h
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <math.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hashpipe_history.h"
+#include "hashpipe_error.h"
+
+int hashpipe_history_name(int instance_id, char * name, size_t size)
+{
+    if(hashpipe_status_semname(instance_id, name, size)) {
+        return 1;
+    }
+    if(strlen(name) + strlen("_history") + 1 > size) {
+        return 1;
+    }
+    strcat(name, "_history");
+    return 0;
+}
+
+static size_t hashpipe_history_size(int depth)
+{
+    return sizeof(hashpipe_history_ring_t)
+        + depth * sizeof(hashpipe_history_sample_t);
+}
+
+int hashpipe_history_create(int instance_id, hashpipe_history_t *h,
+        const char **keys, int nkeys, double period, int depth)
+{
+    char name[NAME_MAX] = {'\0'};
+    int i, fd;
+
+    if(nkeys < 1 || nkeys > HASHPIPE_HISTORY_MAX_KEYS
+    || period <= 0 || depth < 2) {
+        hashpipe_error(__FUNCTION__, "invalid history parameters");
+        return HASHPIPE_ERR_PARAM;
+    }
+
+    instance_id &= 0x3f;
+    h->instance_id = instance_id;
+    h->size = hashpipe_history_size(depth);
+    h->ring = NULL;
+
+    if(hashpipe_history_name(instance_id, name, NAME_MAX)) {
+        hashpipe_error(__FUNCTION__, "history name truncated");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    // Start from scratch so that readers attached to an old ring with a
+    // different size or key list do not see inconsistent data.
+    shm_unlink(name);
+    mode_t old_umask = umask(0);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    umask(old_umask);
+    if(fd == -1) {
+        hashpipe_error(__FUNCTION__, "shm_open %s", name);
+        return HASHPIPE_ERR_SYS;
+    }
+    if(ftruncate(fd, h->size)) {
+        hashpipe_error(__FUNCTION__, "ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return HASHPIPE_ERR_SYS;
+    }
+    h->ring = mmap(NULL, h->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(h->ring == MAP_FAILED) {
+        hashpipe_error(__FUNCTION__, "mmap");
+        h->ring = NULL;
+        shm_unlink(name);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    // New shared memory objects are zero filled
+    h->ring->version = HASHPIPE_HISTORY_VERSION;
+    h->ring->nkeys = nkeys;
+    h->ring->depth = depth;
+    h->ring->period = period;
+    for(i=0; i<nkeys; i++) {
+        strncpy(h->ring->key[i], keys[i], sizeof(h->ring->key[i])-1);
+    }
+    __atomic_store_n(&h->ring->magic, HASHPIPE_HISTORY_MAGIC, __ATOMIC_RELEASE);
+
+    return HASHPIPE_OK;
+}
+
+int hashpipe_history_attach(int instance_id, hashpipe_history_t *h)
+{
+    char name[NAME_MAX] = {'\0'};
+    struct stat st;
+    int fd;
+
+    instance_id &= 0x3f;
+    h->instance_id = instance_id;
+    h->size = 0;
+    h->ring = NULL;
+
+    if(hashpipe_history_name(instance_id, name, NAME_MAX)) {
+        hashpipe_error(__FUNCTION__, "history name truncated");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if(fd == -1) {
+        return errno == ENOENT ? HASHPIPE_ERR_KEY : HASHPIPE_ERR_SYS;
+    }
+    if(fstat(fd, &st) || st.st_size < sizeof(hashpipe_history_ring_t)) {
+        close(fd);
+        return HASHPIPE_ERR_KEY;
+    }
+    h->size = st.st_size;
+    h->ring = mmap(NULL, h->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(h->ring == MAP_FAILED) {
+        hashpipe_error(__FUNCTION__, "mmap");
+        h->ring = NULL;
+        return HASHPIPE_ERR_SYS;
+    }
+
+    // Make sure the ring is initialized and matches our idea of its layout
+    if(__atomic_load_n(&h->ring->magic, __ATOMIC_ACQUIRE)
+                != HASHPIPE_HISTORY_MAGIC
+    || h->ring->version != HASHPIPE_HISTORY_VERSION
+    || h->ring->nkeys > HASHPIPE_HISTORY_MAX_KEYS
+    || h->size < hashpipe_history_size(h->ring->depth)) {
+        hashpipe_history_detach(h, 0);
+        return HASHPIPE_ERR_KEY;
+    }
+
+    return HASHPIPE_OK;
+}
+
+int hashpipe_history_detach(hashpipe_history_t *h, int unlink)
+{
+    char name[NAME_MAX] = {'\0'};
+
+    if(h->ring) {
+        munmap(h->ring, h->size);
+        h->ring = NULL;
+    }
+    if(unlink) {
+        hashpipe_history_name(h->instance_id, name, NAME_MAX);
+        if(shm_unlink(name) && errno != ENOENT) {
+            hashpipe_error(__FUNCTION__, "shm_unlink %s", name);
+            return HASHPIPE_ERR_SYS;
+        }
+    }
+    return HASHPIPE_OK;
+}
+
+int hashpipe_history_sample(hashpipe_history_t *h, hashpipe_status_t *s)
+{
+    hashpipe_history_ring_t *r = h->ring;
+    hashpipe_history_sample_t *sample;
+    hkv_t kv[HASHPIPE_HISTORY_MAX_KEYS];
+    char str[HASHPIPE_HISTORY_MAX_KEYS][72];
+    struct timespec ts;
+    uint64_t count;
+    char *p;
+    int i;
+
+    if(!r) {
+        return HASHPIPE_ERR_GEN;
+    }
+
+    memset(kv, 0, sizeof(kv));
+    for(i=0; i<r->nkeys; i++) {
+        kv[i].keyword = r->key[i];
+        // Get values as strings so that non-numeric ones can be told apart
+        kv[i].type = HKV_S;
+        kv[i].val = str[i];
+        kv[i].lstr = sizeof(str[i]);
+        str[i][0] = '\0';
+    }
+
+    // Get all keys in one pass over the status buffer
+    hashpipe_status_lock_safe(s);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    hgetv(s->buf, kv, r->nkeys);
+    hashpipe_status_unlock_safe(s);
+
+    // Fill in next sample, then publish it
+    count = r->count;
+    sample = &r->sample[count % r->depth];
+    sample->time_ns = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    for(i=0; i<r->nkeys; i++) {
+        sample->value[i] = NAN;
+        // Integers and floating point numbers (with E or D exponents)
+        if(kv[i].card && (isnum(str[i]) == 1 || isnum(str[i]) == 2)) {
+            for(p=str[i]; *p; p++) {
+                if(*p == 'D' || *p == 'd') {
+                    *p = 'e';
+                }
+            }
+            sample->value[i] = strtod(str[i], NULL);
+        }
+    }
+    __atomic_store_n(&r->count, count+1, __ATOMIC_RELEASE);
+
+    return HASHPIPE_OK;
+}
+
+/* Returns index of keyword in ring's key list, or -1 if not found */
+static int hashpipe_history_key_index(hashpipe_history_ring_t *r,
+        const char *keyword)
+{
+    int i;
+    for(i=0; i<r->nkeys; i++) {
+        if(!strncasecmp(r->key[i], keyword, sizeof(r->key[i]))) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Copy up to max of the most recent complete samples of key k into t/v
+ * (oldest first).  Returns the number of samples copied.
+ */
+static int hashpipe_history_copy(hashpipe_history_ring_t *r, int k, int max,
+        double *t, double *v)
+{
+    uint64_t count, first, n;
+    hashpipe_history_sample_t *sample;
+    int i, ncopied;
+
+    do {
+        count = __atomic_load_n(&r->count, __ATOMIC_ACQUIRE);
+        // The sample being written (count % depth) is not complete, so at
+        // most depth-1 samples are available.
+        n = count < r->depth - 1 ? count : r->depth - 1;
+        if(n > max) {
+            n = max;
+        }
+        first = count - n;
+        for(i=0; i<n; i++) {
+            sample = &r->sample[(first + i) % r->depth];
+            if(t) t[i] = sample->time_ns / 1e9;
+            if(v) v[i] = sample->value[k];
+        }
+        ncopied = n;
+        // Retry if the writer lapped us while copying
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while(__atomic_load_n(&r->count, __ATOMIC_RELAXED) - first
+            >= r->depth);
+
+    return ncopied;
+}
+
+int hashpipe_history_get(hashpipe_history_t *h, const char *keyword, int max,
+        double *t, double *v)
+{
+    int k;
+    if(!h->ring) {
+        return HASHPIPE_ERR_GEN;
+    }
+    if((k = hashpipe_history_key_index(h->ring, keyword)) < 0) {
+        return HASHPIPE_ERR_KEY;
+    }
+    return hashpipe_history_copy(h->ring, k, max, t, v);
+}
+
+int hashpipe_history_stats(hashpipe_history_t *h, const char *keyword,
+        double window, double *rate, double *min, double *max)
+{
+    hashpipe_history_ring_t *r = h->ring;
+    double *t, *v;
+    double vmin = NAN, vmax = NAN;
+    int i, k, n, first, last;
+
+    if(!r) {
+        return HASHPIPE_ERR_GEN;
+    }
+    if((k = hashpipe_history_key_index(r, keyword)) < 0) {
+        return HASHPIPE_ERR_KEY;
+    }
+
+    // Number of samples covering window (plus one for differencing)
+    n = (int)ceil(window / r->period) + 1;
+    if(n > r->depth) {
+        n = r->depth;
+    }
+    t = (double *)malloc(2 * n * sizeof(double));
+    if(!t) {
+        return HASHPIPE_ERR_SYS;
+    }
+    v = t + n;
+    n = hashpipe_history_copy(r, k, n, t, v);
+
+    // Ignore samples older than window and samples without values
+    first = -1;
+    last = -1;
+    for(i=0; i<n; i++) {
+        if(isnan(v[i]) || t[i] < t[n-1] - window - r->period / 2) {
+            continue;
+        }
+        if(first < 0) {
+            first = i;
+        }
+        last = i;
+        if(isnan(vmin) || v[i] < vmin) vmin = v[i];
+        if(isnan(vmax) || v[i] > vmax) vmax = v[i];
+    }
+
+    if(rate) {
+        *rate = (first >= 0 && t[last] > t[first])
+            ? (v[last] - v[first]) / (t[last] - t[first]) : NAN;
+    }
+    if(min) *min = vmin;
+    if(max) *max = vmax;
+    n = first < 0 ? 0 : last - first + 1;
+
+    free(t);
+    return n;
+}
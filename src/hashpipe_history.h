@@ -0,0 +1,108 @@
+/* hashpipe_history.h
+ *
+ * Routines dealing with the (optional) hashpipe status history shared memory
+ * segment.  The history segment is a ring of timestamped samples of selected
+ * numeric status buffer keys.  The samples are taken at a fixed cadence by a
+ * single writer (e.g. the hashpipe executable when run with the --history
+ * option).  Readers get rates, min/max values, and short-term history without
+ * polling the status buffer and without locking anything.
+ */
+#ifndef _HASHPIPE_HISTORY_H
+#define _HASHPIPE_HISTORY_H
+
+#include <stdint.h>
+
+#include "hashpipe_status.h"
+
+#define HASHPIPE_HISTORY_MAGIC 0x48504849 // "HPHI"
+#define HASHPIPE_HISTORY_VERSION 1
+#define HASHPIPE_HISTORY_MAX_KEYS 32
+#define HASHPIPE_HISTORY_SECONDS 60 // Default amount of history to keep
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Structure describes one sample of the history ring (lives in shared
+ * memory).  Keys that were not found in the status buffer (or that have
+ * non-numeric values) are stored as NAN.
+ */
+typedef struct {
+    int64_t time_ns; /* CLOCK_REALTIME time of sample in nanoseconds */
+    double value[HASHPIPE_HISTORY_MAX_KEYS]; /* One value per key */
+} hashpipe_history_sample_t;
+
+/* Structure describes history ring header (lives in shared memory).  The
+ * samples follow the header.  Sample n (counting from 0) is stored in
+ * sample[n % depth].  The writer stores each sample before advancing count,
+ * so samples count-depth+1 through count-1 are always complete.
+ */
+typedef struct {
+    uint32_t magic;   /* HASHPIPE_HISTORY_MAGIC once initialized */
+    uint32_t version; /* HASHPIPE_HISTORY_VERSION */
+    uint32_t nkeys;   /* Number of keys being sampled */
+    uint32_t depth;   /* Number of samples in ring */
+    double period;    /* Nominal time between samples in seconds */
+    char key[HASHPIPE_HISTORY_MAX_KEYS][16]; /* Keys being sampled */
+    uint64_t count;   /* Total number of samples written */
+    hashpipe_history_sample_t sample[];
+} hashpipe_history_ring_t;
+
+/* Structure describes history shared memory area */
+typedef struct {
+    int instance_id; /* Instance ID of this history ring */
+    size_t size;     /* Size of mapping in bytes */
+    hashpipe_history_ring_t *ring; /* Pointer to mapping */
+} hashpipe_history_t;
+
+/*
+ * Stores the hashpipe history (POSIX) shared memory object name in name
+ * buffer of length size.  The name is the hashpipe status semaphore name
+ * (see hashpipe_status_semname()) with "_history" appended.  Returns 0 (no
+ * error) if the name fit in given size, returns 1 if the name is truncated.
+ */
+int hashpipe_history_name(int instance_id, char * name, size_t size);
+
+/* Create (or re-create) the history ring for instance_id to sample the nkeys
+ * status buffer keys in keys every period seconds, keeping depth samples.
+ * Any existing history for instance_id is discarded.  Only the writer should
+ * call this.  Returns HASHPIPE_OK on success.
+ */
+int hashpipe_history_create(int instance_id, hashpipe_history_t *h,
+        const char **keys, int nkeys, double period, int depth);
+
+/* Attach to an existing history ring (read only).  Returns HASHPIPE_OK on
+ * success or HASHPIPE_ERR_KEY if there is no history ring for instance_id.
+ */
+int hashpipe_history_attach(int instance_id, hashpipe_history_t *h);
+
+/* Detach from (and, if unlink is non-zero, remove) the history ring */
+int hashpipe_history_detach(hashpipe_history_t *h, int unlink);
+
+/* Take one sample of the ring's keys from status buffer s.  Locks s while
+ * reading the keys.  Only the writer should call this.
+ */
+int hashpipe_history_sample(hashpipe_history_t *h, hashpipe_status_t *s);
+
+/* Get up to max of the most recent samples of keyword, oldest first.  Stores
+ * times (in seconds since the epoch) in t and values in v (either may be
+ * NULL).  Returns the number of samples stored, or a negative error code
+ * (HASHPIPE_ERR_KEY if keyword is not being sampled).
+ */
+int hashpipe_history_get(hashpipe_history_t *h, const char *keyword, int max,
+        double *t, double *v);
+
+/* Compute statistics of keyword over the most recent window seconds.  rate is
+ * the change in value per second between the first and last samples in the
+ * window (e.g. packets per second for a packet counter).  Any of rate, min,
+ * and max may be NULL.  Returns the number of samples used (at least 2 are
+ * needed for rate to be valid), or a negative error code.
+ */
+int hashpipe_history_stats(hashpipe_history_t *h, const char *keyword,
+        double window, double *rate, double *min, double *max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _HASHPIPE_HISTORY_H
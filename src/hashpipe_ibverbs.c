@@ -11,6 +11,7 @@
 #include <sys/ioctl.h>
 
 #include "hashpipe_ibverbs.h"
+#include "hashpipe_trace.h"
 
 // Need to include this after including hashpipe_ibverbs.h since
 // HPIBV_USE_MMAP_PKTBUFS may be defined there.
@@ -1136,6 +1137,7 @@ struct hashpipe_ibv_recv_pkt * hashpipe_ibv_recv_pkts(
   int i;
   int poll_rc = 0;
   int num_wce;
+  uint32_t num_pkts = 0;
   uint64_t wr_id;
   struct pollfd pfd;
   struct ibv_qp *qp;
@@ -1248,11 +1250,13 @@ struct hashpipe_ibv_recv_pkt * hashpipe_ibv_recv_pkts(
         recv_tail = recv_tail->next;
       }
     } // for each work completion
+    num_pkts += num_wce;
   } while(num_wce);
 
   // Ensure list is NULL terminated (if we have a list)
   if(recv_tail) {
     recv_tail->next = NULL;
+    hashpipe_trace(HASHPIPE_TRACE_PKT_BATCH, 0, num_pkts);
   }
 
   return recv_head;
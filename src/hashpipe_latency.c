@@ -0,0 +1,250 @@
+/* hashpipe_latency.c
+ *
+ * Block latency tracking.  See hashpipe_latency.h.
+ */
+#define _GNU_SOURCE 1
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "hashpipe_latency.h"
+#include "hashpipe_trace.h"
+#include "hashpipe_futex.h"
+
+// Times of one block (ns of CLOCK_MONOTONIC, 0 if unknown)
+typedef struct {
+    uint64_t origin;
+    uint64_t filled;
+    uint64_t got_free;   // When the producer got the (free) block
+    uint64_t new_origin; // Given by hashpipe_latency_set_origin()
+} block_times_t;
+
+// Times of the blocks of each databuf (by id), allocated on first use
+static block_times_t *block_times[HASHPIPE_TRACE_MAX_DATABUFS];
+
+// Calling thread's histograms (NULL if not recording)
+static __thread hashpipe_latency_t *my_latency = NULL;
+// Oldest origin of input blocks got since calling thread last marked a block
+// filled (0 if none)
+static __thread uint64_t my_pending_origin = 0;
+// Origin of block calling thread last marked filled (0 if none)
+static __thread uint64_t my_last_origin = 0;
+// Non-zero once calling thread has got a filled block
+static __thread int my_has_input = 0;
+
+static block_times_t *get_times(hashpipe_databuf_t *d, int id, int block_id)
+{
+    block_times_t *times, *expected = NULL;
+
+    if(id <= 0 || id >= HASHPIPE_TRACE_MAX_DATABUFS
+    || block_id < 0 || block_id >= d->n_block) {
+        return NULL;
+    }
+    times = __atomic_load_n(&block_times[id], __ATOMIC_ACQUIRE);
+    if(!times) {
+        times = calloc(d->n_block, sizeof(block_times_t));
+        if(!times) {
+            return NULL;
+        }
+        if(!__atomic_compare_exchange_n(&block_times[id], &expected, times, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            // Another thread got there first
+            free(times);
+            times = expected;
+        }
+    }
+    return &times[block_id];
+}
+
+static int bucket(uint64_t ns)
+{
+    int e;
+    if(ns < (1 << HASHPIPE_LATENCY_SUB_BITS)) {
+        return ns;
+    }
+    e = 63 - __builtin_clzll(ns);
+    if(e >= HASHPIPE_LATENCY_MAX_BITS) {
+        return HASHPIPE_LATENCY_NUM_BUCKETS - 1;
+    }
+    return ((e - HASHPIPE_LATENCY_SUB_BITS + 1) << HASHPIPE_LATENCY_SUB_BITS)
+        + ((ns >> (e - HASHPIPE_LATENCY_SUB_BITS))
+                & ((1 << HASHPIPE_LATENCY_SUB_BITS) - 1));
+}
+
+// Returns middle of bucket b in ns
+static double bucket_ns(int b)
+{
+    int e, sub;
+    if(b < (1 << HASHPIPE_LATENCY_SUB_BITS)) {
+        return b;
+    }
+    e = (b >> HASHPIPE_LATENCY_SUB_BITS) + HASHPIPE_LATENCY_SUB_BITS - 1;
+    sub = b & ((1 << HASHPIPE_LATENCY_SUB_BITS) - 1);
+    return ((double)((1 << HASHPIPE_LATENCY_SUB_BITS) + sub) + 0.5)
+        * (double)(1ULL << (e - HASHPIPE_LATENCY_SUB_BITS));
+}
+
+static void record(hashpipe_latency_hist_t *h, uint64_t now, uint64_t then)
+{
+    uint64_t ns = now > then ? now - then : 0;
+    uint64_t max = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    int b = bucket(ns);
+    // Only the owning thread increments counts
+    __atomic_store_n(&h->count[b], h->count[b] + 1, __ATOMIC_RELAXED);
+    while(ns > max && !__atomic_compare_exchange_n(&h->max, &max, ns, 0,
+                __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void hashpipe_latency_set_thread(hashpipe_latency_t *l)
+{
+    my_latency = l;
+    my_pending_origin = 0;
+    my_last_origin = 0;
+    my_has_input = 0;
+}
+
+uint64_t hashpipe_latency_now()
+{
+    return monotonic_ns();
+}
+
+void hashpipe_latency_set_origin(hashpipe_databuf_t *d, int block_id,
+        uint64_t origin_ns)
+{
+    block_times_t *t;
+    if(my_latency
+    && (t = get_times(d, hashpipe_trace_databuf_id(d->semid), block_id))) {
+        t->new_origin = origin_ns;
+    }
+}
+
+uint64_t hashpipe_latency_origin(hashpipe_databuf_t *d, int block_id)
+{
+    block_times_t *t = get_times(d, hashpipe_trace_databuf_id(d->semid),
+            block_id);
+    return t ? t->origin : 0;
+}
+
+void hashpipe_latency_got_free(hashpipe_databuf_t *d, int id, int block_id)
+{
+    block_times_t *t;
+    if(my_latency && (t = get_times(d, id, block_id))) {
+        t->got_free = hashpipe_latency_now();
+    }
+}
+
+void hashpipe_latency_got_filled(hashpipe_databuf_t *d, int id, int block_id)
+{
+    block_times_t *t;
+    if(my_latency && (t = get_times(d, id, block_id))) {
+        my_has_input = 1;
+        if(t->origin && (!my_pending_origin || t->origin < my_pending_origin)) {
+            my_pending_origin = t->origin;
+        }
+    }
+}
+
+void hashpipe_latency_set_filled(hashpipe_databuf_t *d, int id, int block_id)
+{
+    block_times_t *t;
+    uint64_t now, origin;
+
+    if(!my_latency || !(t = get_times(d, id, block_id))) {
+        return;
+    }
+    now = hashpipe_latency_now();
+    if(t->new_origin) {
+        origin = t->new_origin;
+        t->new_origin = 0;
+    } else if(my_pending_origin) {
+        origin = my_pending_origin;
+    } else if(my_has_input && my_last_origin) {
+        origin = my_last_origin;
+    } else {
+        origin = t->got_free ? t->got_free : now;
+    }
+    my_pending_origin = 0;
+    my_last_origin = origin;
+    t->origin = origin;
+    t->filled = now;
+
+    if(!my_has_input) {
+        record(&my_latency->stage, now, t->got_free ? t->got_free : now);
+        record(&my_latency->total, now, origin);
+    }
+    t->got_free = 0;
+}
+
+void hashpipe_latency_set_free(hashpipe_databuf_t *d, int id, int block_id)
+{
+    block_times_t *t;
+    uint64_t now;
+
+    if(!my_latency || !(t = get_times(d, id, block_id)) || !t->filled) {
+        return;
+    }
+    now = hashpipe_latency_now();
+    record(&my_latency->stage, now, t->filled);
+    record(&my_latency->total, now, t->origin);
+    t->filled = 0;
+}
+
+uint64_t hashpipe_latency_delta(hashpipe_latency_hist_t *h,
+        uint64_t delta[HASHPIPE_LATENCY_NUM_BUCKETS], uint64_t *max)
+{
+    uint64_t count, n = 0, m;
+    int i;
+
+    for(i=0; i<HASHPIPE_LATENCY_NUM_BUCKETS; i++) {
+        count = __atomic_load_n(&h->count[i], __ATOMIC_RELAXED);
+        delta[i] += count - h->prev[i];
+        n += count - h->prev[i];
+        h->prev[i] = count;
+    }
+    m = __atomic_exchange_n(&h->max, 0, __ATOMIC_RELAXED);
+    if(m > *max) {
+        *max = m;
+    }
+    return n;
+}
+
+uint64_t hashpipe_latency_stats(
+        const uint64_t delta[HASHPIPE_LATENCY_NUM_BUCKETS], uint64_t max,
+        hashpipe_latency_stats_t *s)
+{
+    uint64_t n = 0, sum = 0, rank50, rank99;
+    int i, have50 = 0;
+
+    memset(s, 0, sizeof(*s));
+    for(i=0; i<HASHPIPE_LATENCY_NUM_BUCKETS; i++) {
+        n += delta[i];
+    }
+    if(n == 0) {
+        return 0;
+    }
+    rank50 = (n + 1) / 2;
+    rank99 = n - n / 100;
+    for(i=0; i<HASHPIPE_LATENCY_NUM_BUCKETS; i++) {
+        sum += delta[i];
+        if(!have50 && sum >= rank50) {
+            s->p50 = bucket_ns(i);
+            have50 = 1;
+        }
+        if(sum >= rank99) {
+            s->p99 = bucket_ns(i);
+            break;
+        }
+    }
+    // Bucket middles can exceed the actual maximum
+    s->max = max;
+    if(max > 0) {
+        if(s->p50 > s->max) s->p50 = s->max;
+        if(s->p99 > s->max) s->p99 = s->max;
+    }
+
+    s->n = n;
+    s->p50 *= 1e-3;
+    s->p99 *= 1e-3;
+    s->max *= 1e-3;
+    return n;
+}
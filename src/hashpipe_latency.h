@@ -0,0 +1,125 @@
+/* hashpipe_latency.h
+ *
+ * Routines dealing with block latency tracking.  When the hashpipe executable
+ * is run with "--latency", the databuf routines keep two times (in ns of
+ * CLOCK_MONOTONIC) for every block of every databuf:
+ *
+ *   origin - When the data of the block entered the pipeline
+ *   filled - When the block was last marked filled
+ *
+ * A block's origin is propagated from the input blocks of the thread that
+ * fills it: when a thread marks a block filled, the block gets the oldest
+ * origin of the input blocks that the thread has waited for since it last
+ * marked a block filled (or the origin of the previous block it filled if it
+ * has not waited for any).  Threads without input blocks (e.g. network
+ * threads) start new origins at the time they got the free block (or, if they
+ * did not wait for it, at the time they mark it filled).  Threads that know
+ * better, e.g. from packet time stamps, can set the origin themselves with
+ * hashpipe_latency_set_origin() before marking the block filled.
+ *
+ * Each pipeline thread records two latency histograms:
+ *
+ *   stage - Time from a block being marked filled until the thread marks it
+ *           free (i.e. time the block spent waiting for and in the stage).
+ *           For threads without input blocks, time from getting a free block
+ *           to marking it filled.
+ *   total - Age of the block's origin at that time
+ *
+ * Once per second the hashpipe executable publishes the 50th and 99th
+ * percentiles and the maximum of the latencies recorded during the last
+ * second (in microseconds) as status buffer keys LS50N, LS99N, LSMXN (stage)
+ * and LT50N, LT99N, LTMXN (total) for the thread with index N (the same index
+ * as CPUSN).  The total latencies of the pipeline's last stages (threads
+ * without output databufs) are combined into the end-to-end latency keys
+ * LE2E50, LE2E99, and LE2EMX.
+ *
+ * Latencies are tracked for databuf IDs below HASHPIPE_TRACE_MAX_DATABUFS
+ * between threads of the same process.  Percentiles are accurate to about 3%.
+ */
+#ifndef _HASHPIPE_LATENCY_H
+#define _HASHPIPE_LATENCY_H
+
+#include <stdint.h>
+#include "hashpipe_databuf.h"
+
+// Histogram buckets are 16 linear sub-buckets per power of 2 of nanoseconds
+// up to 2^40 ns (about 18 minutes, longer latencies go in the last bucket).
+#define HASHPIPE_LATENCY_SUB_BITS 4
+#define HASHPIPE_LATENCY_MAX_BITS 40
+#define HASHPIPE_LATENCY_NUM_BUCKETS \
+    ((HASHPIPE_LATENCY_MAX_BITS - HASHPIPE_LATENCY_SUB_BITS + 1) \
+     << HASHPIPE_LATENCY_SUB_BITS)
+
+typedef struct {
+    uint64_t count[HASHPIPE_LATENCY_NUM_BUCKETS]; // Written by owning thread
+    uint64_t max;  // Maximum latency (ns) since last hashpipe_latency_delta()
+    uint64_t prev[HASHPIPE_LATENCY_NUM_BUCKETS];  // Used by ..._delta()
+} hashpipe_latency_hist_t;
+
+// Latency histograms of one pipeline thread
+typedef struct hashpipe_latency {
+    hashpipe_latency_hist_t stage;
+    hashpipe_latency_hist_t total;
+} hashpipe_latency_t;
+
+// Statistics computed by hashpipe_latency_stats() (in microseconds)
+typedef struct {
+    uint64_t n;
+    double p50;
+    double p99;
+    double max;
+} hashpipe_latency_stats_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Makes the calling thread record its latencies in l (NULL to stop).  Blocks
+ * are only tracked by threads that record latencies.  Used by the hashpipe
+ * executable.
+ */
+void hashpipe_latency_set_thread(hashpipe_latency_t *l);
+
+/* Returns the current time in ns of CLOCK_MONOTONIC */
+uint64_t hashpipe_latency_now();
+
+/* Sets the origin (ns of CLOCK_MONOTONIC) of block_id of d.  Must be called
+ * before marking the block filled.  Time stamps of other clocks (e.g. packet
+ * time stamps of CLOCK_REALTIME) must be converted first.
+ */
+void hashpipe_latency_set_origin(hashpipe_databuf_t *d, int block_id,
+        uint64_t origin_ns);
+
+/* Returns the origin (ns of CLOCK_MONOTONIC) of block_id of d, or 0 if it is
+ * not known.
+ */
+uint64_t hashpipe_latency_origin(hashpipe_databuf_t *d, int block_id);
+
+/* Adds the counts of h since the previous call to delta and raises *max to
+ * the maximum latency (ns) since the previous call.  Only one thread should
+ * call this for a given h.  Returns the number of latencies added.
+ */
+uint64_t hashpipe_latency_delta(hashpipe_latency_hist_t *h,
+        uint64_t delta[HASHPIPE_LATENCY_NUM_BUCKETS], uint64_t *max);
+
+/* Computes statistics of the histogram counts in delta (with maximum max ns)
+ * in s.  Returns the number of latencies in delta.
+ */
+uint64_t hashpipe_latency_stats(
+        const uint64_t delta[HASHPIPE_LATENCY_NUM_BUCKETS], uint64_t max,
+        hashpipe_latency_stats_t *s);
+
+/* Called by the databuf routines (with the databuf's trace ID, see
+ * hashpipe_trace_databuf_id()) after getting a free block, after getting a
+ * filled block, after marking a block filled, and after marking a block free.
+ */
+void hashpipe_latency_got_free(hashpipe_databuf_t *d, int id, int block_id);
+void hashpipe_latency_got_filled(hashpipe_databuf_t *d, int id, int block_id);
+void hashpipe_latency_set_filled(hashpipe_databuf_t *d, int id, int block_id);
+void hashpipe_latency_set_free(hashpipe_databuf_t *d, int id, int block_id);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _HASHPIPE_LATENCY_H
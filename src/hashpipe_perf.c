@@ -0,0 +1,147 @@
+/* hashpipe_perf.c
+ *
+ * Per thread performance counters.  See hashpipe_perf.h.
+ */
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#include "hashpipe_perf.h"
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} counters[HASHPIPE_PERF_NUM_COUNTERS] = {
+    [HASHPIPE_PERF_CYCLES] =
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [HASHPIPE_PERF_INSTRUCTIONS] =
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [HASHPIPE_PERF_LLC_MISSES] =
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [HASHPIPE_PERF_CONTEXT_SWITCHES] =
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+    [HASHPIPE_PERF_TASK_CLOCK] =
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}
+};
+
+static int perf_event_open(struct perf_event_attr *attr)
+{
+    // Calling thread, any CPU, no group
+    return syscall(SYS_perf_event_open, attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+}
+
+void hashpipe_perf_init(hashpipe_perf_t *p)
+{
+    int i;
+    memset(p, 0, sizeof(*p));
+    for(i=0; i<HASHPIPE_PERF_NUM_COUNTERS; i++) {
+        p->fd[i] = -1;
+    }
+}
+
+int hashpipe_perf_open(hashpipe_perf_t *p)
+{
+    struct perf_event_attr attr;
+    int i, n = 0;
+
+    hashpipe_perf_init(p);
+    for(i=0; i<HASHPIPE_PERF_NUM_COUNTERS; i++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counters[i].type;
+        attr.config = counters[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+                         | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        attr.exclude_hv = 1;
+        p->fd[i] = perf_event_open(&attr);
+        if(p->fd[i] < 0 && (errno == EACCES || errno == EPERM)) {
+            // Not allowed to count in the kernel, count user space only
+            attr.exclude_kernel = 1;
+            p->fd[i] = perf_event_open(&attr);
+        }
+        if(p->fd[i] >= 0) {
+            n++;
+        }
+    }
+
+    // Start the clock for hashpipe_perf_sample()
+    hashpipe_perf_read(p, p->last);
+    clock_gettime(CLOCK_MONOTONIC, &p->last_time);
+    return n;
+}
+
+void hashpipe_perf_close(hashpipe_perf_t *p)
+{
+    int i;
+    for(i=0; i<HASHPIPE_PERF_NUM_COUNTERS; i++) {
+        if(p->fd[i] >= 0) {
+            close(p->fd[i]);
+            p->fd[i] = -1;
+        }
+    }
+}
+
+int hashpipe_perf_read(hashpipe_perf_t *p,
+        uint64_t values[HASHPIPE_PERF_NUM_COUNTERS])
+{
+    // value, time enabled, time running
+    uint64_t buf[3];
+    int i, rv = -1;
+
+    for(i=0; i<HASHPIPE_PERF_NUM_COUNTERS; i++) {
+        values[i] = 0;
+        if(p->fd[i] < 0 || read(p->fd[i], buf, sizeof(buf)) != sizeof(buf)) {
+            continue;
+        }
+        // Scale for the time the counter was multiplexed out
+        if(buf[2] > 0 && buf[2] < buf[1]) {
+            buf[0] = (uint64_t)((double)buf[0] * buf[1] / buf[2]);
+        }
+        values[i] = buf[0];
+        rv = 0;
+    }
+    return rv;
+}
+
+int hashpipe_perf_sample(hashpipe_perf_t *p, hashpipe_perf_rates_t *rates)
+{
+    uint64_t now[HASHPIPE_PERF_NUM_COUNTERS];
+    double d[HASHPIPE_PERF_NUM_COUNTERS];
+    struct timespec t;
+    double dt;
+    int i;
+
+    if(hashpipe_perf_read(p, now)) {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    dt = (t.tv_sec - p->last_time.tv_sec)
+       + 1e-9 * (t.tv_nsec - p->last_time.tv_nsec);
+    for(i=0; i<HASHPIPE_PERF_NUM_COUNTERS; i++) {
+        d[i] = p->fd[i] >= 0 ? (double)(now[i] - p->last[i]) : -1;
+        p->last[i] = now[i];
+    }
+    p->last_time = t;
+
+#define HAVE(c) (p->fd[HASHPIPE_PERF_##c] >= 0)
+#define DELTA(c) (d[HASHPIPE_PERF_##c])
+    rates->ipc = HAVE(CYCLES) && HAVE(INSTRUCTIONS) && DELTA(CYCLES) > 0
+        ? DELTA(INSTRUCTIONS) / DELTA(CYCLES) : -1;
+    rates->ghz = HAVE(CYCLES) && HAVE(TASK_CLOCK) && DELTA(TASK_CLOCK) > 0
+        ? DELTA(CYCLES) / DELTA(TASK_CLOCK) : -1;
+    rates->llc_mpki = HAVE(LLC_MISSES) && HAVE(INSTRUCTIONS)
+        && DELTA(INSTRUCTIONS) > 0
+        ? 1000 * DELTA(LLC_MISSES) / DELTA(INSTRUCTIONS) : -1;
+    rates->csw_per_sec = HAVE(CONTEXT_SWITCHES) && dt > 0
+        ? DELTA(CONTEXT_SWITCHES) / dt : -1;
+    rates->cpu = HAVE(TASK_CLOCK) && dt > 0
+        ? 1e-9 * DELTA(TASK_CLOCK) / dt : -1;
+#undef HAVE
+#undef DELTA
+
+    return 0;
+}
@@ -0,0 +1,89 @@
+/* hashpipe_perf.h
+ *
+ * Routines dealing with per thread hardware performance counters (via Linux's
+ * perf_event_open).  When the hashpipe executable is run with "--perf", each
+ * pipeline thread opens its counters before its run function is called, and
+ * once per second the hashpipe executable publishes the following status
+ * buffer keys for the thread with index N (the same index as CPUSN):
+ *
+ *   PIPCN  - Instructions per cycle
+ *   PGHZN  - Cycles per second of CPU time (i.e. effective clock rate, which
+ *            drops when the CPU is throttled)
+ *   PMPKN  - Last level cache misses per 1000 instructions
+ *   PCSWN  - Context switches per second
+ *   PCPUN  - Fraction of one CPU used
+ *
+ * Counters that the CPU (or virtual machine) does not provide are skipped and
+ * their keys are not published.  When /proc/sys/kernel/perf_event_paranoid
+ * prevents counting in the kernel, only user space is counted.
+ *
+ * Threads can also read their counters themselves (e.g. around processing a
+ * block) with hashpipe_perf_read(&args->perf, values).
+ */
+#ifndef _HASHPIPE_PERF_H
+#define _HASHPIPE_PERF_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Indexes of counters
+enum hashpipe_perf_counter {
+    HASHPIPE_PERF_CYCLES = 0,
+    HASHPIPE_PERF_INSTRUCTIONS,
+    HASHPIPE_PERF_LLC_MISSES,
+    HASHPIPE_PERF_CONTEXT_SWITCHES,
+    HASHPIPE_PERF_TASK_CLOCK, // Nanoseconds on CPU
+    HASHPIPE_PERF_NUM_COUNTERS
+};
+
+typedef struct hashpipe_perf {
+    int fd[HASHPIPE_PERF_NUM_COUNTERS]; // -1 if not counting
+    // Used by hashpipe_perf_sample()
+    uint64_t last[HASHPIPE_PERF_NUM_COUNTERS];
+    struct timespec last_time;
+} hashpipe_perf_t;
+
+// Rates computed by hashpipe_perf_sample().  Values that are not available
+// are negative.
+typedef struct {
+    double ipc;
+    double ghz;
+    double llc_mpki;
+    double csw_per_sec;
+    double cpu;
+} hashpipe_perf_rates_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Marks all counters of p as not counting */
+void hashpipe_perf_init(hashpipe_perf_t *p);
+
+/* Opens the counters of p for the calling thread.  Returns the number of
+ * counters opened (0 if perf events are not available).
+ */
+int hashpipe_perf_open(hashpipe_perf_t *p);
+
+/* Closes the counters of p */
+void hashpipe_perf_close(hashpipe_perf_t *p);
+
+/* Stores the current value of each counter of p in values (0 for counters
+ * that are not counting).  Values are scaled up when the kernel had to
+ * multiplex counters.  Can be called from any thread.  Returns 0 on success
+ * or -1 if no counters are open.
+ */
+int hashpipe_perf_read(hashpipe_perf_t *p,
+        uint64_t values[HASHPIPE_PERF_NUM_COUNTERS]);
+
+/* Stores the rates since the previous call (or since the counters were
+ * opened) in rates.  Only one thread should sample a given p.  Returns 0 on
+ * success or -1 if no counters are open.
+ */
+int hashpipe_perf_sample(hashpipe_perf_t *p, hashpipe_perf_rates_t *rates);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _HASHPIPE_PERF_H
@@ -27,6 +27,7 @@
 #include <poll.h>
 
 #include "hashpipe_pktsock.h"
+#include "hashpipe_trace.h"
 
 //#define PKTSOCK_PROTO ETH_P_ALL
 #define PKTSOCK_PROTO ETH_P_IP
@@ -34,6 +35,10 @@
 #define BLOCK_SIZE(p_ps) \
   (p_ps->frame_size * p_ps->nframes / p_ps->nblocks)
 
+// Number of frames received by the calling thread since it last found a ring
+// empty (traced as a HASHPIPE_TRACE_PKT_BATCH event when it does)
+static __thread uint32_t frames_in_batch = 0;
+
 // p_ps->s_tpr should be initialized by caller with desired ring parameters.
 // ifname should specify the name of the interface to bind to (e.g. "eth2").
 // ring_type should be PACKET_RX_RING or PACKET_TX_RING.
@@ -107,8 +112,13 @@ unsigned char * hashpipe_pktsock_recv_frame_nonblock(struct hashpipe_pktsock *p_
 
   // If frame has not yet been received, return NULL
   if(!(TPACKET_HDR(frame, tp_status) & TP_STATUS_USER)) {
+    if(frames_in_batch) {
+      hashpipe_trace(HASHPIPE_TRACE_PKT_BATCH, 0, frames_in_batch);
+      frames_in_batch = 0;
+    }
     return NULL;
   }
+  frames_in_batch++;
 
   // Advance next_idx
   p_ps->next_idx++;
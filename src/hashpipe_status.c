@@ -3,9 +3,11 @@
  * Implementation of the status routines described 
  * in hashpipe_status.h
  */
+#define _GNU_SOURCE 1
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <limits.h>
 #include <sys/ipc.h>
 #include <sys/shm.h>
@@ -14,12 +16,50 @@
 #include <fcntl.h>
 #include <semaphore.h>
 #include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
 
 #include "hashpipe_ipckey.h"
 #include "hashpipe_status.h"
 #include "hashpipe_error.h"
+#include "hashpipe_trace.h"
+#include "hashpipe_futex.h"
 #include "fitshead.h"
 
+// Size of the default status shared memory segment
+#define HASHPIPE_STATUS_SHM_SIZE \
+    (HASHPIPE_STATUS_TOTAL_SIZE + HASHPIPE_STATUS_CTRL_SIZE)
+
+// The status buffer (if any) that is currently locked by the calling thread.
+// This is how the hput/hdel functions find the control block of the buffer
+// they are modifying.
+static __thread hashpipe_status_t *locked_status = NULL;
+// Non-zero if locked_status has been changed since it was locked.
+static __thread int locked_status_changed = 0;
+// The status buffer (if any) that the calling thread failed to lock because
+// its most recent lock attempt timed out.
+static __thread hashpipe_status_t *locked_status_failed = NULL;
+// Thread ID and name of the calling thread (for lock instrumentation).
+static __thread pid_t my_tid = 0;
+static __thread char my_name[16];
+
+/* Hash keyword for key_gen and index lookups.  Like ksearch(), this is case
+ * insensitive and only considers the first 8 characters of keyword.
+ */
+static uint32_t hashpipe_status_key_hash(const char *keyword)
+{
+    int i;
+    uint32_t h = 2166136261u; // FNV-1a
+    for(i=0; i<8 && keyword[i] && keyword[i] != ' ' && keyword[i] != '='; i++) {
+        h ^= (unsigned char)toupper(keyword[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
 /*
  * Stores the hashpipe status (POSIX) semaphore name in semid buffer of length
  * size.  Returns 0 (no error) if semaphore name fit in given size, returns 1
@@ -78,13 +118,48 @@ int hashpipe_status_exists(int instance_id)
         hashpipe_error("hashpipe_status_attach", "hashpipe_status_key error");
         return 0;
     }
-    int shmid = shmget(key, HASHPIPE_STATUS_TOTAL_SIZE, 0666);
+    int shmid = shmget(key, 0, 0666);
     return (shmid==-1) ? 0 : 1;
 }
 
+/* Returns the buffer size to use when creating a new status buffer */
+static size_t hashpipe_status_new_size()
+{
+    size_t size = HASHPIPE_STATUS_TOTAL_SIZE;
+    const char * envstr = getenv("HASHPIPE_STATUS_SIZE");
+    if(envstr) {
+        size = strtoul(envstr, NULL, 0);
+        // Round up to multiple of 2880 (i.e. 36 records)
+        size = (size + 2879) / 2880 * 2880;
+        if(size < HASHPIPE_STATUS_TOTAL_SIZE) {
+            size = HASHPIPE_STATUS_TOTAL_SIZE;
+        } else if(size > HASHPIPE_STATUS_MAX_SIZE) {
+            hashpipe_warn("hashpipe_status_attach",
+                "HASHPIPE_STATUS_SIZE too large, using %d",
+                HASHPIPE_STATUS_MAX_SIZE);
+            size = HASHPIPE_STATUS_MAX_SIZE;
+        }
+    }
+    return size;
+}
+
+/* Allocate index for s (s->size must be set) */
+static void hashpipe_status_index_alloc(hashpipe_status_t *s)
+{
+    // Use at least four index entries per card to keep probe sequences short
+    size_t n = 1024;
+    while(n < 4 * s->size / HASHPIPE_STATUS_RECORD_SIZE) {
+        n *= 2;
+    }
+    s->index = (uint32_t *)calloc(n, sizeof(uint32_t));
+    s->index_mask = s->index ? n - 1 : 0;
+}
+
 int hashpipe_status_attach(int instance_id, hashpipe_status_t *s)
 {
+    static int warned_no_ctrl = 0;
     char semid[NAME_MAX] = {'\0'};
+    size_t size;
     instance_id &= 0x3f;
     s->instance_id = instance_id;
 
@@ -94,7 +169,14 @@ int hashpipe_status_attach(int instance_id, hashpipe_status_t *s)
         hashpipe_error("hashpipe_status_attach", "hashpipe_status_key error");
         return(0);
     }
-    s->shmid = shmget(key, HASHPIPE_STATUS_TOTAL_SIZE, 0666 | IPC_CREAT);
+    size = hashpipe_status_new_size();
+    s->shmid = shmget(key, size + HASHPIPE_STATUS_CTRL_SIZE, 0666 | IPC_CREAT);
+    if (s->shmid==-1 && errno==EINVAL) {
+        // Segment exists, but it is smaller than we want.  This happens if it
+        // was created with a smaller size or by an older version of HASHPIPE
+        // (or an external tool).  Attach to it anyway and use its size.
+        s->shmid = shmget(key, 0, 0666);
+    }
     if (s->shmid==-1) { 
         hashpipe_error("hashpipe_status_attach", "shmget error");
         return(HASHPIPE_ERR_SYS);
@@ -109,6 +191,32 @@ int hashpipe_status_attach(int instance_id, hashpipe_status_t *s)
         return(HASHPIPE_ERR_SYS);
     }
 
+    /* Locate control block, if the segment is big enough to have one */
+    struct shmid_ds ds;
+    if(shmctl(s->shmid, IPC_STAT, &ds) != 0) {
+        ds.shm_segsz = HASHPIPE_STATUS_TOTAL_SIZE;
+    }
+    if(ds.shm_segsz >= HASHPIPE_STATUS_SHM_SIZE) {
+        s->size = ds.shm_segsz - HASHPIPE_STATUS_CTRL_SIZE;
+        s->ctrl = (hashpipe_status_ctrl_t *)(s->buf + s->size);
+        if(s->size != size && getenv("HASHPIPE_STATUS_SIZE")) {
+            hashpipe_warn("hashpipe_status_attach",
+                "existing status buffer size is %lu, not %lu "
+                "(use hashpipe_clean_shmem -d to recreate it)",
+                (unsigned long)s->size, (unsigned long)size);
+        }
+    } else {
+        s->size = ds.shm_segsz < HASHPIPE_STATUS_TOTAL_SIZE ?
+            ds.shm_segsz : HASHPIPE_STATUS_TOTAL_SIZE;
+        s->ctrl = NULL;
+        if(!warned_no_ctrl) {
+            hashpipe_warn("hashpipe_status_attach",
+                "status buffer has no control block "
+                "(use hashpipe_clean_shmem -d to recreate it)");
+            warned_no_ctrl = 1;
+        }
+    }
+
     /*
      * Get the semaphore name.  Return error on truncation.
      */
@@ -128,6 +236,9 @@ int hashpipe_status_attach(int instance_id, hashpipe_status_t *s)
         return(HASHPIPE_ERR_SYS);
     }
 
+    /* Allocate keyword index (lookups still work without it) */
+    hashpipe_status_index_alloc(s);
+
     /* Init buffer if needed */
     hashpipe_status_chkinit(s);
 
@@ -142,27 +253,226 @@ int hashpipe_status_detach(hashpipe_status_t *s) {
           return HASHPIPE_ERR_SYS;
       }
       s->buf = NULL;
+      s->ctrl = NULL;
+      free(s->index);
+      s->index = NULL;
+      s->index_mask = 0;
     }
     return HASHPIPE_OK;
 }
 
-/* TODO: put in some (long, ~few sec) timeout */
+/* Note that s has been locked by the calling thread, which waited wait_ns
+ * nanoseconds for it (t_ns is the current CLOCK_MONOTONIC time or 0).
+ */
+static void hashpipe_status_set_locked(hashpipe_status_t *s, int64_t wait_ns,
+        int64_t t_ns)
+{
+    hashpipe_status_ctrl_t *c = s->ctrl;
+
+    hashpipe_trace(HASHPIPE_TRACE_LOCKED, 0,
+            wait_ns < UINT32_MAX ? wait_ns : UINT32_MAX);
+
+    locked_status = s;
+    locked_status_changed = 0;
+    locked_status_failed = NULL;
+
+    if(c) {
+        if(!my_tid) {
+            my_tid = syscall(SYS_gettid);
+            prctl(PR_GET_NAME, my_name, 0, 0, 0);
+        }
+        __atomic_store_n(&c->holder_pid, getpid(), __ATOMIC_RELEASE);
+        c->last_pid = getpid();
+        c->last_tid = my_tid;
+        memcpy(c->last_name, my_name, sizeof(c->last_name));
+        c->lock_count++;
+        if(wait_ns > 0) {
+            c->lock_wait_ns += wait_ns;
+            if(c->lock_wait_max_ns < wait_ns) {
+                c->lock_wait_max_ns = wait_ns;
+            }
+        }
+        c->lock_time_ns = t_ns ? t_ns : monotonic_ns();
+    }
+}
+
+/* Called when a lock attempt on s has been waiting for a while.  Logs who is
+ * holding the lock and, if the holder is a process that no longer exists,
+ * takes the lock over from it.  Returns 1 if the lock was taken over.
+ */
+static int hashpipe_status_check_holder(hashpipe_status_t *s, int64_t waited)
+{
+    hashpipe_status_ctrl_t *c = s->ctrl;
+    uint32_t pid;
+
+    if(!c) {
+        hashpipe_warn("hashpipe_status_lock",
+            "waited %.1f s for status buffer lock", waited / 1e9);
+        return 0;
+    }
+
+    pid = __atomic_load_n(&c->holder_pid, __ATOMIC_ACQUIRE);
+    if(pid == 0) {
+        // Locked by something that does not record itself as the holder
+        // (e.g. an older version of HASHPIPE or an external tool).
+        hashpipe_warn("hashpipe_status_lock",
+            "waited %.1f s for status buffer lock held by unknown process "
+            "(last holder was '%s' pid %u tid %u)", waited / 1e9,
+            c->last_name, c->last_pid, c->last_tid);
+        return 0;
+    }
+
+    if(kill(pid, 0) == -1 && errno == ESRCH) {
+        // Holder died with the lock held.  Only one waiter may take over.
+        if(__atomic_compare_exchange_n(&c->holder_pid, &pid, getpid(), 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            hashpipe_warn("hashpipe_status_lock",
+                "taking over status buffer lock from dead process %u "
+                "('%s' tid %u)", pid, c->last_name, c->last_tid);
+            __atomic_add_fetch(&c->lock_recoveries, 1, __ATOMIC_RELAXED);
+            return 1;
+        }
+        return 0;
+    }
+
+    hashpipe_warn("hashpipe_status_lock",
+        "waited %.1f s for status buffer lock held by '%s' pid %u tid %u "
+        "for %.1f s", waited / 1e9, c->last_name, pid, c->last_tid,
+        (monotonic_ns() - c->lock_time_ns) / 1e9);
+    return 0;
+}
+
+/* Lock s, waiting at most timeout_ns nanoseconds (forever if negative) */
+static int hashpipe_status_lock_ns(hashpipe_status_t *s, int64_t timeout_ns,
+        int busywait)
+{
+    const int64_t warn_ns = HASHPIPE_STATUS_LOCK_WARN * 1000000000LL;
+    int64_t start, now, next_check, slice;
+    struct timespec deadline;
+    int rv;
+
+    // Fast path
+    if(sem_trywait(s->lock) == 0) {
+        hashpipe_status_set_locked(s, 0, 0);
+        return HASHPIPE_OK;
+    } else if(errno != EAGAIN && errno != EINTR) {
+        return HASHPIPE_ERR_SYS;
+    }
+
+    hashpipe_trace(HASHPIPE_TRACE_LOCK_WAIT, 0, 0);
+    start = now = monotonic_ns();
+    next_check = start + warn_ns;
+    while(1) {
+        if(timeout_ns >= 0 && now - start >= timeout_ns) {
+            if(s->ctrl) {
+                __atomic_add_fetch(&s->ctrl->lock_timeouts, 1,
+                        __ATOMIC_RELAXED);
+            }
+            hashpipe_error("hashpipe_status_lock",
+                "timed out after %.1f s waiting for status buffer lock",
+                (now - start) / 1e9);
+            locked_status_failed = s;
+            errno = ETIMEDOUT;
+            return HASHPIPE_TIMEOUT;
+        }
+
+        if(now >= next_check) {
+            if(hashpipe_status_check_holder(s, now - start)) {
+                // Took over lock (semaphore is still 0)
+                hashpipe_status_set_locked(s, now - start, now);
+                return HASHPIPE_OK;
+            }
+            next_check = now + warn_ns;
+        }
+
+        if(busywait) {
+            rv = sem_trywait(s->lock);
+        } else {
+            // Sleep until next check or timeout, whichever comes first
+            slice = next_check - now;
+            if(timeout_ns >= 0 && start + timeout_ns - now < slice) {
+                slice = start + timeout_ns - now;
+            }
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += slice / 1000000000;
+            deadline.tv_nsec += slice % 1000000000;
+            if(deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000;
+            }
+            rv = sem_timedwait(s->lock, &deadline);
+        }
+
+        now = monotonic_ns();
+        if(rv == 0) {
+            hashpipe_status_set_locked(s, now - start, now);
+            return HASHPIPE_OK;
+        } else if(errno != EAGAIN && errno != ETIMEDOUT && errno != EINTR) {
+            return HASHPIPE_ERR_SYS;
+        }
+    }
+}
+
+/* Returns default lock timeout in nanoseconds (negative means forever) */
+static int64_t hashpipe_status_lock_default_timeout()
+{
+    static int64_t timeout_ns = 0; // 0 means not yet determined
+    const char * envstr;
+    double timeout;
+
+    if(timeout_ns == 0) {
+        envstr = getenv("HASHPIPE_STATUS_LOCK_TIMEOUT");
+        timeout = envstr ? strtod(envstr, NULL) : 0;
+        timeout_ns = timeout > 0 ? (int64_t)(timeout * 1e9) : -1;
+    }
+    return timeout_ns;
+}
+
+// These never time out because callers (e.g. the *_safe macros) write to the
+// buffer without checking whether they got the lock.
 int hashpipe_status_lock(hashpipe_status_t *s) {
-    return(sem_wait(s->lock));
+    return hashpipe_status_lock_ns(s, -1, 0);
 }
 
-/* TODO: put in some (long, ~few sec) timeout */
 int hashpipe_status_lock_busywait(hashpipe_status_t *s) {
-    int rv;
-    do {
-      rv = sem_trywait(s->lock);
-    } while (rv == -1 && errno == EAGAIN);
-    return rv;
+    return hashpipe_status_lock_ns(s, -1, 1);
+}
+
+int hashpipe_status_lock_timeout(hashpipe_status_t *s,
+        const struct timespec *timeout)
+{
+    return hashpipe_status_lock_ns(s, timeout ?
+            timeout->tv_sec * 1000000000LL + timeout->tv_nsec
+            : hashpipe_status_lock_default_timeout(), 0);
 }
 
 int hashpipe_status_unlock(hashpipe_status_t *s) {
+    int rv;
+    int changed = 0;
     int lock_val = 0;
 
+    // Do not unlock if the last attempt to lock s timed out, since someone
+    // else holds the lock.
+    if(locked_status_failed == s) {
+      hashpipe_warn(__FUNCTION__, "not unlocking status buffer that could "
+          "not be locked");
+      locked_status_failed = NULL;
+      return 0;
+    }
+
+    if(locked_status == s) {
+        changed = locked_status_changed;
+        locked_status = NULL;
+        locked_status_changed = 0;
+        // Update hold time statistic
+        if(s->ctrl) {
+            int64_t hold = monotonic_ns() - s->ctrl->lock_time_ns;
+            if(s->ctrl->lock_hold_max_ns < hold) {
+                s->ctrl->lock_hold_max_ns = hold;
+            }
+        }
+    }
+
     // Get semaphore value
     if(sem_getvalue(s->lock, &lock_val)) {
       hashpipe_error(__FUNCTION__,
@@ -173,8 +483,21 @@ int hashpipe_status_unlock(hashpipe_status_t *s) {
     }
     // If locked
     if(lock_val < 1) {
+      // No longer held by anyone
+      if(s->ctrl) {
+        __atomic_store_n(&s->ctrl->holder_pid, 0, __ATOMIC_RELEASE);
+      }
       // Unlock it
-      return sem_post(s->lock);
+      rv = sem_post(s->lock);
+      hashpipe_trace(HASHPIPE_TRACE_UNLOCKED, 0, 0);
+      // Notify waiters of changes (if any)
+      if(changed && s->ctrl) {
+        __atomic_add_fetch(&s->ctrl->generation, 1, __ATOMIC_SEQ_CST);
+        if(__atomic_load_n(&s->ctrl->waiters, __ATOMIC_SEQ_CST)) {
+          futex_wake_all(&s->ctrl->generation);
+        }
+      }
+      return rv;
     } else {
       hashpipe_warn(__FUNCTION__, "status buffer already unlocked");
     }
@@ -183,14 +506,269 @@ int hashpipe_status_unlock(hashpipe_status_t *s) {
     return 0;
 }
 
+void hashpipe_status_note_change(const char *buf, const char *keyword)
+{
+    hashpipe_status_t *s = locked_status;
+    if(s && s->buf == buf && s->ctrl) {
+        __atomic_add_fetch(&s->ctrl->key_gen[hashpipe_status_key_hash(keyword) % HASHPIPE_STATUS_KEY_GENS],
+            1, __ATOMIC_RELEASE);
+        locked_status_changed = 1;
+    }
+}
+
+char *hashpipe_status_end_hint(const char *buf)
+{
+    hashpipe_status_t *s = locked_status;
+    char *end;
+    if(!s || s->buf != buf || !s->ctrl
+    || s->ctrl->hlength < HASHPIPE_STATUS_RECORD_SIZE
+    || s->ctrl->hlength > s->size) {
+        return NULL;
+    }
+    end = s->buf + s->ctrl->hlength - HASHPIPE_STATUS_RECORD_SIZE;
+    // Make sure the cached END card is still (the first) END card in case the
+    // buffer was changed by something that does not maintain the cache.
+    if(strncmp(end, "END", 3) || (end[3] != ' ' && end[3] != '\0')
+    || (end > s->buf && !strncmp(end-HASHPIPE_STATUS_RECORD_SIZE, "END", 3)
+        && (end[3-HASHPIPE_STATUS_RECORD_SIZE] == ' '
+         || end[3-HASHPIPE_STATUS_RECORD_SIZE] == '\0'))) {
+        s->ctrl->hlength = 0;
+        return NULL;
+    }
+    return end;
+}
+
+void hashpipe_status_note_end(const char *buf, const char *end)
+{
+    hashpipe_status_t *s = locked_status;
+    if(s && s->buf == buf && s->ctrl) {
+        s->ctrl->hlength = end ? end - buf + HASHPIPE_STATUS_RECORD_SIZE : 0;
+    }
+}
+
+size_t hashpipe_status_capacity(const char *buf)
+{
+    hashpipe_status_t *s = locked_status;
+    return (s && s->buf == buf) ? s->size : 0;
+}
+
+// Maximum number of index entries examined for a keyword
+#define HASHPIPE_STATUS_INDEX_PROBES 16
+
+/* Returns non-zero if card (which must be within s->buf) starts with keyword
+ * (a keyword of at most 8 characters).  This is a quick check for index
+ * lookups; ksearch() does the full check.
+ */
+static int hashpipe_status_card_is(const char *card, const char *keyword)
+{
+    size_t len = strnlen(keyword, 8);
+    return strncasecmp(card, keyword, len) == 0
+        && (len == 8 || card[len] == ' ' || card[len] == '=');
+}
+
+char *hashpipe_status_index_get(const char *buf, const char *keyword)
+{
+    hashpipe_status_t *s = locked_status;
+    uint32_t h, i, card;
+    if(!s || s->buf != buf || !s->index) {
+        return NULL;
+    }
+    h = hashpipe_status_key_hash(keyword);
+    for(i=0; i<HASHPIPE_STATUS_INDEX_PROBES; i++) {
+        card = s->index[(h + i) & s->index_mask];
+        if(card == 0) {
+            break;
+        }
+        if(card <= s->size / HASHPIPE_STATUS_RECORD_SIZE
+        && hashpipe_status_card_is(
+                s->buf + (card - 1) * HASHPIPE_STATUS_RECORD_SIZE, keyword)) {
+            return s->buf + (card - 1) * HASHPIPE_STATUS_RECORD_SIZE;
+        }
+    }
+    return NULL;
+}
+
+void hashpipe_status_index_put(const char *buf, const char *keyword,
+        const char *card)
+{
+    hashpipe_status_t *s = locked_status;
+    uint32_t h, i, slot, old;
+    if(!s || s->buf != buf || !s->index) {
+        return;
+    }
+    h = hashpipe_status_key_hash(keyword);
+    // Use the entry for keyword or the first unused entry.  Entries that
+    // point to cards that have moved are not reclaimed, so if there is no
+    // room, evict whatever is in the keyword's first entry.
+    slot = h & s->index_mask;
+    for(i=0; i<HASHPIPE_STATUS_INDEX_PROBES; i++) {
+        old = s->index[(h + i) & s->index_mask];
+        if(old == 0 || (old <= s->size / HASHPIPE_STATUS_RECORD_SIZE
+        && hashpipe_status_card_is(
+                s->buf + (old - 1) * HASHPIPE_STATUS_RECORD_SIZE, keyword))) {
+            slot = (h + i) & s->index_mask;
+            break;
+        }
+    }
+    s->index[slot] = (card - buf) / HASHPIPE_STATUS_RECORD_SIZE + 1;
+}
+
+/* Note that every key of s has changed (s must be locked) */
+static void hashpipe_status_note_all_changed(hashpipe_status_t *s)
+{
+    int i;
+    if(s->ctrl) {
+        // END card may have moved
+        s->ctrl->hlength = 0;
+        for(i=0; i<HASHPIPE_STATUS_KEY_GENS; i++) {
+            __atomic_add_fetch(&s->ctrl->key_gen[i], 1, __ATOMIC_RELEASE);
+        }
+        if(locked_status == s) {
+            locked_status_changed = 1;
+        }
+    }
+}
+
+uint32_t hashpipe_status_generation(hashpipe_status_t *s)
+{
+    if(!s->ctrl) {
+        return 0;
+    }
+    return __atomic_load_n(&s->ctrl->generation, __ATOMIC_ACQUIRE);
+}
+
+uint32_t hashpipe_status_key_generation(hashpipe_status_t *s,
+        const char *keyword)
+{
+    if(!s->ctrl) {
+        return 0;
+    }
+    return __atomic_load_n(&s->ctrl->key_gen[hashpipe_status_key_hash(keyword) % HASHPIPE_STATUS_KEY_GENS],
+        __ATOMIC_ACQUIRE);
+}
+
+/* Sets *remaining to the time remaining until deadline.  Returns 0 if deadline
+ * has passed.
+ */
+static int time_remaining(const struct timespec *deadline,
+        struct timespec *remaining)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    remaining->tv_sec = deadline->tv_sec - now.tv_sec;
+    remaining->tv_nsec = deadline->tv_nsec - now.tv_nsec;
+    if(remaining->tv_nsec < 0) {
+        remaining->tv_sec--;
+        remaining->tv_nsec += 1000000000;
+    }
+    return remaining->tv_sec >= 0;
+}
+
+/* Waits for global generation to differ from gen or for deadline to pass.
+ * Caller must have already incremented ctrl->waiters.
+ */
+static int hashpipe_status_futex_wait(hashpipe_status_t *s, uint32_t gen,
+        const struct timespec *deadline)
+{
+    struct timespec remaining;
+    struct timespec *timeout = NULL;
+
+    if(deadline) {
+        if(!time_remaining(deadline, &remaining)) {
+            return HASHPIPE_TIMEOUT;
+        }
+        timeout = &remaining;
+    }
+    if(futex_wait(&s->ctrl->generation, gen, timeout) == -1) {
+        if(errno == ETIMEDOUT) {
+            return HASHPIPE_TIMEOUT;
+        } else if(errno == EINTR) {
+            return HASHPIPE_ERR_SYS;
+        } else if(errno != EAGAIN) {
+            hashpipe_error(__FUNCTION__, "futex wait error");
+            return HASHPIPE_ERR_SYS;
+        }
+    }
+    return HASHPIPE_OK;
+}
+
+/* Computes deadline from timeout (NULL means no deadline) */
+static struct timespec *get_deadline(const struct timespec *timeout,
+        struct timespec *deadline)
+{
+    if(!timeout) {
+        return NULL;
+    }
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout->tv_sec;
+    deadline->tv_nsec += timeout->tv_nsec;
+    if(deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+int hashpipe_status_wait_change(hashpipe_status_t *s, uint32_t *generation,
+        const struct timespec *timeout)
+{
+    return hashpipe_status_wait_key_change(s, NULL, generation, timeout);
+}
+
+/* If keyword is NULL, wait for a change of the global generation */
+int hashpipe_status_wait_key_change(hashpipe_status_t *s, const char *keyword,
+        uint32_t *key_generation, const struct timespec *timeout)
+{
+    int rv = HASHPIPE_OK;
+    uint32_t gen, key_gen;
+    uint32_t *key_gen_ptr;
+    struct timespec deadline_ts;
+    struct timespec *deadline;
+
+    if(!s->ctrl) {
+        return HASHPIPE_ERR_GEN;
+    }
+
+    key_gen_ptr = keyword
+        ? &s->ctrl->key_gen[hashpipe_status_key_hash(keyword) % HASHPIPE_STATUS_KEY_GENS]
+        : &s->ctrl->generation;
+
+    deadline = get_deadline(timeout, &deadline_ts);
+
+    __atomic_add_fetch(&s->ctrl->waiters, 1, __ATOMIC_SEQ_CST);
+    while(1) {
+        // Global generation must be loaded before the key generation is
+        // checked so that a change between the check and the wait will cause
+        // the wait to return immediately.
+        gen = __atomic_load_n(&s->ctrl->generation, __ATOMIC_SEQ_CST);
+        key_gen = __atomic_load_n(key_gen_ptr, __ATOMIC_SEQ_CST);
+        if(key_gen != *key_generation) {
+            *key_generation = key_gen;
+            rv = HASHPIPE_OK;
+            break;
+        }
+        rv = hashpipe_status_futex_wait(s, gen, deadline);
+        if(rv != HASHPIPE_OK) {
+            break;
+        }
+    }
+    __atomic_sub_fetch(&s->ctrl->waiters, 1, __ATOMIC_SEQ_CST);
+
+    return rv;
+}
+
 /* Return pointer to END key */
 static
-char *hashpipe_find_end(char *buf) {
+char *hashpipe_find_end(hashpipe_status_t *s) {
     /* Loop over fixed size records */
-    int offs;
-    char *out=NULL;
-    for (offs=0; offs<HASHPIPE_STATUS_TOTAL_SIZE; offs+=HASHPIPE_STATUS_RECORD_SIZE) {
-        if (strncmp(&buf[offs], "END", 3)==0) { out=&buf[offs]; break; }
+    size_t offs;
+    char *out;
+    /* Use cached location if possible */
+    if((out=hashpipe_status_end_hint(s->buf))) {
+        return out;
+    }
+    for (offs=0; offs<s->size; offs+=HASHPIPE_STATUS_RECORD_SIZE) {
+        if (strncmp(&s->buf[offs], "END", 3)==0) { out=&s->buf[offs]; break; }
     }
     return(out);
 }
@@ -201,18 +779,37 @@ void hashpipe_status_chkinit(hashpipe_status_t *s)
     int instance_id = -1;
 
     /* Lock */
-    hashpipe_status_lock(s);
+    if (hashpipe_status_lock(s)) {
+        hashpipe_error(__FUNCTION__, "could not lock status buffer");
+        return;
+    }
+
+    /* Initialize control block if needed */
+    if (s->ctrl && (s->ctrl->magic != HASHPIPE_STATUS_CTRL_MAGIC
+                 || s->ctrl->version != HASHPIPE_STATUS_CTRL_VERSION)) {
+        memset(s->ctrl, 0, sizeof(hashpipe_status_ctrl_t));
+        s->ctrl->magic = HASHPIPE_STATUS_CTRL_MAGIC;
+        s->ctrl->version = HASHPIPE_STATUS_CTRL_VERSION;
+        /* We hold the lock */
+        s->ctrl->holder_pid = getpid();
+        s->ctrl->lock_time_ns = monotonic_ns();
+    }
+    if (s->ctrl) {
+        s->ctrl->size = s->size;
+    }
 
     /* If no END, clear it out */
-    if (hashpipe_find_end(s->buf)==NULL) {
+    if (hashpipe_find_end(s)==NULL) {
         /* Zero bufer */
-        memset(s->buf, 0, HASHPIPE_STATUS_TOTAL_SIZE);
+        memset(s->buf, 0, s->size);
         /* Fill first record w/ spaces */
         memset(s->buf, ' ', HASHPIPE_STATUS_RECORD_SIZE);
         /* add END */
         strncpy(s->buf, "END", 3);
         // Add INSTANCE record
         hputi4(s->buf, "INSTANCE", s->instance_id);
+        // Every key has changed
+        hashpipe_status_note_all_changed(s);
     } else {
         // Check INSTANCE record
         if(!hgeti4(s->buf, "INSTANCE", &instance_id)) {
@@ -236,10 +833,13 @@ void hashpipe_status_chkinit(hashpipe_status_t *s)
 void hashpipe_status_clear(hashpipe_status_t *s) {
 
     /* Lock */
-    hashpipe_status_lock(s);
+    if (hashpipe_status_lock(s)) {
+        hashpipe_error(__FUNCTION__, "could not lock status buffer");
+        return;
+    }
 
     /* Zero bufer */
-    memset(s->buf, 0, HASHPIPE_STATUS_TOTAL_SIZE);
+    memset(s->buf, 0, s->size);
     /* Fill first record w/ spaces */
     memset(s->buf, ' ', HASHPIPE_STATUS_RECORD_SIZE);
     /* add END */
@@ -247,6 +847,223 @@ void hashpipe_status_clear(hashpipe_status_t *s) {
 
     hputi4(s->buf, "INSTANCE", s->instance_id);
 
+    /* Every key has changed */
+    hashpipe_status_note_all_changed(s);
+
     /* Unlock */
     hashpipe_status_unlock(s);
 }
+
+// Lock statistics as of the last hashpipe_status_publish_lock_stats() of the
+// calling thread (right after it took the lock to publish them, so they
+// include its own lock acquisition)
+static __thread uint64_t published_count = -1;
+static __thread uint64_t published_wait_ns = -1;
+static __thread uint64_t published_wait_max_ns = -1;
+static __thread uint64_t published_hold_max_ns = -1;
+static __thread uint32_t published_timeouts = -1;
+static __thread uint32_t published_recoveries = -1;
+
+void hashpipe_status_publish_lock_stats(hashpipe_status_t *s)
+{
+    hashpipe_status_ctrl_t *c = s->ctrl;
+    if(!c) {
+        return;
+    }
+    // Skip publishing (and locking, which would change LOCKCNT by itself)
+    // unless someone else has used the lock since last time.
+    if(c->lock_count == published_count
+    && c->lock_wait_ns == published_wait_ns
+    && c->lock_wait_max_ns == published_wait_max_ns
+    && c->lock_hold_max_ns == published_hold_max_ns
+    && c->lock_timeouts == published_timeouts
+    && c->lock_recoveries == published_recoveries) {
+        return;
+    }
+    if(hashpipe_status_lock(s)) {
+        return;
+    }
+    published_count = c->lock_count;
+    published_wait_ns = c->lock_wait_ns;
+    published_wait_max_ns = c->lock_wait_max_ns;
+    published_hold_max_ns = c->lock_hold_max_ns;
+    published_timeouts = c->lock_timeouts;
+    published_recoveries = c->lock_recoveries;
+    hputu8(s->buf, "LOCKCNT", c->lock_count);
+    hputr8(s->buf, "LOCKWAIT", c->lock_wait_ns / 1e9);
+    hputr8(s->buf, "LOCKMAXW", c->lock_wait_max_ns / 1e9);
+    hputr8(s->buf, "LOCKMAXH", c->lock_hold_max_ns / 1e9);
+    hputu4(s->buf, "LOCKTOUT", c->lock_timeouts);
+    hputu4(s->buf, "LOCKRCVR", c->lock_recoveries);
+    hashpipe_status_unlock(s);
+}
+
+int hashpipe_status_snapshot(hashpipe_status_t *s,
+        hashpipe_status_snapshot_t *snap)
+{
+    char *end;
+    size_t len;
+    int rv;
+
+    /* Nothing to do if nothing has changed since the last snapshot */
+    if(snap->buf && s->ctrl
+    && snap->generation == hashpipe_status_generation(s)) {
+        return HASHPIPE_OK;
+    }
+
+    /* Make sure there is room for the entire buffer (plus NUL) up front so
+     * that nothing needs to be allocated while holding the lock.
+     */
+    if(snap->size < s->size + 1) {
+        char *buf = realloc(snap->buf, s->size + 1);
+        if(!buf) {
+            hashpipe_error(__FUNCTION__, "realloc");
+            return HASHPIPE_ERR_SYS;
+        }
+        snap->buf = buf;
+        snap->size = s->size + 1;
+    }
+
+    if((rv = hashpipe_status_lock(s))) {
+        return rv;
+    }
+    end = hashpipe_find_end(s);
+    len = end ? end + HASHPIPE_STATUS_RECORD_SIZE - s->buf : s->size;
+    memcpy(snap->buf, s->buf, len);
+    snap->generation = hashpipe_status_generation(s);
+    hashpipe_status_unlock(s);
+
+    snap->buf[len] = '\0';
+    snap->len = len;
+
+    return HASHPIPE_OK;
+}
+
+void hashpipe_status_snapshot_free(hashpipe_status_snapshot_t *snap)
+{
+    free(snap->buf);
+    memset(snap, 0, sizeof(hashpipe_status_snapshot_t));
+}
+
+int hashpipe_status_card_keyword(const char *card, char *key)
+{
+    int i;
+    for(i=0; i<8 && card[i] && card[i] != ' ' && card[i] != '='; i++) {
+        key[i] = card[i];
+    }
+    key[i] = '\0';
+    return i > 0 && card[8] == '=';
+}
+
+int hashpipe_status_card_value(const char *card, char *value)
+{
+    const char *p = card + 9;
+    const char *end = card + HASHPIPE_STATUS_RECORD_SIZE;
+    char *v = value;
+
+    while(p < end && *p == ' ') {
+        p++;
+    }
+    if(p < end && *p == '\'') {
+        // Quoted string, '' is an embedded quote
+        for(p++; p < end && *p; p++) {
+            if(*p == '\'') {
+                if(p+1 < end && p[1] == '\'') {
+                    p++;
+                } else {
+                    break;
+                }
+            }
+            *v++ = *p;
+        }
+        while(v > value && v[-1] == ' ') {
+            v--;
+        }
+        *v = '\0';
+        return 1;
+    }
+    // Unquoted value ends at comment or blank
+    while(p < end && *p && *p != ' ' && *p != '/') {
+        *v++ = *p++;
+    }
+    *v = '\0';
+    return 0;
+}
+
+/* Returns the card for key in snapshot buffer buf of length len, trying the
+ * card at offset hint first (cards only move when a key before them is
+ * deleted).  Returns NULL if key is not found.
+ */
+static const char *find_card(const char *buf, size_t len, size_t hint,
+        const char *key)
+{
+    char cardkey[9];
+    size_t offs;
+
+    if(hint + HASHPIPE_STATUS_RECORD_SIZE <= len
+    && hashpipe_status_card_keyword(buf+hint, cardkey)
+    && !strcmp(cardkey, key)) {
+        return buf + hint;
+    }
+    for(offs=0; offs+HASHPIPE_STATUS_RECORD_SIZE <= len;
+            offs+=HASHPIPE_STATUS_RECORD_SIZE) {
+        if(hashpipe_status_card_keyword(buf+offs, cardkey)
+        && !strcmp(cardkey, key)) {
+            return buf + offs;
+        }
+    }
+    return NULL;
+}
+
+int hashpipe_status_snapshot_changes(const hashpipe_status_snapshot_t *cur,
+        const hashpipe_status_snapshot_t *prev,
+        hashpipe_status_change_func_t func, void *data)
+{
+    char key[9];
+    const char *card, *pcard;
+    size_t offs, shift;
+    int n = 0;
+
+    // New and changed keys.  shift tracks how far cards have moved so that
+    // deleting one key does not turn every later lookup into a scan.
+    shift = 0;
+    for(offs=0; offs+HASHPIPE_STATUS_RECORD_SIZE <= cur->len;
+            offs+=HASHPIPE_STATUS_RECORD_SIZE) {
+        card = cur->buf + offs;
+        if(!hashpipe_status_card_keyword(card, key)) {
+            continue;
+        }
+        if(prev) {
+            pcard = find_card(prev->buf, prev->len, offs+shift, key);
+            if(pcard) {
+                shift = pcard - prev->buf - offs;
+                if(!memcmp(card, pcard, HASHPIPE_STATUS_RECORD_SIZE)) {
+                    continue;
+                }
+            }
+        }
+        func(key, card, data);
+        n++;
+    }
+
+    // Deleted keys
+    if(prev) {
+        shift = 0;
+        for(offs=0; offs+HASHPIPE_STATUS_RECORD_SIZE <= prev->len;
+                offs+=HASHPIPE_STATUS_RECORD_SIZE) {
+            pcard = prev->buf + offs;
+            if(!hashpipe_status_card_keyword(pcard, key)) {
+                continue;
+            }
+            card = find_card(cur->buf, cur->len, offs+shift, key);
+            if(card) {
+                shift = card - cur->buf - offs;
+            } else {
+                func(key, NULL, data);
+                n++;
+            }
+        }
+    }
+
+    return n;
+}
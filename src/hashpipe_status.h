@@ -7,6 +7,8 @@
 #ifndef _HASHPIPE_STATUS_H
 #define _HASHPIPE_STATUS_H
 
+#include <stdint.h>
+#include <time.h>
 #include <semaphore.h>
 
 // fitshead.h does not need to be included here, but it is likely to be
@@ -14,19 +16,69 @@
 // client.
 #include "fitshead.h"
 
-#define HASHPIPE_STATUS_TOTAL_SIZE (2880*64) // FITS-style buffer
+#define HASHPIPE_STATUS_TOTAL_SIZE (2880*64) // Default FITS-style buffer size
+#define HASHPIPE_STATUS_MAX_SIZE (HASHPIPE_STATUS_TOTAL_SIZE*256) // Max size
 #define HASHPIPE_STATUS_RECORD_SIZE 80 // Size of each record (e.g. FITS "card")
 
+// The status shared memory segment consists of the FITS-style buffer followed
+// by a control block.  The control block holds bookkeeping information that
+// is not part of the FITS-style buffer itself (e.g. change generation
+// counters).  Putting it after the buffer keeps the buffer at the start of the
+// segment so that external tools that know nothing of the control block can
+// still attach to the segment and use the buffer as before.  The control
+// block occupies the last HASHPIPE_STATUS_CTRL_SIZE bytes of the segment, so
+// the size of the buffer is the segment size minus HASHPIPE_STATUS_CTRL_SIZE.
+#define HASHPIPE_STATUS_CTRL_SIZE (8*1024)
+#define HASHPIPE_STATUS_CTRL_MAGIC 0x48505354 // "HPST"
+#define HASHPIPE_STATUS_CTRL_VERSION 4
+
+// Number of per-key change generation counters in the control block.  Keys
+// are hashed into these counters so unrelated keys may share a counter.  This
+// can cause spurious wakeups of hashpipe_status_wait_key_change(), but it will
+// never cause a change to go unnoticed.
+#define HASHPIPE_STATUS_KEY_GENS 1024
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/* Structure describes status memory area */
+/* Structure describes status control block (lives in shared memory) */
+typedef struct {
+    uint32_t magic;      /* HASHPIPE_STATUS_CTRL_MAGIC once initialized */
+    uint32_t version;    /* HASHPIPE_STATUS_CTRL_VERSION */
+    uint32_t generation; /* Bumped on unlock after any change (futex word) */
+    uint32_t waiters;    /* Number of processes/threads waiting for changes */
+    uint32_t hlength;    /* Length of header through END card (0 if unknown) */
+    uint32_t size;       /* Size of the FITS-style buffer in bytes */
+    /* Lock instrumentation (only updated by hashpipe_status_lock et al.) */
+    uint32_t holder_pid; /* PID of current lock holder (0 if unlocked/unknown) */
+    uint32_t last_pid;   /* PID of most recent lock holder */
+    uint32_t last_tid;   /* Thread ID of most recent lock holder */
+    char last_name[16];  /* Thread name of most recent lock holder */
+    uint32_t lock_timeouts;   /* Number of lock attempts that timed out */
+    uint32_t lock_recoveries; /* Number of locks taken over from dead holders */
+    int64_t lock_time_ns;     /* CLOCK_MONOTONIC time lock was last acquired */
+    uint64_t lock_count;      /* Number of lock acquisitions */
+    uint64_t lock_wait_ns;    /* Total time spent waiting for the lock */
+    uint64_t lock_wait_max_ns; /* Longest wait for the lock */
+    uint64_t lock_hold_max_ns; /* Longest time the lock was held */
+    uint32_t key_gen[HASHPIPE_STATUS_KEY_GENS]; /* Per-key generations */
+} hashpipe_status_ctrl_t;
+
+/* Structure describes status memory area.  The size, ctrl, index, and
+ * index_mask fields were added after the original four, so plugins compiled
+ * against an older hashpipe_status.h (or hashpipe.h, which embeds this
+ * structure in hashpipe_thread_args_t) must be rebuilt.
+ */
 typedef struct {
     int instance_id; /* Instance ID of this status buffer (DO NOT SET/CHANGE!) */
     int shmid;   /* Shared memory segment id */
     sem_t *lock; /* POSIX semaphore descriptor for locking */
     char *buf;   /* Pointer to data area */
+    size_t size; /* Size of data area in bytes */
+    hashpipe_status_ctrl_t *ctrl; /* Pointer to control block (or NULL) */
+    uint32_t *index;     /* Card index cache for keyword lookups (or NULL) */
+    uint32_t index_mask; /* Number of index entries minus one */
 } hashpipe_status_t;
 
 /*
@@ -50,6 +102,13 @@ int hashpipe_status_exists(int instance_id);
 /* Return a pointer to the status shared mem area,
  * creating it if it doesn't exist.  Attaches/creates
  * lock semaphore as well.  Returns nonzero on error.
+ *
+ * The size of the FITS-style buffer of a newly created status shared memory
+ * segment is $HASHPIPE_STATUS_SIZE bytes (if defined in the environment,
+ * rounded up to a multiple of 2880) or HASHPIPE_STATUS_TOTAL_SIZE.  The size
+ * of an existing segment is not changed; s->size is set to the actual size.
+ * An existing segment must be deleted (e.g. with "hashpipe_clean_shmem -d")
+ * for a new size to take effect.
  */
 int hashpipe_status_attach(int instance_id, hashpipe_status_t *s);
 
@@ -60,11 +119,86 @@ int hashpipe_status_detach(hashpipe_status_t *s);
  * waiting for the buffer to become unlocked.  hashpipe_status_lock_busywait
  * will busy-wait while waiting for the buffer to become unlocked.  Return
  * non-zero on errors.
+ *
+ * Both wait for as long as it takes.  hashpipe_status_lock_timeout() waits for
+ * at most timeout, or (if timeout is NULL) for at most
+ * $HASHPIPE_STATUS_LOCK_TIMEOUT seconds if that is defined in the environment
+ * and greater than zero (otherwise forever).  It returns HASHPIPE_TIMEOUT if
+ * the timeout expires, in which case the caller does NOT hold the lock and
+ * must not touch the buffer.  The *_safe macros below cannot skip the code
+ * they guard, so they never time out.  While waiting, a warning identifying
+ * the lock holder is logged every HASHPIPE_STATUS_LOCK_WARN seconds.  If the
+ * holder is a process that no longer exists, the lock is taken over from it.
+ *
+ * Calling hashpipe_status_unlock() after a lock attempt that timed out is a
+ * no-op (with a warning) rather than releasing someone else's lock.
  */
+#define HASHPIPE_STATUS_LOCK_WARN 5
 int hashpipe_status_lock(hashpipe_status_t *s);
 int hashpipe_status_lock_busywait(hashpipe_status_t *s);
+int hashpipe_status_lock_timeout(hashpipe_status_t *s,
+        const struct timespec *timeout);
 int hashpipe_status_unlock(hashpipe_status_t *s);
 
+/* Store lock statistics from the control block in the status buffer (which
+ * must NOT be locked by the caller) as LOCKCNT (number of acquisitions),
+ * LOCKWAIT (total wait time in seconds), LOCKMAXW (longest wait in seconds),
+ * LOCKMAXH (longest hold time in seconds), LOCKTOUT (number of timeouts), and
+ * LOCKRCVR (number of locks taken over from dead holders).  The hashpipe
+ * executable calls this once per second.  Nothing is written (and the lock is
+ * not taken) if nobody else has used the lock since the calling thread last
+ * published the statistics, so an idle status buffer stays unchanged.
+ */
+void hashpipe_status_publish_lock_stats(hashpipe_status_t *s);
+
+/* Structure describes a private copy of the status buffer.  Zero initialize
+ * before first use.  The memory pointed to by buf is owned by the caller and
+ * is reused (and grown as needed) by each hashpipe_status_snapshot() call.
+ */
+typedef struct {
+    char *buf;           /* Copy of status buffer through END (NUL terminated) */
+    size_t size;         /* Allocated size of buf in bytes */
+    size_t len;          /* Length of copy through END card in bytes */
+    uint32_t generation; /* Status buffer generation at time of copy */
+} hashpipe_status_snapshot_t;
+
+/* Copy the used portion of the status buffer (through the END card) into
+ * snap while holding the lock only for the copy.  The usual hget functions
+ * (including hgetv) can then be used on snap->buf without locking.  If the
+ * status buffer has not changed since snap was last taken (according to its
+ * generation counter), snap is left as is without locking.  Returns
+ * HASHPIPE_OK on success, HASHPIPE_TIMEOUT if the lock could not be acquired,
+ * or HASHPIPE_ERR_SYS if memory could not be allocated.  The status buffer
+ * must NOT be locked by the caller.
+ */
+int hashpipe_status_snapshot(hashpipe_status_t *s,
+        hashpipe_status_snapshot_t *snap);
+
+/* Free the memory of snap (and zero it so it can be reused) */
+void hashpipe_status_snapshot_free(hashpipe_status_snapshot_t *snap);
+
+/* Calls func for each key of snapshot cur that has been added or changed
+ * since snapshot prev (every key of cur if prev is NULL), passing the key's
+ * card in cur, and for each key of prev that has been deleted from cur,
+ * passing a NULL card.  Returns the number of calls made to func.
+ */
+typedef void (* hashpipe_status_change_func_t)(const char *key,
+        const char *card, void *data);
+int hashpipe_status_snapshot_changes(const hashpipe_status_snapshot_t *cur,
+        const hashpipe_status_snapshot_t *prev,
+        hashpipe_status_change_func_t func, void *data);
+
+/* Stores the keyword of card in key (which must have room for 9 chars).
+ * Returns non-zero if card has a value (i.e. "=" in column 9).
+ */
+int hashpipe_status_card_keyword(const char *card, char *key);
+
+/* Stores the value of card in value (which must have room for 81 chars).
+ * Quotes are removed from string values (and trailing blanks stripped).
+ * Returns non-zero if the value is a string.
+ */
+int hashpipe_status_card_value(const char *card, char *value);
+
 /* Check the buffer for appropriate formatting (existence of "END").
  * If not found, zero it out and add END.
  */
@@ -73,6 +207,68 @@ void hashpipe_status_chkinit(hashpipe_status_t *s);
 /* Clear out whole buffer */
 void hashpipe_status_clear(hashpipe_status_t *s);
 
+/* Change notification.  Every time the status buffer is unlocked after one or
+ * more keys have been added, changed, or deleted by the hput/hdel functions,
+ * the global generation counter is incremented and any waiters are woken up.
+ * The per-key generation counter of each changed key is incremented as well.
+ * Putting a key with its current value is not considered a change.
+ *
+ * hashpipe_status_generation() and hashpipe_status_key_generation() return
+ * the current global or per-key generation value.  They do not require the
+ * status buffer to be locked.
+ *
+ * hashpipe_status_wait_change() sleeps until the global generation differs
+ * from *generation, then stores the new generation value in *generation.
+ * hashpipe_status_wait_key_change() does likewise for the generation of the
+ * given keyword.  Neither function must be called with the status buffer
+ * locked.  A NULL timeout means wait forever.  Both return HASHPIPE_OK on
+ * change, HASHPIPE_TIMEOUT on timeout, HASHPIPE_ERR_SYS if interrupted by a
+ * signal, or HASHPIPE_ERR_GEN if the status shared memory segment has no
+ * control block (e.g. it was created by an older version of HASHPIPE).
+ */
+uint32_t hashpipe_status_generation(hashpipe_status_t *s);
+uint32_t hashpipe_status_key_generation(hashpipe_status_t *s,
+        const char *keyword);
+int hashpipe_status_wait_change(hashpipe_status_t *s, uint32_t *generation,
+        const struct timespec *timeout);
+int hashpipe_status_wait_key_change(hashpipe_status_t *s, const char *keyword,
+        uint32_t *key_generation, const struct timespec *timeout);
+
+/* Called by the hput/hdel functions to note that keyword has been changed in
+ * buf.  This is a no-op unless buf belongs to a status buffer that is
+ * currently locked by the calling thread.  Not intended for use by clients.
+ */
+void hashpipe_status_note_change(const char *buf, const char *keyword);
+
+/* Called by ksearch() and the hput/hdel functions to get or set the location
+ * of the END card of buf.  The location is cached in the control block so
+ * that finding the end of the header does not require scanning it.
+ * hashpipe_status_end_hint() returns NULL if buf does not belong to a status
+ * buffer that is currently locked by the calling thread or if the cached
+ * location is unknown or stale.  hashpipe_status_note_end() is a no-op unless
+ * buf belongs to a status buffer that is currently locked by the calling
+ * thread.  Not intended for use by clients.
+ */
+char *hashpipe_status_end_hint(const char *buf);
+void hashpipe_status_note_end(const char *buf, const char *end);
+
+/* Called by the hput functions to get the size of buf when adding a card.
+ * Returns 0 (unknown size) unless buf belongs to a status buffer that is
+ * currently locked by the calling thread.  Not intended for use by clients.
+ */
+size_t hashpipe_status_capacity(const char *buf);
+
+/* Called by ksearch() to get or set the card most recently found for keyword
+ * in buf.  This per-process index lets lookups in large status buffers skip
+ * scanning.  Cards returned by hashpipe_status_index_get() are only a hint
+ * and must be verified by the caller.  Both functions are no-ops unless buf
+ * belongs to a status buffer that is currently locked by the calling thread.
+ * Not intended for use by clients.
+ */
+char *hashpipe_status_index_get(const char *buf, const char *keyword);
+void hashpipe_status_index_put(const char *buf, const char *keyword,
+        const char *card);
+
 // Thread-safe lock/unlock macros for status buffer used to ensure that the
 // status buffer is not left in a locked state.  Each hashpipe_status_lock_safe
 // or hashpipe_status_lock_busywait_safe must be paired with a
@@ -0,0 +1,145 @@
+/* hashpipe_status_bench.c
+ *
+ * Microbenchmark of the FITS header routines (hget/hput/ksearch) on a full
+ * status buffer.  Not installed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+#include <string.h>
+#include <time.h>
+
+#include "fitshead.h"
+#include "hashpipe_status.h"
+
+void usage()
+{
+    printf(
+            "Usage: hashpipe_status_bench [options]\n"
+            "Options:\n"
+            "  -h,   --help\n"
+            "  -n N, --iterations=N  Calls per routine  [10000]\n"
+            "  -s N, --size=N        Buffer size (bytes) [%d]\n",
+            HASHPIPE_STATUS_TOTAL_SIZE
+            );
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+// Prints time per call of the routine timed since t0
+static void report(const char *name, double t0, long n)
+{
+    printf("%-16s %8.1f ns/call\n", name, 1e9 * (now() - t0) / n);
+}
+
+int main(int argc, char *argv[])
+{
+    static struct option long_opts[] = {
+        {"help",       0, NULL, 'h'},
+        {"iterations", 1, NULL, 'n'},
+        {"size",       1, NULL, 's'},
+        {0,0,0,0}
+    };
+    int opt, size = HASHPIPE_STATUS_TOTAL_SIZE, nkeys, ival = 0;
+    long i, n = 10000;
+    double t0, dval = 0;
+    char *buf, key[16], last[16], sval[80];
+
+    while ((opt=getopt_long(argc,argv,"hn:s:",long_opts,NULL))!=-1) {
+        switch (opt) {
+            case 'n':
+                n = strtol(optarg, NULL, 0);
+                break;
+            case 's':
+                size = strtol(optarg, NULL, 0);
+                break;
+            case 'h':
+            default:
+                usage();
+                exit(0);
+                break;
+        }
+    }
+    if(n < 1 || size < 2*HASHPIPE_STATUS_RECORD_SIZE) {
+        usage();
+        exit(1);
+    }
+
+    // Fill buffer with keys, leaving room for END
+    buf = malloc(size + 1);
+    if(!buf) {
+        perror("malloc");
+        exit(1);
+    }
+    memset(buf, ' ', size);
+    buf[size] = '\0';
+    memcpy(buf, "END", 3);
+    nkeys = size / HASHPIPE_STATUS_RECORD_SIZE - 1;
+    for(i=0; i<nkeys; i++) {
+        snprintf(key, sizeof(key), "K%07ld", i);
+        if(i % 3 == 0) {
+            hputi4(buf, key, i);
+        } else if(i % 3 == 1) {
+            hputr8(buf, key, i / 7.0);
+        } else {
+            hputs(buf, key, "some string value");
+        }
+    }
+    // The last key is the worst case for searching
+    snprintf(last, sizeof(last), "K%07d", nkeys - 1);
+    printf("%d keys in %d bytes, %ld calls per routine, last key %s\n",
+            nkeys, size, n, last);
+
+    t0 = now();
+    for(i=0; i<n; i++) {
+        if(!ksearch(buf, last)) {
+            fprintf(stderr, "ksearch failed\n");
+            exit(1);
+        }
+    }
+    report("ksearch", t0, n);
+
+    t0 = now();
+    for(i=0; i<n; i++) {
+        hputi4(buf, last, (int)i);
+    }
+    report("hputi4", t0, n);
+
+    t0 = now();
+    for(i=0; i<n; i++) {
+        hgeti4(buf, last, &ival);
+    }
+    report("hgeti4", t0, n);
+
+    t0 = now();
+    for(i=0; i<n; i++) {
+        hputr8(buf, last, i * 0.001);
+    }
+    report("hputr8", t0, n);
+
+    t0 = now();
+    for(i=0; i<n; i++) {
+        hgetr8(buf, last, &dval);
+    }
+    report("hgetr8", t0, n);
+
+    t0 = now();
+    for(i=0; i<n; i++) {
+        hputs(buf, last, "some string value");
+    }
+    report("hputs", t0, n);
+
+    t0 = now();
+    for(i=0; i<n; i++) {
+        hgets(buf, last, sizeof(sval), sval);
+    }
+    report("hgets", t0, n);
+
+    free(buf);
+    return 0;
+}
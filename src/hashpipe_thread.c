@@ -2,31 +2,84 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sched.h>
+#include <pthread.h>
 #include <string.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include "hashpipe.h"
 
+// Accessed with __atomic builtins since it is shared by all threads
 static int run_threads_flag = 1;
 
+// Args of the calling pipeline thread (NULL for other threads)
+static __thread hashpipe_thread_args_t *my_thread_args = NULL;
+
 static hashpipe_thread_desc_t *thread_list[MAX_HASHPIPE_THREADS];
 static int num_threads = 0;
 
 // Functions to query the run threads flag
 int run_threads()
 {
-  return run_threads_flag;
+  hashpipe_thread_args_t *args = my_thread_args;
+  if(args) {
+    if(!args->ready) {
+      hashpipe_thread_ready();
+    }
+    hashpipe_thread_heartbeat(0);
+    // Stopped individually (e.g. while draining the pipeline)
+    if(__atomic_load_n(&args->stop, __ATOMIC_ACQUIRE)) {
+      return 0;
+    }
+  }
+  return __atomic_load_n(&run_threads_flag, __ATOMIC_ACQUIRE);
+}
+
+void hashpipe_thread_set_args(hashpipe_thread_args_t *args)
+{
+  my_thread_args = args;
+}
+
+void hashpipe_thread_heartbeat(int waiting)
+{
+  hashpipe_thread_args_t *args = my_thread_args;
+  if(args) {
+    // Only the owning thread writes these
+    __atomic_store_n(&args->waiting, waiting, __ATOMIC_RELAXED);
+    __atomic_store_n(&args->heartbeat, args->heartbeat + 1, __ATOMIC_RELEASE);
+  }
+}
+
+uint64_t hashpipe_worker_first_seq(const hashpipe_thread_args_t *args)
+{
+  return args->worker_index;
+}
+
+uint64_t hashpipe_worker_next_seq(const hashpipe_thread_args_t *args,
+        uint64_t seq)
+{
+  return seq + (args->num_workers > 1 ? args->num_workers : 1);
+}
+
+void hashpipe_thread_ready()
+{
+  hashpipe_thread_args_t *args = my_thread_args;
+  if(args && !args->ready) {
+    pthread_mutex_lock(&args->finished_m);
+    args->ready = 1;
+    pthread_cond_broadcast(&args->finished_c);
+    pthread_mutex_unlock(&args->finished_m);
+  }
 }
 
 // Functions to set and clear the run threads flag
 void set_run_threads()
 {
-  run_threads_flag = 1;
+  __atomic_store_n(&run_threads_flag, 1, __ATOMIC_RELEASE);
 }
 
 void clear_run_threads()
 {
-  run_threads_flag = 0;
+  __atomic_store_n(&run_threads_flag, 0, __ATOMIC_RELEASE);
 }
 
 // Register a thread descriptor
@@ -99,7 +152,8 @@ list_hashpipe_threads(FILE * f)
 unsigned int
 get_cpu_affinity()
 {
-    int i, mask=0;
+    int i;
+    unsigned int mask=0;
     cpu_set_t cpuset;
     CPU_ZERO(&cpuset);
 
@@ -108,14 +162,250 @@ get_cpu_affinity()
         hashpipe_error(__FUNCTION__, "Error getting cpu affinity.");
         return 0;
     }
-    if(mask != 0) {
-        // Only handle 32 cores (for now)
-        for(i=31; i<=0; i--) {
-            mask <<= 1;
-            if(CPU_ISSET(i, &cpuset)) {
-              mask |= 1;
-            }
+    // Only CPUs 0 to 31 fit in the mask
+    for(i=31; i>=0; i--) {
+        mask <<= 1;
+        if(CPU_ISSET(i, &cpuset)) {
+          mask |= 1;
         }
     }
     return mask;
 }
+
+int
+hashpipe_node_cpus(int node, cpu_set_t *set)
+{
+    char path[80];
+    char list[4096];
+    FILE *f;
+    int rv;
+
+    snprintf(path, sizeof(path),
+        "/sys/devices/system/node/node%d/cpulist", node);
+    if(node < 0 || !(f = fopen(path, "r"))) {
+        return -1;
+    }
+    if(!fgets(list, sizeof(list), f)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    list[strcspn(list, "\n")] = '\0';
+
+    CPU_ZERO(set);
+    rv = hashpipe_cpulist_parse(list, set);
+    return rv ? rv : CPU_COUNT(set) ? 0 : -1;
+}
+
+int
+hashpipe_cpulist_parse(const char *s, cpu_set_t *set)
+{
+    cpu_set_t node_set;
+    char *end;
+    long first, last, stride, i;
+
+    CPU_ZERO(set);
+    while(*s) {
+        if(!strncmp(s, "node:", 5)) {
+            // All CPUs of a NUMA node
+            first = strtol(s+5, &end, 10);
+            if(end == s+5 || hashpipe_node_cpus(first, &node_set)) {
+                return -1;
+            }
+            CPU_OR(set, set, &node_set);
+        } else {
+            // N, N-M, or N-M:S
+            first = last = strtol(s, &end, 10);
+            if(end == s || first < 0) {
+                return -1;
+            }
+            stride = 1;
+            if(*end == '-') {
+                s = end + 1;
+                last = strtol(s, &end, 10);
+                if(end == s || last < first) {
+                    return -1;
+                }
+                if(*end == ':') {
+                    s = end + 1;
+                    stride = strtol(s, &end, 10);
+                    if(end == s || stride < 1) {
+                        return -1;
+                    }
+                }
+            }
+            if(last >= CPU_SETSIZE) {
+                return -1;
+            }
+            for(i=first; i<=last; i+=stride) {
+                CPU_SET(i, set);
+            }
+        }
+        if(*end == ',') {
+            end++;
+        } else if(*end) {
+            return -1;
+        }
+        s = end;
+    }
+    return 0;
+}
+
+int
+hashpipe_cpumask_parse(const char *s, cpu_set_t *set)
+{
+    const char *p;
+    int cpu = 0, nibble, b;
+    unsigned long long mask;
+    char *end;
+
+    CPU_ZERO(set);
+    if(strncasecmp(s, "0x", 2)) {
+        // Decimal (or octal) mask of up to 64 CPUs
+        mask = strtoull(s, &end, 0);
+        if(end == s || *end) {
+            return -1;
+        }
+        for(cpu=0; mask; cpu++, mask>>=1) {
+            if(mask & 1) {
+                CPU_SET(cpu, set);
+            }
+        }
+        return 0;
+    }
+
+    // Hexadecimal mask of any length (commas, as in /proc masks, ignored)
+    s += 2;
+    if(!*s) {
+        return -1;
+    }
+    for(p = s + strlen(s) - 1; p >= s; p--) {
+        if(*p == ',') {
+            continue;
+        }
+        if(*p >= '0' && *p <= '9') {
+            nibble = *p - '0';
+        } else if(*p >= 'a' && *p <= 'f') {
+            nibble = *p - 'a' + 10;
+        } else if(*p >= 'A' && *p <= 'F') {
+            nibble = *p - 'A' + 10;
+        } else {
+            return -1;
+        }
+        for(b=0; b<4; b++, cpu++) {
+            if(nibble & (1<<b)) {
+                if(cpu >= CPU_SETSIZE) {
+                    return -1;
+                }
+                CPU_SET(cpu, set);
+            }
+        }
+    }
+    return 0;
+}
+
+char *
+hashpipe_cpulist_format(const cpu_set_t *set, char *buf, size_t size)
+{
+    int i, j;
+    char range[32];
+    size_t len = 0, n;
+
+    if(size == 0) {
+        return buf;
+    }
+    buf[0] = '\0';
+    for(i=0; i<CPU_SETSIZE; i++) {
+        if(!CPU_ISSET(i, set)) {
+            continue;
+        }
+        for(j=i; j+1<CPU_SETSIZE && CPU_ISSET(j+1, set); j++);
+        n = snprintf(range, sizeof(range), j == i ? "%s%d" : "%s%d-%d",
+            len ? "," : "", i, j);
+        // Leave room for "..." if this is not the last range
+        if(len + n + 4 > size) {
+            if(len + 4 <= size) {
+                strcpy(buf+len, "...");
+            }
+            break;
+        }
+        strcpy(buf+len, range);
+        len += n;
+        i = j;
+    }
+    return buf;
+}
+
+int
+hashpipe_isolated_cpus(cpu_set_t *set)
+{
+    char list[4096];
+    FILE *f;
+
+    CPU_ZERO(set);
+    if(!(f = fopen("/sys/devices/system/cpu/isolated", "r"))) {
+        return -1;
+    }
+    if(!fgets(list, sizeof(list), f)) {
+        // Empty means no isolated CPUs
+        list[0] = '\0';
+    }
+    fclose(f);
+    list[strcspn(list, "\n")] = '\0';
+    return hashpipe_cpulist_parse(list, set);
+}
+
+int
+hashpipe_sched_parse(const char *s, int *policy, int *priority)
+{
+    static const struct {
+        const char *name;
+        int policy;
+    } policies[] = {
+        {"fifo",  SCHED_FIFO},
+        {"rr",    SCHED_RR},
+        {"other", SCHED_OTHER},
+        {"batch", SCHED_BATCH},
+        {"idle",  SCHED_IDLE}
+    };
+    size_t len = strcspn(s, ":");
+    char *end;
+    int i;
+
+    for(i=0; i<sizeof(policies)/sizeof(policies[0]); i++) {
+        if(len == strlen(policies[i].name)
+        && !strncasecmp(s, policies[i].name, len)) {
+            break;
+        }
+    }
+    if(i == sizeof(policies)/sizeof(policies[0])) {
+        return -1;
+    }
+    *policy = policies[i].policy;
+
+    if(*policy == SCHED_FIFO || *policy == SCHED_RR) {
+        // Real-time priority (default lowest)
+        *priority = sched_get_priority_min(*policy);
+    } else {
+        // Nice level
+        *priority = 0;
+    }
+    if(s[len] == ':') {
+        *priority = strtol(s+len+1, &end, 10);
+        if(end == s+len+1 || *end || *policy == SCHED_IDLE) {
+            return -1;
+        }
+    } else if(s[len]) {
+        return -1;
+    }
+
+    if(*policy == SCHED_FIFO || *policy == SCHED_RR) {
+        if(*priority < sched_get_priority_min(*policy)
+        || *priority > sched_get_priority_max(*policy)) {
+            return -1;
+        }
+    } else if(*priority < -20 || *priority > 19) {
+        return -1;
+    }
+    return 0;
+}
@@ -2,18 +2,33 @@
 #include <string.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 #include "hashpipe_thread_args.h"
 
 void hashpipe_thread_args_init(struct hashpipe_thread_args *a) {
     a->thread_desc=0;
     a->instance_id=0;
-    a->cpu_mask=0;
+    memset(&a->cpu_set, 0, sizeof(a->cpu_set));
+    a->sched_policy=-1;
+    a->sched_priority=0;
     a->finished=0;
+    a->ready=0;
+    a->stop=0;
+    a->tid=0;
+    a->heartbeat=0;
+    a->waiting=0;
+    a->worker_index=0;
+    a->num_workers=1;
+    a->num_input_buffers=0;
+    a->num_output_buffers=0;
     pthread_cond_init(&a->finished_c,NULL);
     pthread_mutex_init(&a->finished_m,NULL);
     memset(&a->st, 0, sizeof(hashpipe_status_t));
     a->ibuf = NULL;
     a->obuf = NULL;
+    hashpipe_perf_init(&a->perf);
+    a->latency = NULL;
+    a->cmdq_ring = -1;
 }
 
 void hashpipe_thread_args_destroy(struct hashpipe_thread_args *a) {
@@ -29,19 +44,47 @@ void hashpipe_thread_set_finished(struct hashpipe_thread_args *a) {
     pthread_mutex_unlock(&a->finished_m);
 }
 
+void hashpipe_thread_stop(struct hashpipe_thread_args *a) {
+    __atomic_store_n(&a->stop, 1, __ATOMIC_RELEASE);
+}
+
 int hashpipe_thread_finished(struct hashpipe_thread_args *a,
         float timeout_sec) {
     struct timeval now;
     struct timespec twait;
-    int rv;
+    int rv = 0;
     pthread_mutex_lock(&a->finished_m);
     gettimeofday(&now,NULL);
     twait.tv_sec = now.tv_sec + (int)timeout_sec;
     twait.tv_nsec = now.tv_usec * 1000 +
         (int)(1e9*(timeout_sec-floor(timeout_sec)));
-    if (a->finished==0)
+    if(twait.tv_nsec >= 1000000000) {
+        twait.tv_sec++;
+        twait.tv_nsec -= 1000000000;
+    }
+    while (a->finished==0 && rv == 0)
         rv = pthread_cond_timedwait(&a->finished_c, &a->finished_m, &twait);
     rv = a->finished;
     pthread_mutex_unlock(&a->finished_m);
     return(rv);
 }
+
+int hashpipe_thread_wait_ready(hashpipe_thread_args_t *a,
+        double timeout_sec) {
+    struct timespec twait;
+    int rv = 0;
+    clock_gettime(CLOCK_REALTIME, &twait);
+    twait.tv_sec += (time_t)timeout_sec;
+    twait.tv_nsec += (long)(1e9*(timeout_sec-floor(timeout_sec)));
+    if(twait.tv_nsec >= 1000000000) {
+        twait.tv_sec++;
+        twait.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&a->finished_m);
+    while(!a->ready && !a->finished && rv == 0) {
+        rv = pthread_cond_timedwait(&a->finished_c, &a->finished_m, &twait);
+    }
+    rv = a->ready ? 1 : a->finished ? -1 : 0;
+    pthread_mutex_unlock(&a->finished_m);
+    return(rv);
+}
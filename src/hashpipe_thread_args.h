@@ -11,4 +11,11 @@ void hashpipe_thread_args_init(hashpipe_thread_args_t *a);
 void hashpipe_thread_args_destroy(hashpipe_thread_args_t *a);
 void hashpipe_thread_set_finished(hashpipe_thread_args_t *a);
 int hashpipe_thread_finished(hashpipe_thread_args_t *a, float timeout_sec);
+/* Waits up to timeout_sec seconds for the thread of a to become ready or
+ * finish.  Returns 1 if ready, -1 if finished without becoming ready, or 0 on
+ * timeout.
+ */
+int hashpipe_thread_wait_ready(hashpipe_thread_args_t *a, double timeout_sec);
+/* Makes run_threads() return false for the thread of a */
+void hashpipe_thread_stop(hashpipe_thread_args_t *a);
 #endif // _HASHPIPE_THREAD_ARGS_H
@@ -0,0 +1,288 @@
+/* hashpipe_trace.c
+ *
+ * Implementation of the event trace routines described
+ * in hashpipe_trace.h
+ */
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+
+#include "hashpipe_trace.h"
+#include "hashpipe_status.h"
+#include "hashpipe_error.h"
+
+hashpipe_trace_shm_t *hashpipe_trace_shm = NULL;
+__thread hashpipe_trace_thread_t hashpipe_trace_my_ring = {NULL, NULL, 0};
+// Semaphore set IDs of databufs by id (-1 if unknown; 0 is a valid semid)
+int hashpipe_trace_semids[HASHPIPE_TRACE_MAX_DATABUFS] = {
+    [0 ... HASHPIPE_TRACE_MAX_DATABUFS-1] = -1
+};
+
+// Where events go once all rings have been claimed
+static __thread hashpipe_trace_ring_t discard_ring;
+static __thread hashpipe_trace_event_t discard_event;
+
+static int64_t clock_ns(clockid_t clk)
+{
+    struct timespec ts;
+    clock_gettime(clk, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int hashpipe_trace_name(int instance_id, char * name, size_t size)
+{
+    if(hashpipe_status_semname(instance_id, name, size)) {
+        return 1;
+    }
+    if(strlen(name) + strlen("_trace") + 1 > size) {
+        return 1;
+    }
+    strcat(name, "_trace");
+    return 0;
+}
+
+static size_t hashpipe_trace_size(uint32_t nevents)
+{
+    return sizeof(hashpipe_trace_shm_t) + (size_t)HASHPIPE_TRACE_MAX_RINGS
+        * nevents * sizeof(hashpipe_trace_event_t);
+}
+
+hashpipe_trace_event_t *hashpipe_trace_events(hashpipe_trace_shm_t *shm,
+        int i)
+{
+    return (hashpipe_trace_event_t *)(shm + 1) + (size_t)i * shm->nevents;
+}
+
+int hashpipe_trace_create(int instance_id, uint32_t nevents)
+{
+    char name[NAME_MAX] = {'\0'};
+    hashpipe_trace_shm_t *shm;
+    const char *envstr;
+    size_t size;
+    uint32_t n;
+    int fd;
+
+    if(hashpipe_trace_shm) {
+        hashpipe_error(__FUNCTION__, "already recording trace events");
+        return HASHPIPE_ERR_GEN;
+    }
+
+    if(nevents == 0) {
+        nevents = HASHPIPE_TRACE_DEFAULT_EVENTS;
+        if((envstr = getenv("HASHPIPE_TRACE_EVENTS"))) {
+            nevents = strtoul(envstr, NULL, 0);
+            if(nevents == 0) {
+                // Tracing disabled
+                return HASHPIPE_OK;
+            }
+        }
+    }
+    if(nevents > (1U<<24)) {
+        nevents = 1U<<24;
+    }
+    // Round up to power of 2
+    for(n = 1; n < nevents; n <<= 1);
+    nevents = n;
+
+    instance_id &= 0x3f;
+    size = hashpipe_trace_size(nevents);
+
+    if(hashpipe_trace_name(instance_id, name, NAME_MAX)) {
+        hashpipe_error(__FUNCTION__, "trace segment name truncated");
+        return HASHPIPE_ERR_SYS;
+    }
+
+    // Start from scratch so that events of a previous run are not mixed with
+    // those of this run.
+    shm_unlink(name);
+    mode_t old_umask = umask(0);
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+    umask(old_umask);
+    if(fd == -1) {
+        hashpipe_error(__FUNCTION__, "shm_open %s", name);
+        return HASHPIPE_ERR_SYS;
+    }
+    if(ftruncate(fd, size)) {
+        hashpipe_error(__FUNCTION__, "ftruncate");
+        close(fd);
+        shm_unlink(name);
+        return HASHPIPE_ERR_SYS;
+    }
+    shm = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(shm == MAP_FAILED) {
+        hashpipe_error(__FUNCTION__, "mmap");
+        shm_unlink(name);
+        return HASHPIPE_ERR_SYS;
+    }
+
+    // New shared memory objects are zero filled
+    shm->version = HASHPIPE_TRACE_VERSION;
+    shm->nevents = nevents;
+    shm->pid = getpid();
+#if !defined(__x86_64__) && !defined(__i386__)
+    shm->tsc_is_ns = 1;
+#endif
+    shm->real0 = clock_ns(CLOCK_REALTIME);
+    shm->mono0 = clock_ns(CLOCK_MONOTONIC);
+    shm->tsc0 = hashpipe_trace_tsc();
+    shm->mono1 = shm->mono0;
+    shm->tsc1 = shm->tsc0;
+    __atomic_store_n(&shm->magic, HASHPIPE_TRACE_MAGIC, __ATOMIC_RELEASE);
+
+    __atomic_store_n(&hashpipe_trace_shm, shm, __ATOMIC_RELEASE);
+    return HASHPIPE_OK;
+}
+
+hashpipe_trace_shm_t *hashpipe_trace_attach(int instance_id, size_t *size)
+{
+    char name[NAME_MAX] = {'\0'};
+    hashpipe_trace_shm_t *shm;
+    struct stat st;
+    int fd;
+
+    if(hashpipe_trace_name(instance_id & 0x3f, name, NAME_MAX)) {
+        hashpipe_error(__FUNCTION__, "trace segment name truncated");
+        return NULL;
+    }
+
+    fd = shm_open(name, O_RDONLY, 0);
+    if(fd == -1) {
+        return NULL;
+    }
+    if(fstat(fd, &st) || st.st_size < sizeof(hashpipe_trace_shm_t)) {
+        close(fd);
+        return NULL;
+    }
+    *size = st.st_size;
+    shm = mmap(NULL, *size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(shm == MAP_FAILED) {
+        hashpipe_error(__FUNCTION__, "mmap");
+        return NULL;
+    }
+
+    // Make sure the segment is initialized and matches our idea of its layout
+    if(__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) != HASHPIPE_TRACE_MAGIC
+    || shm->version != HASHPIPE_TRACE_VERSION
+    || *size < hashpipe_trace_size(shm->nevents)) {
+        munmap(shm, *size);
+        return NULL;
+    }
+
+    return shm;
+}
+
+int hashpipe_trace_detach(hashpipe_trace_shm_t *shm, size_t size)
+{
+    if(shm && munmap(shm, size)) {
+        hashpipe_error(__FUNCTION__, "munmap");
+        return HASHPIPE_ERR_SYS;
+    }
+    return HASHPIPE_OK;
+}
+
+int hashpipe_trace_unlink(int instance_id)
+{
+    char name[NAME_MAX] = {'\0'};
+
+    hashpipe_trace_name(instance_id & 0x3f, name, NAME_MAX);
+    if(shm_unlink(name) && errno != ENOENT) {
+        hashpipe_error(__FUNCTION__, "shm_unlink %s", name);
+        return HASHPIPE_ERR_SYS;
+    }
+    return HASHPIPE_OK;
+}
+
+void hashpipe_trace_calibrate()
+{
+    hashpipe_trace_shm_t *shm = hashpipe_trace_shm;
+    uint64_t tsc;
+    int64_t mono;
+
+    if(shm) {
+        // Readers may see a torn calibration point, but they only use it to
+        // compute a rate over (typically) many seconds.
+        mono = clock_ns(CLOCK_MONOTONIC);
+        tsc = hashpipe_trace_tsc();
+        shm->tsc1 = tsc;
+        shm->mono1 = mono;
+    }
+}
+
+void hashpipe_trace_databuf(int databuf_id, int semid)
+{
+    if(databuf_id > 0 && databuf_id < HASHPIPE_TRACE_MAX_DATABUFS) {
+        hashpipe_trace_semids[databuf_id] = semid;
+    }
+}
+
+// Claims the ring of a thread of this process that has exited for the
+// calling thread (with Linux thread ID tid).  Returns the index of the ring or
+// HASHPIPE_TRACE_MAX_RINGS if there is none.
+static uint32_t claim_exited_ring(hashpipe_trace_shm_t *shm, int32_t tid)
+{
+    int saved_errno = errno;
+    int32_t owner;
+    uint32_t i;
+
+    for(i=0; i<HASHPIPE_TRACE_MAX_RINGS; i++) {
+        owner = __atomic_load_n(&shm->ring[i].tid, __ATOMIC_ACQUIRE);
+        if(owner > 0
+        && syscall(SYS_tgkill, getpid(), owner, 0) == -1 && errno == ESRCH
+        && __atomic_compare_exchange_n(&shm->ring[i].tid, &owner, tid, 0,
+                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    errno = saved_errno;
+    return i;
+}
+
+int hashpipe_trace_claim()
+{
+    hashpipe_trace_shm_t *shm = hashpipe_trace_shm;
+    hashpipe_trace_thread_t *t = &hashpipe_trace_my_ring;
+    hashpipe_trace_ring_t *r;
+    int32_t tid = syscall(SYS_gettid);
+    uint32_t i;
+
+    i = __atomic_fetch_add(&shm->nrings, 1, __ATOMIC_RELAXED);
+    if(i >= HASHPIPE_TRACE_MAX_RINGS) {
+        __atomic_store_n(&shm->nrings, HASHPIPE_TRACE_MAX_RINGS,
+                __ATOMIC_RELAXED);
+        // Reuse the ring of an exited thread (e.g. of a restarted pipeline
+        // thread), if any
+        i = claim_exited_ring(shm, tid);
+        if(i >= HASHPIPE_TRACE_MAX_RINGS) {
+            // No more rings, discard this thread's events
+            t->events = &discard_event;
+            t->mask = 0;
+            t->ring = &discard_ring;
+            return 1;
+        }
+        // Drop the previous owner's events
+        __atomic_store_n(&shm->ring[i].head, 0, __ATOMIC_RELEASE);
+    }
+
+    r = &shm->ring[i];
+    prctl(PR_GET_NAME, r->name, 0, 0, 0);
+    r->name[sizeof(r->name)-1] = '\0';
+    r->mask = shm->nevents - 1;
+    __atomic_store_n(&r->tid, tid, __ATOMIC_RELEASE);
+
+    t->events = hashpipe_trace_events(shm, i);
+    t->mask = r->mask;
+    t->ring = r;
+    return 1;
+}
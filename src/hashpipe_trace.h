@@ -0,0 +1,236 @@
+/* hashpipe_trace.h
+ *
+ * Routines dealing with the hashpipe event trace shared memory segment.  The
+ * trace segment holds one ring of compact binary events per thread.  Each
+ * event is time stamped with the CPU's time stamp counter (or with
+ * CLOCK_MONOTONIC where there is none).  Recording an event costs a few
+ * nanoseconds, so tracing can be left on in production.  The segment outlives
+ * the process that created it, so the last events of each thread can be
+ * examined after a pipeline drops data, hangs, or crashes (e.g. with
+ * "hashpipe_trace_dump", which writes Chrome/Perfetto trace JSON).
+ *
+ * The hashpipe executable creates the trace segment at startup.  The databuf
+ * and status buffer routines record their events automatically, and so do
+ * the packet socket and ibverbs receive routines (one PKT_BATCH event per
+ * burst of frames received by hashpipe_pktsock_recv_*() without finding the
+ * ring empty, one per list of packets returned by hashpipe_ibv_recv_pkts()).
+ * Threads that receive packets with plain sockets (e.g. set up with
+ * hashpipe_udp_init(), which has no receive routine) can record their own
+ * batches, as well as any other events:
+ *
+ *   hashpipe_trace(HASHPIPE_TRACE_PKT_BATCH, 0, npackets);
+ *   hashpipe_trace(HASHPIPE_TRACE_USER_BEGIN, 1, block_seq);
+ *   ... do work ...
+ *   hashpipe_trace(HASHPIPE_TRACE_USER_END, 1, block_seq);
+ *
+ * Each thread claims a ring the first time it records an event.  Rings are
+ * not released when threads exit, so the rings of exited threads are kept for
+ * post-mortem analysis until all HASHPIPE_TRACE_MAX_RINGS rings have been
+ * claimed.  After that, threads (e.g. restarted pipeline threads) claim the
+ * rings of exited threads.  Events of threads that do not get a ring are
+ * discarded.
+ */
+#ifndef _HASHPIPE_TRACE_H
+#define _HASHPIPE_TRACE_H
+
+#include <stdint.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+#define HASHPIPE_TRACE_MAGIC 0x48505452 // "HPTR"
+#define HASHPIPE_TRACE_VERSION 1
+#define HASHPIPE_TRACE_MAX_RINGS 64        // Maximum number of rings
+#define HASHPIPE_TRACE_DEFAULT_EVENTS 16384 // Default events per ring
+#define HASHPIPE_TRACE_MAX_DATABUFS 64     // Maximum number of databufs
+
+/* Event types.  aux and arg of hashpipe_trace() are shown in brackets. */
+enum {
+    HASHPIPE_TRACE_NONE = 0,
+    HASHPIPE_TRACE_WAIT_FREE_BEGIN,   /* [databuf, block] */
+    HASHPIPE_TRACE_WAIT_FREE_END,     /* [databuf, block] (arg has MSB set
+                                         if wait failed or timed out) */
+    HASHPIPE_TRACE_WAIT_FILLED_BEGIN, /* [databuf, block] */
+    HASHPIPE_TRACE_WAIT_FILLED_END,   /* [databuf, block] (as above) */
+    HASHPIPE_TRACE_SET_FREE,          /* [databuf, block] */
+    HASHPIPE_TRACE_SET_FILLED,        /* [databuf, block] */
+    HASHPIPE_TRACE_LOCK_WAIT,         /* [0, 0] Status buffer lock busy */
+    HASHPIPE_TRACE_LOCKED,            /* [0, wait ns] Status buffer locked */
+    HASHPIPE_TRACE_UNLOCKED,          /* [0, 0] Status buffer unlocked */
+    HASHPIPE_TRACE_PKT_BATCH,         /* [0, number of packets] */
+    HASHPIPE_TRACE_USER_BEGIN,        /* [user id, user value] */
+    HASHPIPE_TRACE_USER_END,          /* [user id, user value] */
+    HASHPIPE_TRACE_USER_MARK,         /* [user id, user value] */
+    HASHPIPE_TRACE_NTYPES
+};
+
+/* Flag set in arg of *_END events if the wait failed or timed out */
+#define HASHPIPE_TRACE_FAILED 0x80000000
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Structure describes one event (lives in shared memory) */
+typedef struct {
+    uint64_t tsc;  /* Time stamp counter value */
+    uint32_t arg;  /* Type specific argument */
+    uint16_t aux;  /* Type specific auxiliary value (e.g. databuf id) */
+    uint8_t type;  /* Event type */
+    uint8_t pad;
+} hashpipe_trace_event_t;
+
+/* Structure describes one thread's ring (lives in shared memory).  The most
+ * recent min(head, mask+1) events are valid.  Only the owning thread writes
+ * to the ring.
+ */
+typedef struct {
+    char name[16];      /* Name of thread that owns this ring */
+    int32_t tid;        /* Linux thread ID of owner (0 if unclaimed) */
+    uint32_t mask;      /* Number of events in ring minus 1 */
+    uint64_t head __attribute__((aligned(64))); /* Number of events written */
+} hashpipe_trace_ring_t;
+
+/* Structure describes trace segment header (lives in shared memory).  The
+ * rings follow the header, then the events of all rings.  Time stamps are
+ * converted to time using two calibration points (tsc0, mono0) and (tsc1,
+ * mono1) of the time stamp counter and CLOCK_MONOTONIC.  real0 is the
+ * CLOCK_REALTIME time corresponding to mono0.
+ */
+typedef struct {
+    uint32_t magic;     /* HASHPIPE_TRACE_MAGIC once initialized */
+    uint32_t version;   /* HASHPIPE_TRACE_VERSION */
+    uint32_t nevents;   /* Events per ring (power of 2) */
+    uint32_t nrings;    /* Number of rings claimed so far */
+    int32_t pid;        /* PID of process that created the segment */
+    uint32_t tsc_is_ns; /* Non-zero if "tsc" is CLOCK_MONOTONIC in ns */
+    uint64_t tsc0;      /* Calibration point at creation */
+    int64_t mono0;
+    int64_t real0;
+    uint64_t tsc1;      /* Most recent calibration point */
+    int64_t mono1;
+    hashpipe_trace_ring_t ring[HASHPIPE_TRACE_MAX_RINGS];
+} hashpipe_trace_shm_t;
+
+/* Structure describes calling thread's ring (process local) */
+typedef struct {
+    hashpipe_trace_ring_t *ring;    /* Ring in shared memory */
+    hashpipe_trace_event_t *events; /* Events of ring */
+    uint32_t mask;                  /* Number of events in ring minus 1 */
+} hashpipe_trace_thread_t;
+
+/* Process local pointer to trace segment being recorded to (NULL if none) */
+extern hashpipe_trace_shm_t *hashpipe_trace_shm;
+/* Calling thread's ring (ring is NULL until first event) */
+extern __thread hashpipe_trace_thread_t hashpipe_trace_my_ring;
+
+/*
+ * Stores the hashpipe trace (POSIX) shared memory object name in name buffer
+ * of length size.  The name is the hashpipe status semaphore name (see
+ * hashpipe_status_semname()) with "_trace" appended.  Returns 0 (no error) if
+ * the name fit in given size, returns 1 if the name is truncated.
+ */
+int hashpipe_trace_name(int instance_id, char * name, size_t size);
+
+/* Create (or re-create) the trace segment for instance_id with nevents
+ * (rounded up to a power of 2) events per ring and start recording this
+ * process's events into it.  The segment stays mapped (and is not removed)
+ * when the process exits.  If nevents is 0, the number of events is taken
+ * from the HASHPIPE_TRACE_EVENTS environment variable (default
+ * HASHPIPE_TRACE_DEFAULT_EVENTS), which can be set to 0 to disable tracing.
+ * Returns HASHPIPE_OK on success (or if tracing is disabled).
+ */
+int hashpipe_trace_create(int instance_id, uint32_t nevents);
+
+/* Attach to an existing trace segment read-only (e.g. to dump it).  Returns a
+ * pointer to the segment or NULL if there is no trace segment for
+ * instance_id.  *size is set to the size of the mapping.
+ */
+hashpipe_trace_shm_t *hashpipe_trace_attach(int instance_id, size_t *size);
+
+/* Returns pointer to the events of ring i of shm */
+hashpipe_trace_event_t *hashpipe_trace_events(hashpipe_trace_shm_t *shm,
+        int i);
+
+/* Detach from a trace segment attached with hashpipe_trace_attach() */
+int hashpipe_trace_detach(hashpipe_trace_shm_t *shm, size_t size);
+
+/* Remove the trace segment of instance_id.  A process that is recording
+ * events keeps its mapping, but its events will no longer be visible to
+ * others.
+ */
+int hashpipe_trace_unlink(int instance_id);
+
+/* Record a new calibration point.  Called periodically by the hashpipe
+ * executable so that time stamps can be converted to time after the fact.
+ */
+void hashpipe_trace_calibrate();
+
+/* Record that databuf_id uses semaphore set semid (called by the databuf
+ * routines so that databuf events can be tagged with databuf_id).
+ */
+void hashpipe_trace_databuf(int databuf_id, int semid);
+
+/* Returns the databuf id recorded for semid (or 0 if none or semid is -1) */
+static inline int hashpipe_trace_databuf_id(int semid)
+{
+    extern int hashpipe_trace_semids[HASHPIPE_TRACE_MAX_DATABUFS];
+    int i;
+    if(semid == -1) {
+        return 0;
+    }
+    for(i=1; i<HASHPIPE_TRACE_MAX_DATABUFS; i++) {
+        if(hashpipe_trace_semids[i] == semid) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+/* Returns time stamp counter value (or CLOCK_MONOTONIC in ns) */
+static inline uint64_t hashpipe_trace_tsc()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+/* Claims a ring for the calling thread (internal, use hashpipe_trace()).
+ * Returns non-zero if the calling thread has a ring to record events to.
+ */
+int hashpipe_trace_claim();
+
+/* Record an event of type with auxiliary value aux and argument arg in the
+ * calling thread's ring.  Does nothing if there is no trace segment.
+ */
+static inline void hashpipe_trace(int type, int aux, uint32_t arg)
+{
+    hashpipe_trace_thread_t *t = &hashpipe_trace_my_ring;
+    hashpipe_trace_event_t *e;
+    uint64_t head;
+
+    if(!t->ring) {
+        if(!hashpipe_trace_shm || !hashpipe_trace_claim()) {
+            return;
+        }
+    }
+    head = t->ring->head;
+    e = &t->events[head & t->mask];
+    e->tsc = hashpipe_trace_tsc();
+    e->arg = arg;
+    e->aux = aux;
+    e->type = type;
+    __atomic_store_n(&t->ring->head, head+1, __ATOMIC_RELEASE);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _HASHPIPE_TRACE_H
@@ -0,0 +1,308 @@
+/* hashpipe_trace_dump.c
+ *
+ * Dumps the event trace of a hashpipe instance as Chrome trace event JSON,
+ * which can be viewed with Perfetto (https://ui.perfetto.dev) or
+ * chrome://tracing.  Works while the pipeline is running and after it has
+ * exited (the trace segment is left behind until the next run or until
+ * "hashpipe_clean_shmem -d").
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <time.h>
+
+#include "hashpipe_trace.h"
+#include "hashpipe_error.h"
+
+void usage() {
+    printf(
+            "Usage: hashpipe_trace_dump [options]\n"
+            "\n"
+            "Options [defaults]:\n"
+            "  -h, --help\n"
+            "  -K KEY, --shmkey=KEY   Specify key for shared memory\n"
+            "  -I N,   --instance=N   Instance number             [0]\n"
+            "  -o FILE, --output=FILE Write JSON to FILE     [stdout]\n"
+            "  -s SEC, --seconds=SEC  Only dump last SEC seconds [all]\n"
+            "\n"
+            "Writes the events recorded by each thread of a hashpipe instance\n"
+            "as Chrome trace event JSON (e.g. for https://ui.perfetto.dev).\n"
+            );
+}
+
+// Per thread state used to pair begin and end events (the oldest events of a
+// ring may be end events whose begin events have been overwritten)
+typedef struct {
+    int wait_open;
+    int lock_wait_open;
+    int lock_held_open;
+    int user_depth;
+} ring_state_t;
+
+static const char *wait_name(int type)
+{
+    return type == HASHPIPE_TRACE_WAIT_FREE_BEGIN
+        || type == HASHPIPE_TRACE_WAIT_FREE_END ? "wait_free" : "wait_filled";
+}
+
+// Prints event e of thread tid at time ts (in microseconds)
+static void print_event(FILE *out, int pid, int tid, const char *tname,
+        double ts, const hashpipe_trace_event_t *e, ring_state_t *rs)
+{
+    const char *fmt = ",\n{\"pid\":%d,\"tid\":%d,\"ts\":%.3f,";
+    uint32_t block = e->arg & ~HASHPIPE_TRACE_FAILED;
+
+    switch(e->type) {
+    case HASHPIPE_TRACE_WAIT_FREE_BEGIN:
+    case HASHPIPE_TRACE_WAIT_FILLED_BEGIN:
+        fprintf(out, fmt, pid, tid, ts);
+        fprintf(out, "\"ph\":\"B\",\"cat\":\"databuf\","
+                "\"name\":\"%s db%d[%u]\","
+                "\"args\":{\"databuf\":%d,\"block\":%u}}",
+                wait_name(e->type), e->aux, block, e->aux, block);
+        rs->wait_open = 1;
+        break;
+    case HASHPIPE_TRACE_WAIT_FREE_END:
+    case HASHPIPE_TRACE_WAIT_FILLED_END:
+        if(rs->wait_open) {
+            fprintf(out, fmt, pid, tid, ts);
+            fprintf(out, "\"ph\":\"E\",\"args\":{\"ok\":%s}}",
+                    e->arg & HASHPIPE_TRACE_FAILED ? "false" : "true");
+            rs->wait_open = 0;
+        }
+        break;
+    case HASHPIPE_TRACE_SET_FREE:
+    case HASHPIPE_TRACE_SET_FILLED:
+        fprintf(out, fmt, pid, tid, ts);
+        fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"cat\":\"databuf\","
+                "\"name\":\"%s db%d[%u]\","
+                "\"args\":{\"databuf\":%d,\"block\":%u}}",
+                e->type == HASHPIPE_TRACE_SET_FREE ? "set_free" : "set_filled",
+                e->aux, block, e->aux, block);
+        break;
+    case HASHPIPE_TRACE_LOCK_WAIT:
+        fprintf(out, fmt, pid, tid, ts);
+        fprintf(out, "\"ph\":\"B\",\"cat\":\"status\","
+                "\"name\":\"status lock wait\"}");
+        rs->lock_wait_open = 1;
+        break;
+    case HASHPIPE_TRACE_LOCKED:
+        if(rs->lock_wait_open) {
+            fprintf(out, fmt, pid, tid, ts);
+            fprintf(out, "\"ph\":\"E\",\"args\":{\"wait_ns\":%u}}", e->arg);
+            rs->lock_wait_open = 0;
+        }
+        fprintf(out, fmt, pid, tid, ts);
+        fprintf(out, "\"ph\":\"B\",\"cat\":\"status\","
+                "\"name\":\"status lock held\"}");
+        rs->lock_held_open = 1;
+        break;
+    case HASHPIPE_TRACE_UNLOCKED:
+        if(rs->lock_held_open) {
+            fprintf(out, fmt, pid, tid, ts);
+            fprintf(out, "\"ph\":\"E\"}");
+            rs->lock_held_open = 0;
+        }
+        break;
+    case HASHPIPE_TRACE_PKT_BATCH:
+        fprintf(out, fmt, pid, tid, ts);
+        fprintf(out, "\"ph\":\"C\",\"name\":\"packets %s\","
+                "\"args\":{\"packets\":%u}}", tname, e->arg);
+        break;
+    case HASHPIPE_TRACE_USER_BEGIN:
+        fprintf(out, fmt, pid, tid, ts);
+        fprintf(out, "\"ph\":\"B\",\"cat\":\"user\",\"name\":\"user %d\","
+                "\"args\":{\"value\":%u}}", e->aux, e->arg);
+        rs->user_depth++;
+        break;
+    case HASHPIPE_TRACE_USER_END:
+        if(rs->user_depth > 0) {
+            fprintf(out, fmt, pid, tid, ts);
+            fprintf(out, "\"ph\":\"E\",\"args\":{\"value\":%u}}", e->arg);
+            rs->user_depth--;
+        }
+        break;
+    case HASHPIPE_TRACE_USER_MARK:
+        fprintf(out, fmt, pid, tid, ts);
+        fprintf(out, "\"ph\":\"i\",\"s\":\"t\",\"cat\":\"user\","
+                "\"name\":\"user %d\",\"args\":{\"value\":%u}}",
+                e->aux, e->arg);
+        break;
+    }
+}
+
+int main(int argc, char *argv[]) {
+
+    /* Loop over cmd line to fill in params */
+    static struct option long_opts[] = {
+        {"help",     0, NULL, 'h'},
+        {"shmkey",   1, NULL, 'K'},
+        {"instance", 1, NULL, 'I'},
+        {"output",   1, NULL, 'o'},
+        {"seconds",  1, NULL, 's'},
+        {0,0,0,0}
+    };
+    int opt;
+    int instance_id=0;
+    double seconds = 0;
+    const char *output = NULL;
+    char keyfile[1000];
+    while ((opt=getopt_long(argc,argv,"hK:I:o:s:",long_opts,NULL))!=-1) {
+        switch (opt) {
+            case 'K': // Keyfile
+                snprintf(keyfile, sizeof(keyfile), "HASHPIPE_KEYFILE=%s", optarg);
+                keyfile[sizeof(keyfile)-1] = '\0';
+                putenv(keyfile);
+                break;
+            case 'I':
+                instance_id=atoi(optarg);
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 's':
+                seconds = strtod(optarg, NULL);
+                break;
+            case 'h':
+                usage();
+                exit(0);
+                break;
+            case '?': // Command line parsing error
+            default:
+                usage();
+                exit(1);
+                break;
+        }
+    }
+
+    size_t size;
+    hashpipe_trace_shm_t *shm = hashpipe_trace_attach(instance_id, &size);
+    if(!shm) {
+        fprintf(stderr, "No event trace for instance %d\n", instance_id);
+        exit(1);
+    }
+
+    /* Determine time stamp counter rate (ticks per nanosecond) */
+    double rate = 1.0;
+    if(!shm->tsc_is_ns) {
+        uint64_t tsc1 = shm->tsc1;
+        int64_t mono1 = shm->mono1;
+        if(mono1 - shm->mono0 < 100000000) {
+            // Not calibrated by its creator (yet), calibrate against now
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            tsc1 = hashpipe_trace_tsc();
+            mono1 = now.tv_sec * 1000000000LL + now.tv_nsec;
+        }
+        if(mono1 > shm->mono0 && tsc1 > shm->tsc0) {
+            rate = (double)(tsc1 - shm->tsc0) / (mono1 - shm->mono0);
+        }
+    }
+
+    /* Copy the valid events of each claimed ring */
+    int nrings = shm->nrings;
+    if(nrings > HASHPIPE_TRACE_MAX_RINGS) {
+        nrings = HASHPIPE_TRACE_MAX_RINGS;
+    }
+    uint32_t nevents = shm->nevents;
+    hashpipe_trace_event_t *copy = malloc(
+            (size_t)nrings * nevents * sizeof(hashpipe_trace_event_t));
+    uint64_t first[HASHPIPE_TRACE_MAX_RINGS];
+    uint64_t last[HASHPIPE_TRACE_MAX_RINGS];
+    uint64_t newest = 0;
+    int i;
+    if(!copy) {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    for(i=0; i<nrings; i++) {
+        hashpipe_trace_ring_t *r = &shm->ring[i];
+        hashpipe_trace_event_t *ev = hashpipe_trace_events(shm, i);
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        uint64_t j;
+        first[i] = head > nevents ? head - nevents : 0;
+        last[i] = head;
+        for(j=first[i]; j<head; j++) {
+            copy[(size_t)i*nevents + (j % nevents)] = ev[j % nevents];
+        }
+        // Skip events that may have been overwritten while copying
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if(head > nevents && head - nevents > first[i]) {
+            first[i] = head - nevents < last[i] ? head - nevents : last[i];
+        }
+        if(last[i] > first[i]) {
+            hashpipe_trace_event_t *e =
+                &copy[(size_t)i*nevents + ((last[i]-1) % nevents)];
+            if(newest < e->tsc) {
+                newest = e->tsc;
+            }
+        }
+    }
+
+    /* Events older than this are not dumped */
+    uint64_t oldest = 0;
+    if(seconds > 0 && newest > seconds * 1e9 * rate) {
+        oldest = newest - (uint64_t)(seconds * 1e9 * rate);
+    }
+
+    FILE *out = stdout;
+    if(output && !(out = fopen(output, "w"))) {
+        perror(output);
+        exit(1);
+    }
+
+    /* Metadata */
+    time_t t0 = shm->real0 / 1000000000LL;
+    char t0str[64];
+    strftime(t0str, sizeof(t0str), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t0));
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\n"
+            "\"otherData\":{\"instance_id\":%d,\"pid\":%d,"
+            "\"start_time\":\"%s\",\"ticks_per_ns\":%.6f},\n"
+            "\"traceEvents\":[\n"
+            "{\"pid\":%d,\"ph\":\"M\",\"name\":\"process_name\","
+            "\"args\":{\"name\":\"hashpipe instance %d\"}}",
+            instance_id, shm->pid, t0str, rate, shm->pid, instance_id);
+
+    for(i=0; i<nrings; i++) {
+        hashpipe_trace_ring_t *r = &shm->ring[i];
+        ring_state_t rs = {0};
+        char tname[sizeof(r->name)+1];
+        uint64_t j;
+        int tid = r->tid;
+
+        if(!tid) {
+            continue;
+        }
+        memcpy(tname, r->name, sizeof(r->name));
+        tname[sizeof(r->name)] = '\0';
+        // Keep thread names JSON safe
+        for(j=0; tname[j]; j++) {
+            if(tname[j] == '"' || tname[j] == '\\' || tname[j] < ' ') {
+                tname[j] = '_';
+            }
+        }
+        fprintf(out, ",\n{\"pid\":%d,\"tid\":%d,\"ph\":\"M\","
+                "\"name\":\"thread_name\",\"args\":{\"name\":\"%s\"}}",
+                shm->pid, tid, tname);
+
+        for(j=first[i]; j<last[i]; j++) {
+            hashpipe_trace_event_t *e = &copy[(size_t)i*nevents + (j%nevents)];
+            if(e->tsc < oldest) {
+                continue;
+            }
+            // Microseconds since trace was created
+            double ts = ((double)e->tsc - (double)shm->tsc0) / rate / 1e3;
+            print_event(out, shm->pid, tid, tname, ts, e, &rs);
+        }
+    }
+    fprintf(out, "\n]}\n");
+
+    if(out != stdout) {
+        fclose(out);
+    }
+    free(copy);
+    hashpipe_trace_detach(shm, size);
+
+    return 0;
+}
@@ -0,0 +1,278 @@
+/* hashpipe_watchdog.c
+ *
+ * Watchdog thread described in hashpipe_watchdog.h
+ */
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "hashpipe_watchdog.h"
+
+// Number of trace events to log for a stalled thread
+#define DUMP_EVENTS 16
+
+// Progress of a databuf consumed by pipeline threads
+struct databuf_progress {
+    int id;
+    hashpipe_databuf_t *db;
+    uint64_t freed; // Blocks marked free at last change
+    double last;    // Time of last change (or of having no filled blocks)
+    int nfilled;
+};
+
+// Heartbeat of a pipeline thread
+struct thread_progress {
+    uint64_t heartbeat;
+    double last;    // Time of last heartbeat
+    int stalled;
+    int published;  // Value of STALLN in status buffer (-1 if none yet)
+};
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+int hashpipe_watchdog_parse(const char *spec, hashpipe_watchdog_args_t *w)
+{
+    char *end;
+
+    w->timeout = strtod(spec, &end);
+    if(end == spec || w->timeout <= 0) {
+        return -1;
+    }
+    w->dump = w->abort = 0;
+    while(*end == ',') {
+        if(!strncmp(end, ",dump", 5)) {
+            w->dump = 1;
+            end += 5;
+        } else if(!strncmp(end, ",abort", 6)) {
+            w->abort = 1;
+            end += 6;
+        } else {
+            return -1;
+        }
+    }
+    return *end ? -1 : 0;
+}
+
+// Prints the most recent trace events of the thread with Linux thread ID tid
+// to stderr (bypassing the rate limit of the log functions)
+static void dump_trace(int tid)
+{
+    static const char *names[HASHPIPE_TRACE_NTYPES] = {
+        [HASHPIPE_TRACE_WAIT_FREE_BEGIN]   = "wait_free_begin",
+        [HASHPIPE_TRACE_WAIT_FREE_END]     = "wait_free_end",
+        [HASHPIPE_TRACE_WAIT_FILLED_BEGIN] = "wait_filled_begin",
+        [HASHPIPE_TRACE_WAIT_FILLED_END]   = "wait_filled_end",
+        [HASHPIPE_TRACE_SET_FREE]          = "set_free",
+        [HASHPIPE_TRACE_SET_FILLED]        = "set_filled",
+        [HASHPIPE_TRACE_LOCK_WAIT]         = "lock_wait",
+        [HASHPIPE_TRACE_LOCKED]            = "locked",
+        [HASHPIPE_TRACE_UNLOCKED]          = "unlocked",
+        [HASHPIPE_TRACE_PKT_BATCH]         = "pkt_batch",
+        [HASHPIPE_TRACE_USER_BEGIN]        = "user_begin",
+        [HASHPIPE_TRACE_USER_END]          = "user_end",
+        [HASHPIPE_TRACE_USER_MARK]         = "user_mark"
+    };
+    hashpipe_trace_shm_t *shm = hashpipe_trace_shm;
+    hashpipe_trace_event_t *events, *e;
+    uint64_t head, i, tsc;
+    double ns_per_tick = 1;
+    uint32_t r, nrings;
+
+    if(!shm) {
+        hashpipe_warn(__FUNCTION__, "no trace to dump");
+        return;
+    }
+    if(!shm->tsc_is_ns && shm->tsc1 > shm->tsc0) {
+        ns_per_tick = (double)(shm->mono1 - shm->mono0)
+                    / (shm->tsc1 - shm->tsc0);
+    }
+    nrings = shm->nrings;
+    if(nrings > HASHPIPE_TRACE_MAX_RINGS) {
+        nrings = HASHPIPE_TRACE_MAX_RINGS;
+    }
+    for(r=0; r<nrings; r++) {
+        if(shm->ring[r].tid == tid) {
+            break;
+        }
+    }
+    if(r == nrings) {
+        hashpipe_warn(__FUNCTION__, "no trace events for thread %d", tid);
+        return;
+    }
+
+    // Print after pending log messages
+    hashpipe_log_drain();
+    events = hashpipe_trace_events(shm, r);
+    head = __atomic_load_n(&shm->ring[r].head, __ATOMIC_ACQUIRE);
+    tsc = hashpipe_trace_tsc();
+    i = head > DUMP_EVENTS ? head - DUMP_EVENTS : 0;
+    if(head - i > shm->ring[r].mask + 1) {
+        i = head - (shm->ring[r].mask + 1);
+    }
+    fprintf(stderr, "Last %u trace events of thread '%s':\n",
+            (unsigned)(head - i), shm->ring[r].name);
+    for(; i<head; i++) {
+        e = &events[i & shm->ring[r].mask];
+        fprintf(stderr, "  %s: %s(%u, %u) %.6f s ago\n",
+                shm->ring[r].name,
+                e->type < HASHPIPE_TRACE_NTYPES && names[e->type]
+                    ? names[e->type] : "unknown",
+                e->aux, e->arg & ~HASHPIPE_TRACE_FAILED,
+                1e-9 * ns_per_tick * (int64_t)(tsc - e->tsc));
+    }
+}
+
+void *hashpipe_watchdog_run(void *vp_args)
+{
+    hashpipe_watchdog_args_t *w = (hashpipe_watchdog_args_t *)vp_args;
+    hashpipe_thread_args_t *args = w->args;
+    int n = w->num_threads;
+    struct thread_progress *tp;
+    struct databuf_progress *dp;
+    hashpipe_status_t st;
+    struct timespec period;
+    double t, stalled_for;
+    uint64_t heartbeat, freed;
+    int ndb = 0, nstalled, wdstat = -1, i, j, k;
+    char key[16];
+
+    tp = calloc(n, sizeof(*tp));
+    dp = calloc(n * HASHPIPE_MAX_THREAD_DATABUFS, sizeof(*dp));
+    if(!tp || !dp || hashpipe_status_attach(args[0].instance_id, &st)) {
+        hashpipe_error(__FUNCTION__, "watchdog setup failed");
+        free(tp);
+        free(dp);
+        return NULL;
+    }
+
+    // Attach to input databufs of all threads (except those whose freed
+    // blocks are not counted, see hashpipe_databuf_freed())
+    t = now();
+    for(i=0; i<n; i++) {
+        tp[i].last = t;
+        tp[i].published = -1;
+        for(j=0; j<args[i].num_input_buffers; j++) {
+            for(k=0; k<ndb && dp[k].id != args[i].input_buffers[j]; k++);
+            if(k < ndb || args[i].input_buffers[j] < 1
+            || args[i].input_buffers[j] >= HASHPIPE_TRACE_MAX_DATABUFS) {
+                continue;
+            }
+            dp[ndb].id = args[i].input_buffers[j];
+            dp[ndb].db = hashpipe_databuf_attach(args[i].instance_id,
+                    dp[ndb].id);
+            dp[ndb].last = t;
+            if(dp[ndb].db) {
+                ndb++;
+            }
+        }
+    }
+
+    // Check a few times per timeout (but at least once per second)
+    t = w->timeout / 4 < 1 ? w->timeout / 4 : 1;
+    period.tv_sec = (time_t)t;
+    period.tv_nsec = (long)(1e9 * (t - period.tv_sec));
+
+    while(run_threads()) {
+        nanosleep(&period, NULL);
+        t = now();
+
+        // Databufs with filled blocks should make progress
+        for(k=0; k<ndb; k++) {
+            dp[k].nfilled = hashpipe_databuf_total_status(dp[k].db);
+            freed = hashpipe_databuf_freed(dp[k].id);
+            if(dp[k].nfilled == 0 || freed != dp[k].freed) {
+                dp[k].freed = freed;
+                dp[k].last = t;
+            }
+        }
+
+        nstalled = 0;
+        for(i=0; i<n; i++) {
+            heartbeat = __atomic_load_n(&args[i].heartbeat, __ATOMIC_ACQUIRE);
+            if(heartbeat != tp[i].heartbeat
+            || __atomic_load_n(&args[i].waiting, __ATOMIC_RELAXED)) {
+                tp[i].heartbeat = heartbeat;
+                tp[i].last = t;
+            }
+            stalled_for = t - tp[i].last;
+            for(k=0; k<ndb; k++) {
+                for(j=0; j<args[i].num_input_buffers; j++) {
+                    if(args[i].input_buffers[j] == dp[k].id
+                    && t - dp[k].last > stalled_for) {
+                        stalled_for = t - dp[k].last;
+                    }
+                }
+            }
+            if(args[i].finished || stalled_for < w->timeout) {
+                stalled_for = 0;
+            }
+
+            // Only touch status buffer when value changes
+            if((int)stalled_for != tp[i].published) {
+                tp[i].published = (int)stalled_for;
+                snprintf(key, sizeof(key), "STALL%d", i);
+                hashpipe_status_lock_safe(&st);
+                hputi4(st.buf, key, tp[i].published);
+                hashpipe_status_unlock_safe(&st);
+            }
+
+            if(stalled_for == 0) {
+                tp[i].stalled = 0;
+                continue;
+            }
+            nstalled++;
+            if(tp[i].stalled) {
+                continue;
+            }
+            tp[i].stalled = 1;
+
+            // Newly stalled
+            hashpipe_error(__FUNCTION__,
+                    "thread %d '%s' stalled for %.1f s (%s)", i,
+                    args[i].thread_desc->name, stalled_for,
+                    t - tp[i].last >= w->timeout ? "no heartbeat"
+                    : "input blocks not consumed");
+            for(k=0; k<ndb; k++) {
+                for(j=0; j<args[i].num_input_buffers; j++) {
+                    if(args[i].input_buffers[j] == dp[k].id) {
+                        hashpipe_info(__FUNCTION__,
+                                "databuf %d: %d blocks filled (mask %016lx)",
+                                dp[k].id, dp[k].nfilled,
+                                hashpipe_databuf_total_mask(dp[k].db));
+                    }
+                }
+            }
+            if(w->dump) {
+                dump_trace(args[i].tid);
+            }
+            if(w->abort) {
+                hashpipe_error(__FUNCTION__, "aborting");
+                hashpipe_log_drain();
+                abort();
+            }
+        }
+
+        if(wdstat != !!nstalled) {
+            wdstat = !!nstalled;
+            hashpipe_status_lock_safe(&st);
+            hputs(st.buf, "WDSTAT", wdstat ? "stalled" : "ok");
+            hashpipe_status_unlock_safe(&st);
+        }
+    }
+
+    for(k=0; k<ndb; k++) {
+        hashpipe_databuf_detach(dp[k].db);
+    }
+    hashpipe_status_detach(&st);
+    free(dp);
+    free(tp);
+    return NULL;
+}
@@ -0,0 +1,45 @@
+/* hashpipe_watchdog.h
+ *
+ * Watchdog thread that detects stalled pipeline threads ("--watchdog" option
+ * of the hashpipe executable).  A thread is stalled when either
+ *
+ *   - it has not had a heartbeat (see hashpipe_thread_heartbeat()) for the
+ *     watchdog timeout while not waiting for a databuf block (e.g. it is stuck
+ *     in its own code or a system call), or
+ *
+ *   - one of its input databufs has had filled blocks, but none of them
+ *     marked free, for the watchdog timeout (e.g. it waits for the wrong
+ *     block or is deadlocked with another thread).  Only databufs with IDs
+ *     below HASHPIPE_TRACE_MAX_DATABUFS are checked.
+ *
+ * Waiting for blocks that never arrive (e.g. because no packets are coming
+ * in) is not a stall.  The watchdog publishes the number of seconds that
+ * thread N has been stalled (0 if it is not stalled) as status buffer key
+ * STALLN and "ok" or "stalled" as WDSTAT.  When a thread stalls, the watchdog
+ * logs an error and optionally the thread's most recent trace events and/or
+ * aborts the process (leaving a core dump and the trace segment behind).
+ */
+#ifndef _HASHPIPE_WATCHDOG_H
+#define _HASHPIPE_WATCHDOG_H
+
+#include "hashpipe.h"
+
+typedef struct {
+    double timeout; // Seconds without progress before a thread is stalled
+    int dump;       // Log trace events of stalled threads
+    int abort;      // Abort when a thread stalls
+    hashpipe_thread_args_t *args; // Pipeline threads
+    int num_threads;
+} hashpipe_watchdog_args_t;
+
+/* Parses watchdog spec "TIMEOUT[,dump][,abort]" into w.  Returns 0 on success
+ * or -1 on error.
+ */
+int hashpipe_watchdog_parse(const char *spec, hashpipe_watchdog_args_t *w);
+
+/* Watchdog thread function (vp_args points to a hashpipe_watchdog_args_t).
+ * Runs until run_threads() returns false or the thread is cancelled.
+ */
+void *hashpipe_watchdog_run(void *vp_args);
+
+#endif // _HASHPIPE_WATCHDOG_H
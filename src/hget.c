@@ -44,6 +44,8 @@
  * Subroutine:  hgetdate (hstring,keyword,date) returns date as fractional year
  * Subroutine:  hgetndec (hstring, keyword, ndec) returns number of dec. places
  * Subroutine:  hgetc  (hstring,keyword) returns character string
+ * Subroutine:  hgetv  (hstring,kv,nkv) returns values for several keywords
+ * Subroutine:  hkvsearch (hstring,kv,nkv) finds entries for several keywords
  * Subroutine:  blsearch (hstring,keyword) returns pointer to blank lines
                 before keyword
  * Subroutine:  ksearch (hstring,keyword) returns pointer to header string entry
@@ -59,8 +61,10 @@
  */
 
 #include <string.h>             /* NULL, strlen, strstr, strcpy */
+#include <strings.h>            /* strncasecmp */
 #include <stdio.h>
 #include "fitshead.h"   /* FITS header extraction subroutines */
+#include "hashpipe_status.h"
 #include <stdlib.h>
 #ifndef VMS
 #include <limits.h>
@@ -69,6 +73,7 @@
 #define SHRT_MAX 32767
 #endif
 #define VLENGTH 81
+#define HLENGTH_MAX HASHPIPE_STATUS_MAX_SIZE /* Maximum length of header string searched */
 
 #ifdef USE_SAOLIB
 static int use_saolib=0;
@@ -158,34 +163,113 @@ int     *ival;          /* Keyword value returned */
 }
 
 
-/* Extract integer*8 value for variable from FITS header string */
+/* Parse a plain decimal value string of the form [+-]digits[.digits] without
+   going through strtod.  Returns the number of significant digits (1-15) with
+   the digits as an integer in *mant and the number of decimal places in
+   *nfrac, or 0 if the string has any other form (exponent, embedded blanks,
+   quotes, too many digits) and must be parsed the slow way. */
 
-int
-hgeti8 (hstring,keyword,i8val)
+static int
+hval2dec (value, mant, nfrac, neg)
 
-const char *hstring;    /* character string containing FITS header information
-                   in the format <keyword>= <value> {/ <comment>} */
-const char *keyword;    /* character string containing the name of the keyword
-                   the value of which is returned.  hget searches for a
-                   line beginning with this string.  if "[n]" is present,
-                   the n'th token in the value is returned.
-                   (the first 8 characters must be unique) */
+const char *value;      /* Value string extracted from FITS header */
+uint8 *mant;            /* Decimal digits as integer (returned) */
+int *nfrac;             /* Number of digits after decimal point (returned) */
+int *neg;               /* 1 if value is negative, else 0 (returned) */
+{
+    const char *c = value;
+    uint8 m = 0;
+    int ndig = 0;
+    int nany = 0;
+    int nf = -1;
+
+    *neg = 0;
+    if (*c == '-') {
+        *neg = 1;
+        c++;
+        }
+    else if (*c == '+')
+        c++;
+    for (; *c != (char) 0; c++) {
+        if (*c >= '0' && *c <= '9') {
+            /* Leading zeros do not count towards precision */
+            if (m != 0 || *c != '0')
+                ndig++;
+            if (ndig > 15)
+                return (0);
+            m = m * 10 + (uint8) (*c - '0');
+            nany++;
+            if (nf >= 0)
+                nf++;
+            }
+        else if (*c == '.' && nf < 0)
+            nf = 0;
+        else
+            return (0);
+        }
+
+    /* Require at least one digit ("-", "." and "" are not numbers) */
+    if (nany == 0)
+        return (0);
+    *mant = m;
+    *nfrac = nf < 0 ? 0 : nf;
+    return (ndig > 0 ? ndig : 1);
+}
+
+/* Powers of ten that are exactly representable as doubles */
+static const double hpow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+/* Fast path for hval2r8 and hval2r4.  Both the mantissa (< 10^15) and the
+   power of ten are exact doubles, so the quotient is correctly rounded and
+   matches what strtod would return.  Returns 0 if the slow path is needed. */
+
+static int
+hval2fastr8 (value, dval)
+
+const char *value;      /* Value string extracted from FITS header */
+double *dval;           /* Parsed value (returned) */
+{
+    uint8 m;
+    int nf, neg;
+
+    if (!hval2dec (value, &m, &nf, &neg) || nf > 22)
+        return (0);
+    *dval = (double) m / hpow10[nf];
+    if (neg)
+        *dval = -*dval;
+    return (1);
+}
+
+
+/* Translate value string for hgeti8 into binary (returns 0 if value is NULL) */
+
+static int
+hval2i8 (value, keyword, i8val)
+
+char *value;            /* Value string extracted from FITS header (or NULL) */
+const char *keyword;    /* Keyword of value (for error messages) */
 int8 *i8val;
 {
-    char *value;
     char *endptr;
-    char value_buffer[VLENGTH + 1];
-
-    /* Get value and comment from header string */
-    value = hgetc_thread_safe (hstring,keyword,value_buffer);
+    uint8 m;
+    int nf, neg;
 
     /* Translate value from ASCII to binary */
     if (value != NULL) {
         if (value[0] == '#') value++;
+        /* Fast path for plain decimal integers (no octal/hex prefix) */
+        if (hval2dec (value, &m, &nf, &neg) && nf == 0 &&
+            strchr (value, '.') == NULL &&
+            (value[neg] != '0' || value[neg+1] == (char) 0)) {
+            *i8val = neg ? -(int8) m : (int8) m;
+            return 1;
+            }
         *i8val = strtoll(value, &endptr, 0);
         if(endptr && endptr[0]) {
             fprintf(stderr, "%s:%s got invalid integer character '%c' (%d)\n",
-                __FUNCTION__, keyword, endptr[0], endptr[0]);
+                "hgeti8", keyword, endptr[0], endptr[0]);
             *i8val = (long long)atof(value);
         }
         return 1;
@@ -194,10 +278,10 @@ int8 *i8val;
     }
 }
 
-/* Extract unsigned integer*8 value for variable from FITS header string */
+/* Extract integer*8 value for variable from FITS header string */
 
 int
-hgetu8 (hstring,keyword,i8val)
+hgeti8 (hstring,keyword,i8val)
 
 const char *hstring;    /* character string containing FITS header information
                    in the format <keyword>= <value> {/ <comment>} */
@@ -206,22 +290,46 @@ const char *keyword;    /* character string containing the name of the keyword
                    line beginning with this string.  if "[n]" is present,
                    the n'th token in the value is returned.
                    (the first 8 characters must be unique) */
-uint8 *i8val;
+int8 *i8val;
 {
     char *value;
-    char *endptr = NULL;
     char value_buffer[VLENGTH + 1];
 
     /* Get value and comment from header string */
     value = hgetc_thread_safe (hstring,keyword,value_buffer);
 
+    /* Translate value from ASCII to binary */
+    return (hval2i8 (value, keyword, i8val));
+}
+
+/* Translate value string for hgetu8 into binary (returns 0 if value is NULL) */
+
+static int
+hval2u8 (value, keyword, i8val)
+
+char *value;            /* Value string extracted from FITS header (or NULL) */
+const char *keyword;    /* Keyword of value (for error messages) */
+uint8 *i8val;
+{
+    char *endptr = NULL;
+    uint8 m;
+    int nf, neg;
+
     /* Translate value from ASCII to binary */
     if (value != NULL) {
         if (value[0] == '#') value++;
+        /* Fast path for plain non-negative decimal integers */
+        if (value[0] != '-' && value[0] != '+' &&
+            hval2dec (value, &m, &nf, &neg) && nf == 0 &&
+            strchr (value, '.') == NULL &&
+            (value[0] != '0' || value[1] == (char) 0)) {
+            *i8val = m;
+            return 1;
+            }
         *i8val = strtoull(value, &endptr, 0);
         if(endptr && endptr[0]) {
             fprintf(stderr, "%s:%s got invalid integer character '%c' (%d)\n",
-                __FUNCTION__, keyword, endptr[0], endptr[0]);
+                "hgetu8", keyword, endptr[0], endptr[0]);
             *i8val = (unsigned long long)atof(value);
         }
         return 1;
@@ -230,10 +338,10 @@ uint8 *i8val;
     }
 }
 
-/* Extract long value for variable from FITS header string */
+/* Extract unsigned integer*8 value for variable from FITS header string */
 
 int
-hgeti4 (hstring,keyword,ival)
+hgetu8 (hstring,keyword,i8val)
 
 const char *hstring;    /* character string containing FITS header information
                    in the format <keyword>= <value> {/ <comment>} */
@@ -242,23 +350,44 @@ const char *keyword;    /* character string containing the name of the keyword
                    line beginning with this string.  if "[n]" is present,
                    the n'th token in the value is returned.
                    (the first 8 characters must be unique) */
-int *ival;
+uint8 *i8val;
 {
     char *value;
+    char value_buffer[VLENGTH + 1];
+
+    /* Get value and comment from header string */
+    value = hgetc_thread_safe (hstring,keyword,value_buffer);
+
+    /* Translate value from ASCII to binary */
+    return (hval2u8 (value, keyword, i8val));
+}
+
+/* Translate value string for hgeti4 into binary (returns 0 if value is NULL) */
+
+static int
+hval2i4 (value, keyword, ival)
+
+char *value;            /* Value string extracted from FITS header (or NULL) */
+const char *keyword;    /* Keyword of value (for error messages) */
+int *ival;
+{
     double dval;
     int minint;
+    uint8 m;
+    int nf, neg;
     int lval;
     char *dchar;
     char val[VLENGTH+1];
-    char value_buffer[VLENGTH + 1];
-
-    /* Get value and comment from header string */
-    value = hgetc_thread_safe (hstring,keyword,value_buffer);
 
     /* Translate value from ASCII to binary */
     if (value != NULL) {
         if (value[0] == '#') value++;
         minint = -INT_MAX - 1;
+        /* Fast path for plain decimal integers that fit */
+        if (hval2dec (value, &m, &nf, &neg) && nf == 0 && m <= INT_MAX) {
+            *ival = neg ? -(int) m : (int) m;
+            return (1);
+            }
         lval = strlen (value);
         if (lval > VLENGTH) {
             strncpy (val, value, VLENGTH);
@@ -290,10 +419,10 @@ int *ival;
         }
 }
 
-/* Extract unsigned long value for variable from FITS header string */
+/* Extract long value for variable from FITS header string */
 
 int
-hgetu4 (hstring,keyword,ival)
+hgeti4 (hstring,keyword,ival)
 
 const char *hstring;    /* character string containing FITS header information
                    in the format <keyword>= <value> {/ <comment>} */
@@ -302,23 +431,45 @@ const char *keyword;    /* character string containing the name of the keyword
                    line beginning with this string.  if "[n]" is present,
                    the n'th token in the value is returned.
                    (the first 8 characters must be unique) */
-unsigned int *ival;
+int *ival;
 {
     char *value;
+    char value_buffer[VLENGTH + 1];
+
+    /* Get value and comment from header string */
+    value = hgetc_thread_safe (hstring,keyword,value_buffer);
+
+    /* Translate value from ASCII to binary */
+    return (hval2i4 (value, keyword, ival));
+}
+
+/* Translate value string for hgetu4 into binary (returns 0 if value is NULL) */
+
+static int
+hval2u4 (value, keyword, ival)
+
+char *value;            /* Value string extracted from FITS header (or NULL) */
+const char *keyword;    /* Keyword of value (for error messages) */
+unsigned int *ival;
+{
     double dval;
     int minint;
+    uint8 m;
+    int nf, neg;
     int lval;
     char *dchar;
     char val[VLENGTH+1];
-    char value_buffer[VLENGTH + 1];
-
-    /* Get value and comment from header string */
-    value = hgetc_thread_safe (hstring,keyword,value_buffer);
 
     /* Translate value from ASCII to binary */
     if (value != NULL) {
         if (value[0] == '#') value++;
         minint = 0;
+        /* Fast path for plain decimal integers that fit */
+        if (hval2dec (value, &m, &nf, &neg) && nf == 0 && !neg &&
+            m <= UINT_MAX) {
+            *ival = (unsigned int) m;
+            return (1);
+            }
         lval = strlen (value);
         if (lval > VLENGTH) {
             strncpy (val, value, VLENGTH);
@@ -350,11 +501,10 @@ unsigned int *ival;
         }
 }
 
-
-/* Extract integer*2 value for variable from fits header string */
+/* Extract unsigned long value for variable from FITS header string */
 
 int
-hgeti2 (hstring,keyword,ival)
+hgetu4 (hstring,keyword,ival)
 
 const char *hstring;    /* character string containing FITS header information
                    in the format <keyword>= <value> {/ <comment>} */
@@ -363,18 +513,33 @@ const char *keyword;    /* character string containing the name of the keyword
                    line beginning with this string.  if "[n]" is present,
                    the n'th token in the value is returned.
                    (the first 8 characters must be unique) */
-short *ival;
+unsigned int *ival;
 {
     char *value;
+    char value_buffer[VLENGTH + 1];
+
+    /* Get value and comment from header string */
+    value = hgetc_thread_safe (hstring,keyword,value_buffer);
+
+    /* Translate value from ASCII to binary */
+    return (hval2u4 (value, keyword, ival));
+}
+
+
+/* Translate value string for hgeti2 into binary (returns 0 if value is NULL) */
+
+static int
+hval2i2 (value, keyword, ival)
+
+char *value;            /* Value string extracted from FITS header (or NULL) */
+const char *keyword;    /* Keyword of value (for error messages) */
+short *ival;
+{
     double dval;
     int minshort;
     int lval;
     char *dchar;
     char val[VLENGTH+1];
-    char value_buffer[VLENGTH + 1];
-
-    /* Get value and comment from header string */
-    value = hgetc_thread_safe (hstring,keyword,value_buffer);
 
     /* Translate value from ASCII to binary */
     if (value != NULL) {
@@ -411,10 +576,10 @@ short *ival;
         }
 }
 
-/* Extract real value for variable from FITS header string */
+/* Extract integer*2 value for variable from fits header string */
 
 int
-hgetr4 (hstring,keyword,rval)
+hgeti2 (hstring,keyword,ival)
 
 const char *hstring;    /* character string containing FITS header information
                    in the format <keyword>= <value> {/ <comment>} */
@@ -423,20 +588,39 @@ const char *keyword;    /* character string containing the name of the keyword
                    line beginning with this string.  if "[n]" is present,
                    the n'th token in the value is returned.
                    (the first 8 characters must be unique) */
-float *rval;
+short *ival;
 {
     char *value;
-    int lval;
-    char *dchar;
-    char val[VLENGTH+1];
     char value_buffer[VLENGTH + 1];
 
     /* Get value and comment from header string */
     value = hgetc_thread_safe (hstring,keyword,value_buffer);
 
+    /* Translate value from ASCII to binary */
+    return (hval2i2 (value, keyword, ival));
+}
+
+/* Translate value string for hgetr4 into binary (returns 0 if value is NULL) */
+
+static int
+hval2r4 (value, keyword, rval)
+
+char *value;            /* Value string extracted from FITS header (or NULL) */
+const char *keyword;    /* Keyword of value (for error messages) */
+float *rval;
+{
+    double dval;
+    int lval;
+    char *dchar;
+    char val[VLENGTH+1];
+
     /* translate value from ASCII to binary */
     if (value != NULL) {
         if (value[0] == '#') value++;
+        if (hval2fastr8 (value, &dval)) {
+            *rval = (float) dval;
+            return (1);
+            }
         lval = strlen (value);
         if (lval > VLENGTH) {
             strncpy (val, value, VLENGTH);
@@ -460,6 +644,30 @@ float *rval;
         }
 }
 
+/* Extract real value for variable from FITS header string */
+
+int
+hgetr4 (hstring,keyword,rval)
+
+const char *hstring;    /* character string containing FITS header information
+                   in the format <keyword>= <value> {/ <comment>} */
+const char *keyword;    /* character string containing the name of the keyword
+                   the value of which is returned.  hget searches for a
+                   line beginning with this string.  if "[n]" is present,
+                   the n'th token in the value is returned.
+                   (the first 8 characters must be unique) */
+float *rval;
+{
+    char *value;
+    char value_buffer[VLENGTH + 1];
+
+    /* Get value and comment from header string */
+    value = hgetc_thread_safe (hstring,keyword,value_buffer);
+
+    /* Translate value from ASCII to binary */
+    return (hval2r4 (value, keyword, rval));
+}
+
 
 /* Extract real*8 right ascension in degrees from FITS header string */
 
@@ -552,32 +760,24 @@ double  *dval;          /* Keyword value returned */
 
 
 
-/* Extract real*8 value for variable from FITS header string */
+/* Translate value string for hgetr8 into binary (returns 0 if value is NULL) */
 
-int
-hgetr8 (hstring,keyword,dval)
+static int
+hval2r8 (value, keyword, dval)
 
-const char *hstring;    /* character string containing FITS header information
-                   in the format <keyword>= <value> {/ <comment>} */
-const char *keyword;    /* character string containing the name of the keyword
-                   the value of which is returned.  hget searches for a
-                   line beginning with this string.  if "[n]" is present,
-                   the n'th token in the value is returned.
-                   (the first 8 characters must be unique) */
+char *value;            /* Value string extracted from FITS header (or NULL) */
+const char *keyword;    /* Keyword of value (for error messages) */
 double *dval;
 {
-    char *value;
     int lval;
     char *dchar;
     char val[VLENGTH+1];
-    char value_buffer[VLENGTH + 1];
-
-    /* Get value and comment from header string */
-    value = hgetc_thread_safe (hstring,keyword,value_buffer);
 
     /* Translate value from ASCII to binary */
     if (value != NULL) {
         if (value[0] == '#') value++;
+        if (hval2fastr8 (value, dval))
+            return (1);
         lval = strlen (value);
         if (lval > VLENGTH) {
             strncpy (val, value, VLENGTH);
@@ -601,11 +801,10 @@ double *dval;
         }
 }
 
-
-/* Extract logical value for variable from FITS header string */
+/* Extract real*8 value for variable from FITS header string */
 
 int
-hgetl (hstring,keyword,ival)
+hgetr8 (hstring,keyword,dval)
 
 const char *hstring;    /* character string containing FITS header information
                    in the format <keyword>= <value> {/ <comment>} */
@@ -614,17 +813,32 @@ const char *keyword;    /* character string containing the name of the keyword
                    line beginning with this string.  if "[n]" is present,
                    the n'th token in the value is returned.
                    (the first 8 characters must be unique) */
-int *ival;
+double *dval;
 {
     char *value;
-    char newval;
-    int lval;
-    char val[VLENGTH+1];
     char value_buffer[VLENGTH + 1];
 
     /* Get value and comment from header string */
     value = hgetc_thread_safe (hstring,keyword,value_buffer);
 
+    /* Translate value from ASCII to binary */
+    return (hval2r8 (value, keyword, dval));
+}
+
+
+/* Translate value string for hgetl into binary (returns 0 if value is NULL) */
+
+static int
+hval2l (value, keyword, ival)
+
+char *value;            /* Value string extracted from FITS header (or NULL) */
+const char *keyword;    /* Keyword of value (for error messages) */
+int *ival;
+{
+    char newval;
+    int lval;
+    char val[VLENGTH+1];
+
     /* Translate value from ASCII to binary */
     if (value != NULL) {
         lval = strlen (value);
@@ -646,6 +860,30 @@ int *ival;
         }
 }
 
+/* Extract logical value for variable from FITS header string */
+
+int
+hgetl (hstring,keyword,ival)
+
+const char *hstring;    /* character string containing FITS header information
+                   in the format <keyword>= <value> {/ <comment>} */
+const char *keyword;    /* character string containing the name of the keyword
+                   the value of which is returned.  hget searches for a
+                   line beginning with this string.  if "[n]" is present,
+                   the n'th token in the value is returned.
+                   (the first 8 characters must be unique) */
+int *ival;
+{
+    char *value;
+    char value_buffer[VLENGTH + 1];
+
+    /* Get value and comment from header string */
+    value = hgetc_thread_safe (hstring,keyword,value_buffer);
+
+    /* Translate value from ASCII to binary */
+    return (hval2l (value, keyword, ival));
+}
+
 
 /* Extract real*8 date from FITS header string (dd/mm/yy or dd-mm-yy) */
 
@@ -925,27 +1163,16 @@ char    *str;           /* String (returned) */
 }
 
 
-/* Extract string value for variable from FITS header string */
+/* Copy value string for hgets into str (returns 0 if value is NULL) */
 
-int
-hgets (hstring, keyword, lstr, str)
+static int
+hval2s (value, lstr, str)
 
-const char *hstring;    /* character string containing FITS header information
-                   in the format <keyword>= <value> {/ <comment>} */
-const char *keyword;    /* character string containing the name of the keyword
-                   the value of which is returned.  hget searches for a
-                   line beginning with this string.  if "[n]" is present,
-                   the n'th token in the value is returned.
-                   (the first 8 characters must be unique) */
-const int lstr; /* Size of str in characters */
-char *str;      /* String (returned) */
+const char *value;      /* Value string extracted from FITS header (or NULL) */
+const int lstr;         /* Size of str in characters */
+char *str;              /* String (returned) */
 {
-    char *value;
     int lval;
-    char value_buffer[VLENGTH + 1];
-
-    /* Get value and comment from header string */
-    value = hgetc_thread_safe (hstring,keyword,value_buffer);
 
     if (value != NULL) {
         lval = strlen (value);
@@ -961,11 +1188,35 @@ char *str;      /* String (returned) */
         return (0);
 }
 
-
-/* Extract number of decimal places for value in FITS header string */
+/* Extract string value for variable from FITS header string */
 
 int
-hgetndec (hstring, keyword, ndec)
+hgets (hstring, keyword, lstr, str)
+
+const char *hstring;    /* character string containing FITS header information
+                   in the format <keyword>= <value> {/ <comment>} */
+const char *keyword;    /* character string containing the name of the keyword
+                   the value of which is returned.  hget searches for a
+                   line beginning with this string.  if "[n]" is present,
+                   the n'th token in the value is returned.
+                   (the first 8 characters must be unique) */
+const int lstr; /* Size of str in characters */
+char *str;      /* String (returned) */
+{
+    char *value;
+    char value_buffer[VLENGTH + 1];
+
+    /* Get value and comment from header string */
+    value = hgetc_thread_safe (hstring,keyword,value_buffer);
+
+    return (hval2s (value, lstr, str));
+}
+
+
+/* Extract number of decimal places for value in FITS header string */
+
+int
+hgetndec (hstring, keyword, ndec)
 
 const char *hstring;    /* character string containing FITS header information
                    in the format <keyword>= <value> {/ <comment>} */
@@ -1021,75 +1272,37 @@ const char *keyword0;   /* character string containing the name of the keyword
     return cval;
 }
 
-char *
-hgetc_thread_safe (hstring,keyword0, value_buffer)
+/* Extract value from FITS header line vpos into cval.  If brack1 is not NULL,
+ * it points to the token specifier (e.g. "2]") given after the keyword.
+ */
 
-const char *hstring;    /* character string containing FITS header information
-                   in the format <keyword>= <value> {/ <comment>} */
-const char *keyword0;   /* character string containing the name of the keyword
-                   the value of which is returned.  hget searches for a
-                   line beginning with this string.  if "[n]" is present,
-                   the n'th token in the value is returned.
-                   (the first 8 characters must be unique) */
-char *value_buffer; /* output buffer, assumed to be VLENGTH+1 bytes minimum */
+static char *
+hgetc_card (vpos, brack1, cval)
+
+const char *vpos;   /* FITS header line containing keyword */
+char *brack1;       /* Token specifier following '[' or ',' (or NULL) */
+char *cval;         /* output buffer, assumed to be VLENGTH+1 bytes minimum */
 {
-    char *cval;
     char *value;
     char cwhite[2];
-    char squot[2], dquot[2], lbracket[2], rbracket[2], slash[2], comma[2];
+    char squot[2], dquot[2], rbracket[2], slash[2];
     char space;
-    char keyword[81]; /* large for ESO hierarchical keywords */
     char line[100];
-    char *vpos, *cpar;
-    char *q1, *q2, *v1, *v2, *c1, *brack1, *brack2;
+    char *cpar = NULL;
+    char *q1, *q2, *v1, *v2, *c1, *brack2;
     //int ipar, i, lkey;
     int ipar, i;
 
-#ifdef USE_SAOLIB
-    int iel=1, ip=1, nel, np, ier;
-    char *get_fits_head_str();
-
-    if( !use_saolib ){
-#endif
-
-    if (value_buffer == NULL)
-    {
-        return NULL;
-    }
-    cval = value_buffer;
-
     squot[0] = (char) 39;
     squot[1] = (char) 0;
     dquot[0] = (char) 34;
     dquot[1] = (char) 0;
-    lbracket[0] = (char) 91;
-    lbracket[1] = (char) 0;
-    comma[0] = (char) 44;
-    comma[1] = (char) 0;
     rbracket[0] = (char) 93;
     rbracket[1] = (char) 0;
     slash[0] = (char) 47;
     slash[1] = (char) 0;
     space = (char) 32;
 
-    /* Find length of variable name */
-    strncpy (keyword,keyword0, sizeof(keyword)-1);
-    brack1 = strsrch (keyword,lbracket);
-    if (brack1 == NULL)
-        brack1 = strsrch (keyword,comma);
-    if (brack1 != NULL) {
-        *brack1 = '\0';
-        brack1++;
-        }
-
-    /* Search header string for variable name */
-    vpos = ksearch (hstring,keyword);
-
-    /* Exit if not found */
-    if (vpos == NULL) {
-        return (NULL);
-        }
-
     /* Initialize line to nulls */
     for (i = 0; i < 100; i++)
         line[i] = 0;
@@ -1262,6 +1475,62 @@ char *value_buffer; /* output buffer, assumed to be VLENGTH+1 bytes minimum */
         }
 
     return (value);
+}
+
+char *
+hgetc_thread_safe (hstring,keyword0, value_buffer)
+
+const char *hstring;    /* character string containing FITS header information
+                   in the format <keyword>= <value> {/ <comment>} */
+const char *keyword0;   /* character string containing the name of the keyword
+                   the value of which is returned.  hget searches for a
+                   line beginning with this string.  if "[n]" is present,
+                   the n'th token in the value is returned.
+                   (the first 8 characters must be unique) */
+char *value_buffer; /* output buffer, assumed to be VLENGTH+1 bytes minimum */
+{
+    char *cval;
+    char lbracket[2], comma[2];
+    char keyword[81]; /* large for ESO hierarchical keywords */
+    char *vpos, *brack1;
+
+#ifdef USE_SAOLIB
+    int iel=1, ip=1, nel, np, ier;
+    char *get_fits_head_str();
+
+    if( !use_saolib ){
+#endif
+
+    if (value_buffer == NULL)
+    {
+        return NULL;
+    }
+    cval = value_buffer;
+
+    lbracket[0] = (char) 91;
+    lbracket[1] = (char) 0;
+    comma[0] = (char) 44;
+    comma[1] = (char) 0;
+
+    /* Find length of variable name */
+    strncpy (keyword,keyword0, sizeof(keyword)-1);
+    brack1 = strsrch (keyword,lbracket);
+    if (brack1 == NULL)
+        brack1 = strsrch (keyword,comma);
+    if (brack1 != NULL) {
+        *brack1 = '\0';
+        brack1++;
+        }
+
+    /* Search header string for variable name */
+    vpos = ksearch (hstring,keyword);
+
+    /* Exit if not found */
+    if (vpos == NULL) {
+        return (NULL);
+        }
+
+    return (hgetc_card (vpos, brack1, cval));
 #ifdef USE_SAOLIB
     } else {
         return(get_fits_head_str(keyword0, iel, ip, &nel, &np, &ier, hstring));
@@ -1270,6 +1539,295 @@ char *value_buffer; /* output buffer, assumed to be VLENGTH+1 bytes minimum */
 }
 
 
+/* Find the value field of FITS header line card (without copying it) */
+
+static int
+hview_card (card, value, lvalue)
+
+const char *card;       /* FITS header line containing keyword */
+const char **value;     /* Pointer to start of value in card (returned) */
+int *lvalue;            /* Length of value in characters (returned) */
+{
+    const char *v1, *v2, *end;
+
+    end = card + 80;
+    v1 = card + 9;
+    if (card[8] != '=')
+        v1 = card + 8;
+
+    /* Skip leading spaces */
+    while (v1 < end && *v1 == ' ')
+        v1++;
+
+    /* Quoted value ends at closing quote ('' is an embedded quote) */
+    if (v1 < end && *v1 == '\'') {
+        v1++;
+        for (v2 = v1; v2 < end && *v2 != '\0'; v2++) {
+            if (*v2 == '\'') {
+                if (v2+1 < end && v2[1] == '\'')
+                    v2++;
+                else
+                    break;
+                }
+            }
+        }
+
+    /* Unquoted value ends at comment */
+    else {
+        for (v2 = v1; v2 < end && *v2 != '\0' && *v2 != '/'; v2++)
+            ;
+        }
+
+    /* Drop trailing spaces */
+    while (v2 > v1 && (v2[-1] == ' ' || v2[-1] == (char) 13))
+        v2--;
+
+    *value = v1;
+    *lvalue = v2 - v1;
+    return (1);
+}
+
+
+/* Find value of keyword in FITS header string without copying it.  The
+   value is not NUL terminated.  Quotes around string values are not part of
+   the value, but embedded quotes remain doubled.  Unlike hgetc_thread_safe(),
+   this uses no static storage, makes no copies, and does not support "[n]"
+   token specifiers.  Returns 1 if keyword is found, 0 if not. */
+
+int
+hview (hstring, keyword, value, lvalue)
+
+const char *hstring;    /* character string containing FITS header information
+                   in the format <keyword>= <value> {/ <comment>} */
+const char *keyword;    /* character string containing the name of the keyword
+                   the value of which is returned.  hview searches for a
+                   line beginning with this string.
+                   (the first 8 characters must be unique) */
+const char **value;     /* Pointer to start of value in hstring (returned) */
+int *lvalue;            /* Length of value in characters (returned) */
+{
+    const char *card;
+
+    card = ksearch (hstring, keyword);
+    if (card == NULL)
+        return (0);
+    return (hview_card (card, value, lvalue));
+}
+
+
+/* Copy value of keyword into value_buffer for the typed hview functions.
+   Returns value_buffer or NULL if keyword is not found. */
+
+static char *
+hview2buf (hstring, keyword, value_buffer)
+
+const char *hstring;    /* FITS header string */
+const char *keyword;    /* FITS keyword */
+char *value_buffer;     /* output buffer, VLENGTH+1 bytes */
+{
+    const char *value;
+    int lvalue;
+
+    if (!hview (hstring, keyword, &value, &lvalue))
+        return (NULL);
+    if (lvalue > VLENGTH)
+        lvalue = VLENGTH;
+    memcpy (value_buffer, value, lvalue);
+    value_buffer[lvalue] = '\0';
+    return (value_buffer);
+}
+
+
+/* Typed versions of hview().  Like hgeti4() et al., but reentrant and
+   without the overhead of hgetc_thread_safe().  Return 1 if keyword is
+   found and its value converted, 0 if not. */
+
+int
+hviewi4 (hstring, keyword, ival)
+
+const char *hstring;    /* FITS header string */
+const char *keyword;    /* FITS keyword */
+int *ival;              /* Integer value (returned) */
+{
+    char value_buffer[VLENGTH + 1];
+    return (hval2i4 (hview2buf (hstring, keyword, value_buffer),
+                     keyword, ival));
+}
+
+int
+hviewi8 (hstring, keyword, i8val)
+
+const char *hstring;    /* FITS header string */
+const char *keyword;    /* FITS keyword */
+int8 *i8val;            /* Integer*8 value (returned) */
+{
+    char value_buffer[VLENGTH + 1];
+    return (hval2i8 (hview2buf (hstring, keyword, value_buffer),
+                     keyword, i8val));
+}
+
+int
+hviewu8 (hstring, keyword, u8val)
+
+const char *hstring;    /* FITS header string */
+const char *keyword;    /* FITS keyword */
+uint8 *u8val;           /* Unsigned integer*8 value (returned) */
+{
+    char value_buffer[VLENGTH + 1];
+    return (hval2u8 (hview2buf (hstring, keyword, value_buffer),
+                     keyword, u8val));
+}
+
+int
+hviewr8 (hstring, keyword, dval)
+
+const char *hstring;    /* FITS header string */
+const char *keyword;    /* FITS keyword */
+double *dval;           /* Real*8 value (returned) */
+{
+    char value_buffer[VLENGTH + 1];
+    return (hval2r8 (hview2buf (hstring, keyword, value_buffer),
+                     keyword, dval));
+}
+
+int
+hviewl (hstring, keyword, ival)
+
+const char *hstring;    /* FITS header string */
+const char *keyword;    /* FITS keyword */
+int *ival;              /* Logical value, 0 or 1 (returned) */
+{
+    char value_buffer[VLENGTH + 1];
+    return (hval2l (hview2buf (hstring, keyword, value_buffer),
+                    keyword, ival));
+}
+
+
+/* Find FITS header lines for several keywords in a single pass */
+
+static int kcard ();
+
+int
+hkvsearch (hstring, kv, nkv)
+
+const char *hstring;    /* character string containing FITS header information
+                   in the format <keyword>= <value> {/ <comment>}
+                   with each entry padded with spaces to 80 characters */
+hkv_t *kv;      /* Array of keyword/value descriptors.  The card field of each
+                   element is set to the line containing its keyword or to
+                   NULL if the keyword is not found.  Lines are matched
+                   exactly like ksearch does (only the first 8 characters of
+                   each keyword are used and matching is case insensitive).
+                   Token specifiers ("[n]") are not supported. */
+const int nkv;  /* Number of elements in kv */
+{
+    char keyword8[9];
+    const char *headlast;
+    char *line, *hend;
+    int i, lkey, lhead, nleft, nfound;
+
+    for (i = 0; i < nkv; i++)
+        kv[i].card = NULL;
+    nfound = 0;
+    nleft = nkv;
+
+/* Use cached END card and index of a locked status buffer if possible */
+    hend = hashpipe_status_end_hint (hstring);
+    if (hend != NULL) {
+        headlast = hend + 80;
+        for (i = 0; i < nkv; i++) {
+            strncpy (keyword8, kv[i].keyword, 8);
+            keyword8[8] = '\0';
+            lkey = strlen (keyword8);
+            if (!strcmp (keyword8, "END"))
+                line = hend;
+            else
+                line = hashpipe_status_index_get (hstring, keyword8);
+            if (line != NULL && line <= hend &&
+                kcard (line, headlast, keyword8, lkey)) {
+                kv[i].card = line;
+                nfound++;
+                nleft--;
+                }
+            }
+        }
+
+/* Find current length of header string */
+    else {
+        for (lhead = 0; lhead < (lhead0 ? lhead0 : HLENGTH_MAX); lhead++) {
+            if (hstring[lhead] == (char) 0)
+                break;
+            }
+        headlast = hstring + lhead;
+        }
+
+/* Visit each line once for the keywords not found yet */
+    for (line = (char *) hstring; line < headlast && nleft > 0; line += 80) {
+        for (i = 0; i < nkv; i++) {
+            if (kv[i].card != NULL)
+                continue;
+            lkey = strnlen (kv[i].keyword, 8);
+            if (!kcard (line, headlast, kv[i].keyword, lkey))
+                continue;
+            kv[i].card = line;
+            nfound++;
+            nleft--;
+
+            /* Remember where keyword is for next time */
+            if (hend != NULL) {
+                strncpy (keyword8, kv[i].keyword, 8);
+                keyword8[8] = '\0';
+                hashpipe_status_index_put (hstring, keyword8, line);
+                }
+            }
+        }
+
+    return (nfound);
+}
+
+
+/* Extract values for several keywords from FITS header string in one pass */
+
+int
+hgetv (hstring, kv, nkv)
+
+const char *hstring;    /* character string containing FITS header information
+                   in the format <keyword>= <value> {/ <comment>} */
+hkv_t *kv;      /* Array of keyword/value descriptors.  For each one that is
+                   found, the value is translated according to its type and
+                   stored where its val field points (strings are stored
+                   like hgets, using the lstr field as the size of the
+                   buffer).  Values of keywords that are not found are left
+                   unchanged; their card field will be NULL. */
+const int nkv;  /* Number of elements in kv */
+{
+    int i, nfound;
+    char *value;
+    char value_buffer[VLENGTH + 1];
+
+    hkvsearch (hstring, kv, nkv);
+
+    nfound = 0;
+    for (i = 0; i < nkv; i++) {
+        if (kv[i].card == NULL)
+            continue;
+        value = hgetc_card (kv[i].card, NULL, value_buffer);
+        switch (kv[i].type) {
+            case HKV_I4: nfound += hval2i4 (value, kv[i].keyword, kv[i].val); break;
+            case HKV_U4: nfound += hval2u4 (value, kv[i].keyword, kv[i].val); break;
+            case HKV_I8: nfound += hval2i8 (value, kv[i].keyword, kv[i].val); break;
+            case HKV_U8: nfound += hval2u8 (value, kv[i].keyword, kv[i].val); break;
+            case HKV_R4: nfound += hval2r4 (value, kv[i].keyword, kv[i].val); break;
+            case HKV_R8: nfound += hval2r8 (value, kv[i].keyword, kv[i].val); break;
+            case HKV_L:  nfound += hval2l (value, kv[i].keyword, kv[i].val); break;
+            case HKV_S:  nfound += hval2s (value, kv[i].lstr, kv[i].val); break;
+            }
+        }
+
+    return (nfound);
+}
+
+
 /* Find beginning of fillable blank line before FITS header keyword line */
 
 char *
@@ -1290,60 +1848,11 @@ const char *keyword;    /* character string containing the name of the variable
                 literal or a character variable terminated by a null
                 or '$'.  it is truncated to 8 characters. */
 {
-    const char *headlast;
-    char *loc, *headnext, *pval, *lc, *line;
+    char *pval;
     char *bval;
-    int icol, nextchar, lkey, nleft, lhstr;
-
-    pval = 0;
 
     /* Search header string for variable name */
-    if (lhead0)
-        lhstr = lhead0;
-    else {
-        lhstr = 0;
-        while (lhstr < 256000 && hstring[lhstr] != 0)
-            lhstr++;
-        }
-    headlast = hstring + lhstr;
-    headnext = (char *) hstring;
-    pval = NULL;
-    while (headnext < headlast) {
-        nleft = headlast - headnext;
-        loc = strncsrch (headnext, keyword, nleft);
-
-        /* Exit if keyword is not found */
-        if (loc == NULL) {
-            break;
-            }
-
-        icol = (loc - hstring) % 80;
-        lkey = strlen (keyword);
-        nextchar = (int) *(loc + lkey);
-
-        /* If this is not in the first 8 characters of a line, keep searching */
-        if (icol > 7)
-            headnext = loc + 1;
-
-        /* If parameter name in header is longer, keep searching */
-        else if (nextchar != 61 && nextchar > 32 && nextchar < 127)
-            headnext = loc + 1;
-
-        /* If preceeding characters in line are not blanks, keep searching */
-        else {
-            line = loc - icol;
-            for (lc = line; lc < loc; lc++) {
-                if (*lc != ' ')
-                    headnext = loc + 1;
-                }
-
-        /* Return pointer to start of line if match */
-            if (loc >= headnext) {
-                pval = line;
-                break;
-                }
-            }
-        }
+    pval = ksearch (hstring, keyword);
 
     /* Return NULL to calling program if keyword is not found */
     if (pval == NULL)
@@ -1355,7 +1864,7 @@ const char *keyword;    /* character string containing the name of the variable
 
     /* Find last nonblank in FITS header string line before requested keyword */
     bval = pval - 80;
-    while (!strncmp (bval,"        ",8) && bval >= hstring)
+    while (bval >= hstring && !strncmp (bval,"        ",8))
         bval = bval - 80;
     bval = bval + 80;
 
@@ -1367,6 +1876,40 @@ const char *keyword;    /* character string containing the name of the variable
 }
 
 
+/* Return 1 if the 80-character line starting at line contains keyword8,
+   which has length lkey, else 0 */
+
+static int
+kcard (line, headlast, keyword8, lkey)
+
+const char *line;       /* Start of line */
+const char *headlast;   /* End of header string */
+const char *keyword8;   /* Keyword (at most 8 characters) */
+int lkey;               /* Length of keyword8 */
+{
+    const char *loc;
+    int icol, nextchar;
+
+    /* Skip leading blanks; the name must start in the first 8 characters */
+    for (icol = 0; icol < 8 && line + icol < headlast; icol++) {
+        if (line[icol] != ' ')
+            break;
+        }
+    loc = line + icol;
+    if (icol > 7 || loc + lkey > headlast)
+        return (0);
+    if (strncasecmp (loc, keyword8, lkey) != 0)
+        return (0);
+
+    /* If parameter name in header is longer, it is not a match */
+    nextchar = (int) *(loc + lkey);
+    if (nextchar != 61 && nextchar > 32 && nextchar < 127)
+        return (0);
+
+    return (1);
+}
+
+
 /* Find FITS header line containing specified keyword */
 
 char *
@@ -1389,8 +1932,8 @@ const char *keyword;    /* character string containing the name of the variable
 {
     char keyword8[9];
     const char *headlast;
-    char *loc, *headnext, *pval, *lc, *line;
-    int icol, nextchar, lkey, nleft, lhead, lmax;
+    char *pval, *line, *hend;
+    int lkey, lhead, lmax;
 
     strncpy(keyword8, keyword, 8);
     keyword8[8] = '\0';
@@ -1404,56 +1947,52 @@ const char *keyword;    /* character string containing the name of the variable
 
     pval = 0;
 
+/* Use cached END card of a locked status buffer if possible */
+    hend = hashpipe_status_end_hint (hstring);
+    if (hend != NULL) {
+        if (!strcmp (keyword8, "END"))
+            return (hend);
+        lhead = hend + 80 - hstring;
+        }
+
 /* Find current length of header string */
-    if (lhead0)
-        lmax = lhead0;
-    else
-        lmax = 256000;
-    for (lhead = 0; lhead < lmax; lhead++) {
-        if (hstring[lhead] == (char) 0)
-            break;
+    else {
+        if (lhead0)
+            lmax = lhead0;
+        else
+            lmax = HLENGTH_MAX;
+        for (lhead = 0; lhead < lmax; lhead++) {
+            if (hstring[lhead] == (char) 0)
+                break;
+            }
         }
 
-/* Search header string for variable name */
+/* Check the index of a locked status buffer for the line last found */
     headlast = hstring + lhead;
-    headnext = (char *) hstring;
-    pval = NULL;
-    while (headnext < headlast) {
-        nleft = headlast - headnext;
-        loc = strncsrch (headnext, keyword8, nleft);
+    lkey = strlen (keyword8);
+    if (hend != NULL) {
+        line = hashpipe_status_index_get (hstring, keyword8);
+        if (line != NULL && line < hend &&
+            kcard (line, headlast, keyword8, lkey))
+            return (line);
+        }
 
-        /* Exit if keyword8 is not found */
-        if (loc == NULL) {
+/* Search header string for variable name, one 80-character line at a time */
+    pval = NULL;
+    for (line = (char *) hstring; line < headlast; line += 80) {
+        if (kcard (line, headlast, keyword8, lkey)) {
+            pval = line;
             break;
             }
+        }
 
-        icol = (loc - hstring) % 80;
-        lkey = strlen (keyword8);
-        nextchar = (int) *(loc + lkey);
-
-        /* If this is not in the first 8 characters of a line, keep searching */
-        if (icol > 7)
-            headnext = loc + 1;
-
-        /* If parameter name in header is longer, keep searching */
-        else if (nextchar != 61 && nextchar > 32 && nextchar < 127)
-            headnext = loc + 1;
-
-        /* If preceeding characters in line are not blanks, keep searching */
-        else {
-            line = loc - icol;
-            for (lc = line; lc < loc; lc++) {
-                if (*lc != ' ')
-                    headnext = loc + 1;
-                }
+/* Remember where keyword is for next time */
+    if (pval != NULL && hend != NULL)
+        hashpipe_status_index_put (hstring, keyword8, pval);
 
-        /* Return pointer to start of line if match */
-            if (loc >= headnext) {
-                pval = line;
-                break;
-                }
-            }
-        }
+/* Remember where END card is */
+    if (pval != NULL && hend == NULL && !strcmp (keyword8, "END"))
+        hashpipe_status_note_end (hstring, pval);
 
 /* Return pointer to calling program */
         return (pval);
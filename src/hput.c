@@ -39,6 +39,7 @@
  * Subroutine:  hputs  (hstring,keyword,cval) sets character string adding ''
  * Subroutine:  hputm  (hstring,keyword,cval) sets multi-line character string
  * Subroutine:  hputc  (hstring,keyword,cval) sets character string cval
+ * Subroutine:  hputv  (hstring,kv,nkv) sets values for several keywords
  * Subroutine:  hdel   (hstring,keyword) deletes entry for keyword keyword
  * Subroutine:  hadd   (hplace,keyword) adds entry for keyword at hplace
  * Subroutine:  hchange (hstring,keyword1,keyword2) changes keyword for entry
@@ -56,11 +57,17 @@
 #include <stdlib.h>
 #include <math.h>
 #include "fitshead.h"
+#include "hashpipe_status.h"
 
 //static int verbose=0;   /* Set to 1 to print error messages and other info */
 const static int verbose=0;/* Set to 1 to print error messages and other info */
 
 static void fixnegzero();
+static void hquote();
+static int hputcline();
+static int u8tostr();
+static int i8tostr();
+static void r8tostr();
 
 
 /*  HPUTU4 - Set unsigned int keyword = ival in FITS header string */
@@ -80,7 +87,7 @@ unsigned int ival;               /* int number */
     char value[30];
 
     /* Translate value from binary to ASCII */
-    sprintf (value,"%u",ival);
+    u8tostr (value, (uint8) ival);
 
     /* Put value into header string */
     return (hputc (hstring,keyword,value));
@@ -103,7 +110,7 @@ int ival;               /* int number */
     char value[30];
 
     /* Translate value from binary to ASCII */
-    sprintf (value,"%d",ival);
+    i8tostr (value, (int8) ival);
 
     /* Put value into header string */
     return (hputc (hstring,keyword,value));
@@ -118,7 +125,7 @@ const char *keyword;    /* keyword */
 uint8 ival;             /* long long (8-byte) integer */
 {
     char value[30];
-    sprintf (value, UINT8_FMT, ival);
+    u8tostr (value, ival);
     return (hputc (hstring, keyword, value));
 }
 
@@ -132,7 +139,7 @@ const char *keyword;    /* keyword */
 int8 ival;              /* long long (8-byte) integer */
 {
     char value[30];
-    sprintf (value, INT8_FMT, ival);
+    i8tostr (value, ival);
     return (hputc (hstring, keyword, value));
 }
 
@@ -170,13 +177,10 @@ const double dval;      /* double number */
 {
     char value[30];
 
-    /* Translate value from binary to ASCII */
-    /* Use 17 digits of precision so that conversion back from text will */
-    /* produce the exact same double precision value.  */
-    sprintf (value, "%.17g", dval);
-
-    /* Remove sign if string is -0 or extension thereof */
-    fixnegzero (value);
+    /* Translate value from binary to ASCII using the fewest digits that */
+    /* will produce the exact same double precision value when converted */
+    /* back from text.  */
+    r8tostr (value, dval);
 
     /* Put value into header string */
     return (hputc (hstring, keyword, value));
@@ -262,6 +266,129 @@ const double dec;               /* Declination in degrees */
 }
 
 
+/* U8TOSTR - Format unsigned integer as decimal string (faster than sprintf).
+ *           Returns length of string */
+
+static int
+u8tostr (string, uval)
+
+char *string;   /* Character string (returned), at least 21 characters */
+uint8 uval;     /* Unsigned integer */
+{
+    char digits[24];
+    int ndig, i;
+
+    ndig = 0;
+    do {
+        digits[ndig++] = '0' + (char) (uval % 10);
+        uval /= 10;
+        } while (uval != 0);
+    for (i = 0; i < ndig; i++)
+        string[i] = digits[ndig-1-i];
+    string[ndig] = (char) 0;
+    return (ndig);
+}
+
+
+/* I8TOSTR - Format integer as decimal string (faster than sprintf).
+ *           Returns length of string */
+
+static int
+i8tostr (string, ival)
+
+char *string;   /* Character string (returned), at least 21 characters */
+int8 ival;      /* Integer */
+{
+    if (ival < 0) {
+        string[0] = '-';
+        return (1 + u8tostr (string+1, (uint8) 0 - (uint8) ival));
+        }
+    return (u8tostr (string, (uint8) ival));
+}
+
+
+/* R8TOSTR - Format double as the shortest decimal string that converts back
+ *           to the exact same value.  Values with magnitudes from 1e-4 up
+ *           to 1e15 that can be represented exactly by 15 or fewer decimal
+ *           digits are formatted without sprintf.  Others fall back to
+ *           sprintf with 15, 16, or 17 significant digits, whichever is the
+ *           first to convert back exactly (17 always does).
+ *
+ * The fast path relies on (double)m / 10^p being correctly rounded when the
+ * integer m and 10^p are both exactly representable, which makes it equal to
+ * what strtod returns for the decimal string of m with p decimal places.
+ */
+
+static void
+r8tostr (string, dval)
+
+char *string;   /* Character string (returned), at least 30 characters */
+double dval;    /* Double number */
+{
+    static const double pow10r8[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19 };
+    static const uint8 pow10u8[] = {
+        1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+        10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+        100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+        100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+        100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL };
+    double aval, scaled;
+    uint8 m, ipart, fpart;
+    char *s;
+    int p, i, lfrac;
+
+    /* Zero (including negative zero) */
+    if (dval == 0.0) {
+        strcpy (string, "0");
+        return;
+        }
+
+    aval = fabs (dval);
+    if (aval >= 1e-4 && aval < 1e15) {
+        for (p = 0; p < 20; p++) {
+            scaled = aval * pow10r8[p];
+            /* m must be exactly representable as a double */
+            if (scaled >= 1e15)
+                break;
+            m = (uint8) (scaled + 0.5);
+            if ((double) m / pow10r8[p] == aval) {
+                s = string;
+                if (dval < 0)
+                    *s++ = '-';
+                ipart = m / pow10u8[p];
+                fpart = m % pow10u8[p];
+                s += u8tostr (s, ipart);
+                if (p > 0) {
+                    *s++ = '.';
+                    lfrac = u8tostr (s, fpart);
+                    /* Shift right and zero pad to p digits */
+                    for (i = lfrac; i >= 0; i--)
+                        s[i + p - lfrac] = s[i];
+                    for (i = 0; i < p - lfrac; i++)
+                        s[i] = '0';
+                    }
+                return;
+                }
+            }
+        }
+
+    /* Use the fewest significant digits (17 at most) that make conversion */
+    /* back from text produce the exact same double precision value.  */
+    for (p = 15; p < 17; p++) {
+        sprintf (string, "%.*g", p, dval);
+        if (strtod (string, NULL) == dval)
+            break;
+        }
+    if (p == 17)
+        sprintf (string, "%.17g", dval);
+
+    /* Remove sign if string is -0 or extension thereof */
+    fixnegzero (string);
+}
+
+
 /* FIXNEGZERO -- Drop - sign from beginning of any string which is all zeros */
 
 static void
@@ -406,9 +533,8 @@ const char *keyword; /* Keyword name */
 const char *cval; /* character string containing the value for variable
                    keyword.  trailing and leading blanks are removed.  */
 {
-    char squot = 39;
     char value[80];
-    int lcval, i, lkeyword;
+    int lkeyword;
 
     /*  If COMMENT or HISTORY, just add it as is */
     lkeyword = (int) strlen (keyword);
@@ -416,6 +542,25 @@ const char *cval; /* character string containing the value for variable
         strncmp (keyword,"HISTORY",7) == 0))
         return (hputc (hstring,keyword,cval));
 
+    /* Quote string */
+    hquote (cval, value);
+
+    /* Put value into header string */
+    return (hputc (hstring,keyword,value));
+}
+
+
+/*  HQUOTE - Quote character string cval into value for hputs */
+
+static void
+hquote (cval, value)
+
+const char *cval; /* character string to quote */
+char *value;      /* quoted string (returned), at least 70 characters long */
+{
+    char squot = 39;
+    int lcval, i;
+
     /*  find length of variable string */
     lcval = (int) strlen (cval);
     if (lcval > 67)
@@ -436,9 +581,6 @@ const char *cval; /* character string containing the value for variable
     /* Add single quote and null to end of string */
     value[lcval+1] = squot;
     value[lcval+2] = (char) 0;
-
-    /* Put value into header string */
-    return (hputc (hstring,keyword,value));
 }
 
 
@@ -454,22 +596,20 @@ const char *value; /* character string containing the value for variable
                    keyword.  trailing and leading blanks are removed.  */
 {
     char keyword8[9];
-    char squot = 39;
-    char line[100];
-    char newcom[50];
-    char *vp, *v1, *v2, *q1, *q2, *c1, *ve;
-    int lkeyword, lcom, lval, lc, lv1, lhead, lblank, ln, nc, i;
+    char *vp, *v1, *v2;
+    int lkeyword, lval, lc, lv1, lhead, ln, nc;
+    size_t lmax;
 
     /* Find length of keyword, value, and header */
     strncpy(keyword8, keyword, 8);
     keyword8[8] = '\0';
     lkeyword = (int) strlen (keyword8);
     lval = (int) strlen (value);
-    lhead = gethlength (hstring);
 
     /*  If COMMENT or HISTORY, always add it just before the END */
     if (lkeyword == 7 && (strncmp (keyword8,"COMMENT",7) == 0 ||
         strncmp (keyword8,"HISTORY",7) == 0)) {
+        lhead = gethlength (hstring);
         
         /* First look for blank lines before END */
         v1 = blsearch (hstring, "END");
@@ -492,8 +632,15 @@ const char *value; /* character string containing the value for variable
                 return (-1);
                 }
 
+            /* If there is no room for END in a status buffer, return error */
+            lmax = hashpipe_status_capacity (hstring);
+            if (lmax > 0 && (size_t) (v2 + 80 - hstring) > lmax) {
+                return (-1);
+                }
+
             /* Move END down 80 characters */
             strncpy (v2, v1, 80);
+            hashpipe_status_note_end (hstring, v2);
             }
         else
             v2 = v1 + 80;
@@ -512,6 +659,7 @@ const char *value; /* character string containing the value for variable
 
         /* Insert comment */
         strncpy (v1+9,value,lv1);
+        hashpipe_status_note_change (hstring, keyword8);
         return (0);
         }
 
@@ -519,8 +667,36 @@ const char *value; /* character string containing the value for variable
     else
         v1 = ksearch (hstring,keyword8);
 
+    return (hputcline (hstring, v1, keyword8, value));
+}
+
+
+/*  HPUTCLINE - Set keyword8 = value on FITS header line v1 (as found by
+ *              ksearch) or, if v1 is NULL, on a new line added to the header.
+ *              Return -1 if error, 0 if OK */
+
+static int
+hputcline (hstring, v1, keyword8, value)
+
+char *hstring;
+char *v1;               /* Line containing keyword8 or NULL */
+const char *keyword8;   /* Keyword (at most 8 characters) */
+const char *value;      /* character string containing the value */
+{
+    char squot = 39;
+    char line[100];
+    char newcom[50];
+    char *vp, *v2, *q1, *q2, *c1, *ve;
+    int lkeyword, lcom, lval, lc, lhead, lblank, ln, nc, i;
+    size_t lmax;
+
+    lkeyword = (int) strlen (keyword8);
+    lval = (int) strlen (value);
+
     /*  If parameter is not found, find a place to put it */
     if (v1 == NULL) {
+        /* Header length is only needed (and found) when adding a line */
+        lhead = gethlength (hstring);
         
         /* First look for blank lines before END */
         v1 = blsearch (hstring, "END");
@@ -542,12 +718,20 @@ const char *value; /* character string containing the value for variable
                 return (-1);
                 }
 
+            /* If there is no room for END in a status buffer, return error */
+            lmax = hashpipe_status_capacity (hstring);
+            if (lmax > 0 && (size_t) (v2 + 80 - hstring) > lmax) {
+                return (-1);
+                }
+
             strncpy (v2, ve, 80);
+            hashpipe_status_note_end (hstring, v2);
             }
         else
             v2 = v1 + 80;
         lcom = 0;
         newcom[0] = 0;
+        line[0] = 0;
         }
 
     /*  Otherwise, extract the entry for this keyword8 from the header */
@@ -649,10 +833,100 @@ const char *value; /* character string containing the value for variable
                 fprintf (stderr,"HPUT: %s  = %s\n",keyword8, value);
             }
 
+        /* Index new entry so that it can be found without searching */
+        if (line[0] == 0)
+            hashpipe_status_index_put (hstring, keyword8, v1);
+
+        /* Note change unless existing entry was rewritten as is */
+        if (line[0] == 0 || strncmp (v1, line, 80) != 0)
+            hashpipe_status_note_change (hstring, keyword8);
+
         return (0);
 }
 
 
+/*  HPUTV - Set values for several keywords in FITS header string, finding
+ *          the existing entries for all of them in a single pass over the
+ *          header.  Keywords that are not found are added as by hputc.
+ *          Return -1 if error, 0 if OK */
+
+int
+hputv (hstring, kv, nkv)
+
+char *hstring;  /* FITS header */
+hkv_t *kv;      /* Array of keyword/value descriptors.  The value of each
+                   one is formatted according to its type as by hputi4,
+                   hputu4, hputi8, hputu8, hputr4, hputr8, hputl, or hputs.
+                   The card field of each one is set by hkvsearch. */
+const int nkv;  /* Number of elements in kv */
+{
+    char keyword8[9];
+    char value[80];
+    int i, lkeyword;
+    int rv = 0;
+
+    hkvsearch (hstring, kv, nkv);
+
+    for (i = 0; i < nkv; i++) {
+
+        /* Translate value from binary to ASCII */
+        switch (kv[i].type) {
+            case HKV_I4:
+                i8tostr (value, (int8) *(int *)kv[i].val);
+                break;
+            case HKV_U4:
+                u8tostr (value, (uint8) *(unsigned int *)kv[i].val);
+                break;
+            case HKV_I8:
+                i8tostr (value, *(int8 *)kv[i].val);
+                break;
+            case HKV_U8:
+                u8tostr (value, *(uint8 *)kv[i].val);
+                break;
+            case HKV_R4:
+                sprintf (value, "%.9f", *(float *)kv[i].val);
+                fixnegzero (value);
+                break;
+            case HKV_R8:
+                r8tostr (value, *(double *)kv[i].val);
+                break;
+            case HKV_L:
+                strcpy (value, *(int *)kv[i].val ? "T" : "F");
+                break;
+            case HKV_S:
+                hquote ((const char *)kv[i].val, value);
+                break;
+            default:
+                rv = -1;
+                continue;
+            }
+
+        /* New keywords and COMMENT or HISTORY are put the usual way */
+        lkeyword = (int) strlen (kv[i].keyword);
+        if (kv[i].card == NULL || (lkeyword == 7 &&
+            (strncmp (kv[i].keyword,"COMMENT",7) == 0 ||
+             strncmp (kv[i].keyword,"HISTORY",7) == 0))) {
+            if (kv[i].type == HKV_S) {
+                if (hputs (hstring, kv[i].keyword, (const char *)kv[i].val))
+                    rv = -1;
+                }
+            else if (hputc (hstring, kv[i].keyword, value))
+                rv = -1;
+            }
+
+        /* Otherwise update the line that hkvsearch found */
+        else {
+            strncpy (keyword8, kv[i].keyword, 8);
+            keyword8[8] = '\0';
+            if (hputcline (hstring, kv[i].card, keyword8, value))
+                rv = -1;
+            }
+        }
+
+    return (rv);
+}
+
+
 /*  HPUTCOM - Set comment for keyword or on line in FITS header string */
 
 int
@@ -785,6 +1059,7 @@ hputcom (hstring,keyword,comment)
     if (verbose) {
         fprintf (stderr,"HPUTCOM: %s / %s\n",keyword,comment);
         }
+    hashpipe_status_note_change (hstring, keyword);
     return (0);
 }
 
@@ -849,11 +1124,21 @@ const char *keyword;    /* Keyword of entry to be deleted */
             strncpy (v, v2, 80);
             }
 
+        /* If END moved up, clear its old line so it is not found again */
+        if (headshrink) {
+            for (v = ve; v < ve + 80; v++)
+                *v = '\0';
+            hashpipe_status_note_end (hstring, ve - 80);
+            }
+
         /* Nul terminate after END line */
-        v2 = ve + 80;
-        *v2 = '\0';
+        else {
+            v2 = ve + 80;
+            *v2 = '\0';
+            }
         }
 
+    hashpipe_status_note_change (hstring, keyword);
     return (1);
 }
 
@@ -937,6 +1222,8 @@ const char *keyword2;   /* New keyword name */
             else
                 v[i] = ' ';
             }
+        hashpipe_status_note_change (hstring, keyword1);
+        hashpipe_status_note_change (hstring, keyword2);
         }
 
     return (1);
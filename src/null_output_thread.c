@@ -7,6 +7,7 @@
 
 #define _GNU_SOURCE 1
 #include <stdio.h>
+#include <errno.h>
 #include <time.h>
 #include <pthread.h>
 
@@ -20,16 +21,9 @@ static void *run(hashpipe_thread_args_t * args)
 
     // Attach to databuf as a low-level hashpipe databuf.  Since
     // null_output_thread can attach to any kind of databuf, we cannot create
-    // the upstream databuf if it does not yet exist.  We have to simply wait
-    // for it to be created by the upstream thread.  Give up after 1 second.
-    int i;
-    struct timespec ts = {0, 1000}; // One microsecond
-    int max_tries = 1000000; // One million microseconds
-    for(i = 0; i < max_tries; i++) {
-        db = hashpipe_databuf_attach(args->instance_id, args->input_buffer);
-        if(db) break;
-        nanosleep(&ts, NULL);
-    }
+    // the upstream databuf ourselves, but the upstream thread's init function
+    // has created it before any thread was started.
+    db = hashpipe_databuf_attach(args->instance_id, args->input_buffer);
 
     if(!db) {
         char msg[256];
@@ -38,11 +32,24 @@ static void *run(hashpipe_thread_args_t * args)
         hashpipe_error(__FUNCTION__, msg);
         return THREAD_ERROR;
     }
+    // hashpipe only checks the databufs of threads that create them, so check
+    // here that the workers of a pool can share the blocks of this one
+    if(args->num_workers > 1 && db->n_block % args->num_workers) {
+        errno = 0; // Not a system error
+        hashpipe_error(__FUNCTION__,
+                "databuf %d has %d blocks, which %d workers cannot share"
+                " (must be a multiple of %d)", args->input_buffer,
+                db->n_block, args->num_workers, args->num_workers);
+        hashpipe_databuf_detach(db);
+        return THREAD_ERROR;
+    }
     pthread_cleanup_push((void (*)(void *))hashpipe_databuf_detach, db);
 
     /* Main loop */
     int rv;
-    int block_idx = 0;
+    // Workers of a pool (see hashpipe -w option) take turns with the blocks
+    uint64_t seq = hashpipe_worker_first_seq(args);
+    int block_idx = seq % db->n_block;
     while (run_threads()) {
 
         hashpipe_status_lock_safe(&st);
@@ -55,6 +62,10 @@ static void *run(hashpipe_thread_args_t * args)
                 hashpipe_status_lock_safe(&st);
                 hputs(st.buf, status_key, "blocked");
                 hashpipe_status_unlock_safe(&st);
+                // Pipeline is being drained (or shut down)
+                if(!run_threads()) {
+                    break;
+                }
                 continue;
             } else {
                 hashpipe_error(__FUNCTION__, "error waiting for filled databuf");
@@ -63,6 +74,10 @@ static void *run(hashpipe_thread_args_t * args)
             }
         }
 
+        if(rv != HASHPIPE_OK) {
+            break;
+        }
+
         // Note processing status, current input block
         hashpipe_status_lock_safe(&st);
         hputs(st.buf, status_key, "processing");
@@ -73,7 +88,8 @@ static void *run(hashpipe_thread_args_t * args)
         hashpipe_databuf_set_free(db, block_idx);
 
         // Setup for next block
-        block_idx = (block_idx + 1) % db->n_block;
+        seq = hashpipe_worker_next_seq(args, seq);
+        block_idx = seq % db->n_block;
 
         /* Will exit if thread has been cancelled */
         pthread_testcancel();
@@ -93,7 +109,8 @@ static hashpipe_thread_desc_t null_thread = {
     init: NULL,
     run:  run,
     ibuf_desc: {NULL},
-    obuf_desc: {NULL}
+    obuf_desc: {NULL},
+    flags: HASHPIPE_THREAD_WORKERS
 };
 
 static __attribute__((constructor)) void ctor()
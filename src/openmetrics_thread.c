@@ -0,0 +1,337 @@
+/*
+ * openmetrics_thread.c
+ *
+ * Utility thread that serves status buffer values and databuf telemetry over
+ * HTTP in the OpenMetrics (Prometheus) text format.  Each scrape of
+ * "/metrics" is rendered from a snapshot of the status buffer, so scrapes
+ * hold the status buffer lock only while copying it (and not at all if the
+ * status buffer has not changed since the previous scrape).
+ *
+ * Exported metrics:
+ *
+ *   hashpipe_status{key="KEY"}          Value of each numeric (or logical)
+ *                                       status buffer key
+ *   hashpipe_status_generation          Status buffer change counter
+ *   hashpipe_databuf_blocks{databuf="N"}        Number of blocks
+ *   hashpipe_databuf_filled_blocks{databuf="N"} Number of filled blocks
+ *   hashpipe_databuf_block_size_bytes{databuf="N"} Size of each block
+ *
+ * All metrics also have an instance_id label.  The thread is configured by
+ * these status buffer keys (e.g. set with the hashpipe "-o KEY=VALUE"
+ * option):
+ *
+ *   METRADDR  Address to listen on ["127.0.0.1"]
+ *   METRPORT  TCP port to listen on [9600 + instance_id]
+ *
+ * Since it has neither an input nor an output databuf, list this thread after
+ * all of the pipeline's data processing threads on the hashpipe command line.
+ * It reports on all databufs before it in the pipeline.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "hashpipe.h"
+
+#define METRICS_DEFAULT_ADDR "127.0.0.1"
+#define METRICS_DEFAULT_PORT 9600
+// Maximum number of databufs to report on
+#define METRICS_MAX_DATABUFS 64
+
+typedef struct {
+    int instance_id;
+    FILE *out;
+} metrics_ctx_t;
+
+// Writes a label value with OpenMetrics escaping
+static void print_label_value(FILE *out, const char *s)
+{
+    for(; *s; s++) {
+        if(*s == '\\' || *s == '"') {
+            fprintf(out, "\\%c", *s);
+        } else if(*s == '\n') {
+            fprintf(out, "\\n");
+        } else {
+            fputc(*s, out);
+        }
+    }
+}
+
+// Returns non-zero if value is a plain decimal number that can be passed
+// through as is
+static int is_number(const char *value)
+{
+    char *end;
+    const char *p;
+    if(!*value) {
+        return 0;
+    }
+    for(p = value; *p; p++) {
+        if(!strchr("0123456789+-.eE", *p)) {
+            return 0;
+        }
+    }
+    strtod(value, &end);
+    return *end == '\0';
+}
+
+// hashpipe_status_snapshot_changes() callback
+static void print_status_key(const char *key, const char *card, void *data)
+{
+    metrics_ctx_t *ctx = (metrics_ctx_t *)data;
+    char value[81];
+
+    if(hashpipe_status_card_value(card, value)) {
+        // Skip strings
+        return;
+    }
+    if(!strcmp(value, "T") || !strcmp(value, "F")) {
+        value[0] = value[0] == 'T' ? '1' : '0';
+    } else if(!is_number(value)) {
+        return;
+    }
+    fprintf(ctx->out, "hashpipe_status{instance_id=\"%d\",key=\"",
+            ctx->instance_id);
+    print_label_value(ctx->out, key);
+    fprintf(ctx->out, "\"} %s\n", value);
+}
+
+// Renders all metrics to out
+static void render_metrics(FILE *out, hashpipe_status_t *st,
+        hashpipe_status_snapshot_t *snap, hashpipe_databuf_t **db, int ndb,
+        int openmetrics)
+{
+    metrics_ctx_t ctx = {st->instance_id, out};
+    int i;
+
+    if(hashpipe_status_snapshot(st, snap) == HASHPIPE_OK) {
+        fprintf(out, "# TYPE hashpipe_status gauge\n");
+        fprintf(out, "# HELP hashpipe_status Numeric status buffer values\n");
+        // Every key of snap is "changed" relative to no previous snapshot
+        hashpipe_status_snapshot_changes(snap, NULL, print_status_key, &ctx);
+    }
+
+    if(st->ctrl) {
+        fprintf(out, "# TYPE hashpipe_status_generation counter\n");
+        fprintf(out, "hashpipe_status_generation%s{instance_id=\"%d\"} %u\n",
+                openmetrics ? "_total" : "", st->instance_id,
+                hashpipe_status_generation(st));
+    }
+
+    fprintf(out, "# TYPE hashpipe_databuf_blocks gauge\n");
+    for(i=1; i<ndb; i++) {
+        if(db[i]) {
+            fprintf(out, "hashpipe_databuf_blocks"
+                    "{instance_id=\"%d\",databuf=\"%d\"} %d\n",
+                    st->instance_id, i, db[i]->n_block);
+        }
+    }
+    fprintf(out, "# TYPE hashpipe_databuf_filled_blocks gauge\n");
+    for(i=1; i<ndb; i++) {
+        if(db[i]) {
+            fprintf(out, "hashpipe_databuf_filled_blocks"
+                    "{instance_id=\"%d\",databuf=\"%d\"} %d\n",
+                    st->instance_id, i, hashpipe_databuf_total_status(db[i]));
+        }
+    }
+    fprintf(out, "# TYPE hashpipe_databuf_block_size_bytes gauge\n");
+    for(i=1; i<ndb; i++) {
+        if(db[i]) {
+            fprintf(out, "hashpipe_databuf_block_size_bytes"
+                    "{instance_id=\"%d\",databuf=\"%d\"} %zu\n",
+                    st->instance_id, i, db[i]->block_size);
+        }
+    }
+
+    if(openmetrics) {
+        fprintf(out, "# EOF\n");
+    }
+}
+
+// Reads an HTTP request from fd and sends the response
+static void handle_request(int fd, hashpipe_status_t *st,
+        hashpipe_status_snapshot_t *snap, hashpipe_databuf_t **db, int ndb)
+{
+    char req[4096];
+    char path[256] = "";
+    char hdr[256];
+    size_t len = 0;
+    ssize_t n;
+    char *body = NULL;
+    size_t body_len = 0;
+    int openmetrics;
+    FILE *out;
+
+    // Read request headers (all we care about)
+    while(len < sizeof(req)-1) {
+        n = recv(fd, req+len, sizeof(req)-1-len, 0);
+        if(n <= 0) {
+            return;
+        }
+        len += n;
+        req[len] = '\0';
+        if(strstr(req, "\r\n\r\n") || strstr(req, "\n\n")) {
+            break;
+        }
+    }
+    req[len] = '\0';
+
+    if(sscanf(req, "GET %255s", path) != 1
+    || (strcmp(path, "/metrics") && strcmp(path, "/"))) {
+        n = snprintf(hdr, sizeof(hdr),
+                "HTTP/1.1 404 Not Found\r\n"
+                "Content-Type: text/plain\r\n"
+                "Content-Length: 10\r\n"
+                "Connection: close\r\n\r\nnot found\n");
+        send(fd, hdr, n, MSG_NOSIGNAL);
+        return;
+    }
+
+    openmetrics = strcasestr(req, "application/openmetrics-text") != NULL;
+    if(!(out = open_memstream(&body, &body_len))) {
+        return;
+    }
+    render_metrics(out, st, snap, db, ndb, openmetrics);
+    fclose(out);
+
+    n = snprintf(hdr, sizeof(hdr),
+            "HTTP/1.1 200 OK\r\n"
+            "Content-Type: %s\r\n"
+            "Content-Length: %zu\r\n"
+            "Connection: close\r\n\r\n",
+            openmetrics
+            ? "application/openmetrics-text; version=1.0.0; charset=utf-8"
+            : "text/plain; version=0.0.4; charset=utf-8",
+            body_len);
+    if(send(fd, hdr, n, MSG_NOSIGNAL) == n) {
+        send(fd, body, body_len, MSG_NOSIGNAL);
+    }
+    free(body);
+}
+
+static void close_fd(void *fd)
+{
+    close(*(int *)fd);
+}
+
+static void detach_databufs(void *p)
+{
+    hashpipe_databuf_t **db = (hashpipe_databuf_t **)p;
+    int i;
+    for(i=0; i<METRICS_MAX_DATABUFS; i++) {
+        if(db[i]) {
+            hashpipe_databuf_detach(db[i]);
+            db[i] = NULL;
+        }
+    }
+}
+
+static void *run(hashpipe_thread_args_t * args)
+{
+    hashpipe_status_t st = args->st;
+    const char * status_key = args->thread_desc->skey;
+    const char * name = args->thread_desc->name;
+    char addr[80] = METRICS_DEFAULT_ADDR;
+    int port = METRICS_DEFAULT_PORT + args->instance_id;
+    hashpipe_databuf_t *db[METRICS_MAX_DATABUFS] = {NULL};
+    hashpipe_status_snapshot_t snap = {0};
+    struct sockaddr_in sa;
+    struct timeval tv = {1, 0};
+    struct pollfd pfd;
+    int ndb, lfd, fd, i;
+    int one = 1;
+
+    hashpipe_status_lock_safe(&st);
+    hgets(st.buf, "METRADDR", sizeof(addr), addr);
+    hgeti4(st.buf, "METRPORT", &port);
+    hashpipe_status_unlock_safe(&st);
+
+    // Report on the databufs of the threads before us
+    ndb = args->input_buffer + 1;
+    if(ndb > METRICS_MAX_DATABUFS) {
+        ndb = METRICS_MAX_DATABUFS;
+    }
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    if(inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+        hashpipe_error(name, "invalid METRADDR '%s'", addr);
+        return THREAD_ERROR;
+    }
+    if((lfd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+        hashpipe_error(name, "socket");
+        return THREAD_ERROR;
+    }
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if(bind(lfd, (struct sockaddr *)&sa, sizeof(sa)) || listen(lfd, 16)) {
+        hashpipe_error(name, "cannot listen on %s:%d", addr, port);
+        close(lfd);
+        return THREAD_ERROR;
+    }
+    pthread_cleanup_push(close_fd, &lfd);
+    pthread_cleanup_push(detach_databufs, db);
+
+    hashpipe_info(name, "serving metrics on http://%s:%d/metrics", addr, port);
+    hashpipe_status_lock_safe(&st);
+    hputs(st.buf, status_key, "listening");
+    hashpipe_status_unlock_safe(&st);
+
+    pfd.fd = lfd;
+    pfd.events = POLLIN;
+    while (run_threads()) {
+        // Wake up once per second to check run_threads()
+        if(poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        if((fd = accept(lfd, NULL, NULL)) == -1) {
+            continue;
+        }
+        // Do not let a slow client stall us for long
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+        // Attach to any databufs that have been created since last time
+        for(i=1; i<ndb; i++) {
+            if(!db[i]) {
+                db[i] = hashpipe_databuf_attach(args->instance_id, i);
+            }
+        }
+
+        handle_request(fd, &st, &snap, db, ndb);
+        close(fd);
+
+        /* Will exit if thread has been cancelled */
+        pthread_testcancel();
+    }
+
+    pthread_cleanup_pop(1); // detach_databufs
+    pthread_cleanup_pop(1); // close_fd
+    hashpipe_status_snapshot_free(&snap);
+
+    // Thread success!
+    return THREAD_OK;
+}
+
+static hashpipe_thread_desc_t openmetrics_thread = {
+    name: "openmetrics_thread",
+    skey: "METRSTAT",
+    init: NULL,
+    run:  run,
+    ibuf_desc: {NULL},
+    obuf_desc: {NULL}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+    register_hashpipe_thread(&openmetrics_thread);
+}
@@ -0,0 +1,123 @@
+#!/bin/bash
+#
+# Exercises redis_gateway_thread against a private redis-server on localhost:
+# starts redis-server and a hashpipe instance running only the gateway thread,
+# then checks that status buffer keys show up in (and disappear from) the
+# instance's status hash (HSET/HDEL) and that messages published to the "set"
+# channels (SUBSCRIBE) update the status buffer.  Needs redis-server and
+# redis-cli in PATH.  Exits with status 0 if all checks pass.
+
+port=16379
+instance=9
+bindir=$(dirname "$0")
+
+while getopts ":hp:I:" opt; do
+  case $opt in
+    p) port=$OPTARG;;
+    I) instance=$OPTARG;;
+    h) echo "Usage: `basename $0` [-p PORT] [-I INSTANCE]"
+       echo "  -p PORT      Port for redis-server [$port]"
+       echo "  -I INSTANCE  hashpipe instance to use [$instance]"
+       exit
+       ;;
+    \?)
+      echo "Invalid option: -$OPTARG" >&2
+      exit 1
+      ;;
+  esac
+done
+
+# Prefer programs next to this script (e.g. in the build directory)
+if [ -x "$bindir/hashpipe" ]; then
+  PATH="$bindir:$PATH"
+fi
+
+for prog in redis-server redis-cli hashpipe hashpipe_check_status hashpipe_clean_shmem; do
+  if ! type -p $prog > /dev/null; then
+    echo "$prog not found" >&2
+    exit 1
+  fi
+done
+
+gwname=gwtest
+status_key="hashpipe://$gwname/$instance/status"
+failures=0
+redis_pid=
+hashpipe_pid=
+
+cleanup() {
+  [ -n "$hashpipe_pid" ] && kill -INT $hashpipe_pid 2> /dev/null && wait $hashpipe_pid
+  [ -n "$redis_pid" ] && kill $redis_pid 2> /dev/null && wait $redis_pid
+  hashpipe_clean_shmem -I $instance -d > /dev/null 2>&1
+}
+trap cleanup EXIT
+
+rcli() {
+  redis-cli -p $port "$@"
+}
+
+# Waits up to 5 seconds for command "$@" to output the expected value given
+# as the first argument
+expect() {
+  local want=$1 got i
+  shift
+  for i in {1..50}; do
+    got=$("$@" 2> /dev/null)
+    [ "$got" == "$want" ] && return 0
+    sleep 0.1
+  done
+  echo "FAIL: '$*' gave '$got', expected '$want'" >&2
+  failures=$((failures+1))
+  return 1
+}
+
+check() {
+  local name=$1
+  shift
+  expect "$@" && echo "ok: $name"
+}
+
+redis-server --port $port --bind 127.0.0.1 --save '' --appendonly no > /dev/null &
+redis_pid=$!
+expect PONG rcli PING || exit 1
+
+hashpipe_clean_shmem -I $instance -d > /dev/null 2>&1
+hashpipe -I $instance \
+  -o REDISHST=127.0.0.1 -o REDISPRT=$port -o REDISGWN=$gwname \
+  -o REDISDLY=0.2 -o GWTEST=hello \
+  redis_gateway_thread > /dev/null 2>&1 &
+hashpipe_pid=$!
+
+# Status buffer -> Redis
+check "initial status buffer published" hello rcli HGET "$status_key" GWTEST
+hashpipe_check_status -I $instance -k GWTEST -s changed
+check "changed key published" changed rcli HGET "$status_key" GWTEST
+hashpipe_check_status -I $instance -k GWTEST -D
+check "deleted key removed" "" rcli HGET "$status_key" GWTEST
+
+# Redis -> status buffer
+check "subscribed to instance channel" 1 \
+  eval "rcli PUBSUB NUMSUB 'hashpipe://$gwname/$instance/set' | tail -1"
+rcli PUBLISH "hashpipe://$gwname/$instance/set" "GWSET1=one" > /dev/null
+check "instance channel" one hashpipe_check_status -I $instance -Q GWSET1
+rcli PUBLISH "hashpipe://$gwname//set" "GWSET2 = two" > /dev/null
+check "host channel" two hashpipe_check_status -I $instance -Q GWSET2
+rcli PUBLISH "hashpipe:///set" $'GWSET3=three\nGWSET4=four' > /dev/null
+check "broadcast channel" three hashpipe_check_status -I $instance -Q GWSET3
+check "multi-line message" four hashpipe_check_status -I $instance -Q GWSET4
+check "set key published back" one rcli HGET "$status_key" GWSET1
+
+# Reconnect after the server restarts
+kill $redis_pid
+wait $redis_pid
+redis-server --port $port --bind 127.0.0.1 --save '' --appendonly no > /dev/null &
+redis_pid=$!
+expect PONG rcli PING || exit 1
+check "status buffer republished after reconnect" one \
+  rcli HGET "$status_key" GWSET1
+
+if [ $failures -gt 0 ]; then
+  echo "$failures check(s) failed" >&2
+  exit 1
+fi
+echo "All checks passed"
@@ -0,0 +1,613 @@
+/*
+ * redis_gateway_thread.c
+ *
+ * Utility thread that publishes the status buffer to a Redis server and
+ * applies status buffer updates received from Redis.  This is a built-in
+ * replacement for running a separate hashpipe_redis_gateway process for each
+ * host.  It uses the same Redis keys and channels:
+ *
+ *   hashpipe://HOST/INSTANCE/status  Hash containing all status buffer keys
+ *   hashpipe://HOST/INSTANCE/set     Channel for updates to this instance
+ *   hashpipe://HOST//set             Channel for updates to all instances
+ *                                    on HOST
+ *   hashpipe:///set                  Channel for updates to all instances
+ *                                    on all hosts
+ *
+ * Messages published to the "set" channels are one or more KEY=VALUE lines.
+ * The values are stored in the status buffer as strings.
+ *
+ * Only keys that have been added, changed, or deleted since the previous
+ * update are sent to Redis, all in one pipelined batch per update.  The
+ * entire status buffer is sent after (re)connecting.
+ *
+ * The thread is configured by these status buffer keys (e.g. set with the
+ * hashpipe "-o KEY=VALUE" option):
+ *
+ *   REDISHST  Redis server host name ["redishost"]
+ *   REDISPRT  Redis server port [6379]
+ *   REDISDLY  Seconds between updates [1.0]
+ *   REDISGWN  HOST part of the Redis key/channel names [short host name]
+ *
+ * Since it has neither an input nor an output databuf, list this thread after
+ * all of the pipeline's data processing threads on the hashpipe command line.
+ *
+ * redis_gateway_test.sh exercises this thread against a local redis-server.
+ */
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "hashpipe.h"
+#include "hashpipe_futex.h"
+
+#define REDIS_DEFAULT_HOST "redishost"
+#define REDIS_DEFAULT_PORT 6379
+#define REDIS_DEFAULT_DELAY 1.0
+// Longest set message that will be processed
+#define REDIS_MAX_MESSAGE (64*1024)
+
+// Buffered Redis connection
+typedef struct {
+    int fd;
+    size_t rpos;
+    size_t rlen;
+    char rbuf[16*1024];
+} redis_conn_t;
+
+// Growable output buffer for building pipelined commands
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t size;
+    int ncmds;
+} redis_cmdbuf_t;
+
+static int redis_connect(redis_conn_t *c, const char *host, int port)
+{
+    struct addrinfo hints, *res, *ai;
+    char service[16];
+    struct timeval tv = {5, 0};
+    int one = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%d", port);
+    if(getaddrinfo(host, service, &hints, &res)) {
+        return -1;
+    }
+
+    c->fd = -1;
+    c->rpos = c->rlen = 0;
+    for(ai = res; ai; ai = ai->ai_next) {
+        c->fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if(c->fd == -1) {
+            continue;
+        }
+        if(connect(c->fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(c->fd);
+        c->fd = -1;
+    }
+    freeaddrinfo(res);
+
+    if(c->fd == -1) {
+        return -1;
+    }
+
+    // Never block forever on a misbehaving server
+    setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(c->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return 0;
+}
+
+static void redis_close(redis_conn_t *c)
+{
+    if(c->fd != -1) {
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static int redis_write(redis_conn_t *c, const char *buf, size_t len)
+{
+    ssize_t n;
+    while(len > 0) {
+        n = send(c->fd, buf, len, MSG_NOSIGNAL);
+        if(n <= 0) {
+            if(n < 0 && errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Returns next byte from c or -1 on error/EOF
+static int redis_getc(redis_conn_t *c)
+{
+    ssize_t n;
+    if(c->rpos == c->rlen) {
+        do {
+            n = recv(c->fd, c->rbuf, sizeof(c->rbuf), 0);
+        } while(n < 0 && errno == EINTR);
+        if(n <= 0) {
+            return -1;
+        }
+        c->rpos = 0;
+        c->rlen = n;
+    }
+    return (unsigned char)c->rbuf[c->rpos++];
+}
+
+// Reads a CRLF terminated line (without the CRLF) into line.  Lines longer
+// than size-1 are truncated.  Returns 0 on success, -1 on error.
+static int redis_getline(redis_conn_t *c, char *line, size_t size)
+{
+    size_t i = 0;
+    int ch;
+    while((ch = redis_getc(c)) != -1) {
+        if(ch == '\n') {
+            if(i > 0 && line[i-1] == '\r') {
+                i--;
+            }
+            line[i] = '\0';
+            return 0;
+        }
+        if(i < size-1) {
+            line[i++] = ch;
+        }
+    }
+    return -1;
+}
+
+// Reads one reply.  If the reply is a bulk string (or integer or simple
+// string) and buf is not NULL, up to size-1 bytes of it are stored
+// NUL-terminated in buf (longer values are truncated).  Array elements are
+// read and discarded (their count is stored in *nelem if not NULL).  Returns
+// the reply type character ('+', '-', ':', '$', or '*') or -1 on error.
+static int redis_read_reply(redis_conn_t *c, char *buf, size_t size,
+        long *nelem)
+{
+    char line[128];
+    long i, n;
+    int ch, type;
+
+    if(redis_getline(c, line, sizeof(line))) {
+        return -1;
+    }
+    type = line[0];
+    switch(type) {
+        case '+':
+        case '-':
+        case ':':
+            if(buf) {
+                snprintf(buf, size, "%s", line+1);
+            }
+            return type;
+        case '$':
+            n = strtol(line+1, NULL, 10);
+            if(n < 0) {
+                // Null bulk string
+                if(buf) {
+                    buf[0] = '\0';
+                }
+                return type;
+            }
+            for(i=0; i<n+2; i++) {
+                if((ch = redis_getc(c)) == -1) {
+                    return -1;
+                }
+                if(buf && i < n && i < size-1) {
+                    buf[i] = ch;
+                }
+            }
+            if(buf) {
+                buf[n < size-1 ? n : size-1] = '\0';
+            }
+            return type;
+        case '*':
+            n = strtol(line+1, NULL, 10);
+            if(nelem) {
+                *nelem = n;
+            } else {
+                for(i=0; i<n; i++) {
+                    if(redis_read_reply(c, NULL, 0, NULL) == -1) {
+                        return -1;
+                    }
+                }
+            }
+            return type;
+    }
+    return -1;
+}
+
+static int cmdbuf_append(redis_cmdbuf_t *cb, const char *s, size_t len)
+{
+    if(cb->len + len > cb->size) {
+        size_t size = cb->size ? cb->size : 4096;
+        char *buf;
+        while(cb->len + len > size) {
+            size *= 2;
+        }
+        if(!(buf = realloc(cb->buf, size))) {
+            return -1;
+        }
+        cb->buf = buf;
+        cb->size = size;
+    }
+    memcpy(cb->buf + cb->len, s, len);
+    cb->len += len;
+    return 0;
+}
+
+// Appends a RESP array header for a command with nargs arguments
+static int cmdbuf_begin(redis_cmdbuf_t *cb, int nargs)
+{
+    char hdr[32];
+    int len = snprintf(hdr, sizeof(hdr), "*%d\r\n", nargs);
+    cb->ncmds++;
+    return cmdbuf_append(cb, hdr, len);
+}
+
+// Appends one bulk string argument
+static int cmdbuf_arg(redis_cmdbuf_t *cb, const char *arg)
+{
+    char hdr[32];
+    size_t n = strlen(arg);
+    int len = snprintf(hdr, sizeof(hdr), "$%zu\r\n", n);
+    if(cmdbuf_append(cb, hdr, len) || cmdbuf_append(cb, arg, n)) {
+        return -1;
+    }
+    return cmdbuf_append(cb, "\r\n", 2);
+}
+
+// Sends the commands in cb and reads (and checks) their replies
+static int cmdbuf_flush(redis_conn_t *c, redis_cmdbuf_t *cb, const char *name)
+{
+    char msg[256];
+    int i, rv = 0;
+
+    if(cb->ncmds == 0) {
+        return 0;
+    }
+    if(redis_write(c, cb->buf, cb->len)) {
+        rv = -1;
+    }
+    for(i=0; rv == 0 && i<cb->ncmds; i++) {
+        switch(redis_read_reply(c, msg, sizeof(msg), NULL)) {
+            case -1:
+                rv = -1;
+                break;
+            case '-':
+                hashpipe_warn(name, "redis error: %s", msg);
+                break;
+        }
+    }
+    cb->len = 0;
+    cb->ncmds = 0;
+    return rv;
+}
+
+// State for collecting changed and deleted keys
+typedef struct {
+    redis_cmdbuf_t set;  // Arguments of HSET command (without header)
+    redis_cmdbuf_t del;  // Arguments of HDEL command (without header)
+    int nset;
+    int ndel;
+} redis_delta_t;
+
+// hashpipe_status_snapshot_changes() callback
+static void collect_change(const char *key, const char *card, void *data)
+{
+    redis_delta_t *d = (redis_delta_t *)data;
+    char value[81];
+
+    if(card) {
+        hashpipe_status_card_value(card, value);
+        cmdbuf_arg(&d->set, key);
+        cmdbuf_arg(&d->set, value);
+        d->nset++;
+    } else {
+        cmdbuf_arg(&d->del, key);
+        d->ndel++;
+    }
+}
+
+// Publishes the changes from prev to cur (all of cur if prev is NULL) to the
+// status hash as one pipelined batch.
+static int publish_changes(redis_conn_t *c, redis_cmdbuf_t *cb,
+        redis_delta_t *d, const char *hashkey,
+        const hashpipe_status_snapshot_t *cur,
+        const hashpipe_status_snapshot_t *prev, double delay, const char *name)
+{
+    char expire[32];
+
+    d->set.len = d->del.len = 0;
+    d->nset = d->ndel = 0;
+    hashpipe_status_snapshot_changes(cur, prev, collect_change, d);
+
+    if(d->nset > 0) {
+        cmdbuf_begin(cb, 2 + 2*d->nset);
+        cmdbuf_arg(cb, "HSET");
+        cmdbuf_arg(cb, hashkey);
+        cmdbuf_append(cb, d->set.buf, d->set.len);
+    }
+    if(d->ndel > 0) {
+        cmdbuf_begin(cb, 2 + d->ndel);
+        cmdbuf_arg(cb, "HDEL");
+        cmdbuf_arg(cb, hashkey);
+        cmdbuf_append(cb, d->del.buf, d->del.len);
+    }
+    // Let the status hash disappear if we stop updating it
+    snprintf(expire, sizeof(expire), "%d", (int)(3*delay) + 10);
+    cmdbuf_begin(cb, 3);
+    cmdbuf_arg(cb, "EXPIRE");
+    cmdbuf_arg(cb, hashkey);
+    cmdbuf_arg(cb, expire);
+
+    return cmdbuf_flush(c, cb, name);
+}
+
+// Applies KEY=VALUE lines in msg to the status buffer
+static void apply_set_message(hashpipe_status_t *st, char *msg)
+{
+    char *line, *eq, *end, *saveptr = NULL;
+
+    hashpipe_status_lock_safe(st);
+    for(line = strtok_r(msg, "\r\n", &saveptr); line;
+            line = strtok_r(NULL, "\r\n", &saveptr)) {
+        if(!(eq = strchr(line, '='))) {
+            continue;
+        }
+        *eq = '\0';
+        // Trim blanks around key
+        while(*line == ' ') {
+            line++;
+        }
+        for(end = eq; end > line && end[-1] == ' '; end--);
+        *end = '\0';
+        if(*line) {
+            hputs(st->buf, line, eq+1);
+        }
+    }
+    hashpipe_status_unlock_safe(st);
+}
+
+// Reads one pubsub message from c.  Set messages are applied to st.
+static int handle_message(redis_conn_t *c, hashpipe_status_t *st, char *msg)
+{
+    char kind[32];
+    long i, n = 0;
+
+    if(redis_read_reply(c, NULL, 0, &n) != '*' || n < 1) {
+        return -1;
+    }
+    if(redis_read_reply(c, kind, sizeof(kind), NULL) == -1) {
+        return -1;
+    }
+    // Channel
+    if(n > 1 && redis_read_reply(c, NULL, 0, NULL) == -1) {
+        return -1;
+    }
+    // Payload (or subscription count)
+    if(n > 2 && redis_read_reply(c, msg, REDIS_MAX_MESSAGE, NULL) == -1) {
+        return -1;
+    }
+    for(i=3; i<n; i++) {
+        if(redis_read_reply(c, NULL, 0, NULL) == -1) {
+            return -1;
+        }
+    }
+    if(!strcmp(kind, "message")) {
+        apply_set_message(st, msg);
+    }
+    return 0;
+}
+
+static void set_state(hashpipe_status_t *st, const char *status_key,
+        const char *state)
+{
+    hashpipe_status_lock_safe(st);
+    hputs(st->buf, status_key, state);
+    hashpipe_status_unlock_safe(st);
+}
+
+static void close_conns(redis_conn_t *conns)
+{
+    redis_close(&conns[0]);
+    redis_close(&conns[1]);
+}
+
+static void *run(hashpipe_thread_args_t * args)
+{
+    hashpipe_status_t st = args->st;
+    const char * status_key = args->thread_desc->skey;
+    const char * name = args->thread_desc->name;
+    char host[80] = REDIS_DEFAULT_HOST;
+    char gwname[80] = "";
+    char hashkey[256];
+    char channels[3][256];
+    int port = REDIS_DEFAULT_PORT;
+    double delay = REDIS_DEFAULT_DELAY;
+    redis_conn_t conns[2]; // Publisher, subscriber
+    redis_cmdbuf_t cb = {0};
+    redis_delta_t delta = {{0}};
+    hashpipe_status_snapshot_t snap[2];
+    int cur = 0;
+    int connected = 0;
+    int warned = 0;
+    int64_t next_ns;
+    uint32_t gen;
+    struct pollfd pfd;
+    char *msg;
+    int i, timeout_ms;
+
+    hashpipe_status_lock_safe(&st);
+    hgets(st.buf, "REDISHST", sizeof(host), host);
+    hgeti4(st.buf, "REDISPRT", &port);
+    hgetr8(st.buf, "REDISDLY", &delay);
+    hgets(st.buf, "REDISGWN", sizeof(gwname), gwname);
+    hashpipe_status_unlock_safe(&st);
+
+    if(delay <= 0) {
+        delay = REDIS_DEFAULT_DELAY;
+    }
+    if(!gwname[0]) {
+        gethostname(gwname, sizeof(gwname)-1);
+        gwname[sizeof(gwname)-1] = '\0';
+        // Use short host name
+        if(strchr(gwname, '.')) {
+            *strchr(gwname, '.') = '\0';
+        }
+    }
+    snprintf(hashkey, sizeof(hashkey), "hashpipe://%s/%d/status",
+            gwname, args->instance_id);
+    snprintf(channels[0], sizeof(channels[0]), "hashpipe://%s/%d/set",
+            gwname, args->instance_id);
+    snprintf(channels[1], sizeof(channels[1]), "hashpipe://%s//set", gwname);
+    snprintf(channels[2], sizeof(channels[2]), "hashpipe:///set");
+
+    if(!(msg = malloc(REDIS_MAX_MESSAGE))) {
+        hashpipe_error(name, "malloc");
+        return THREAD_ERROR;
+    }
+    memset(snap, 0, sizeof(snap));
+    conns[0].fd = conns[1].fd = -1;
+    pthread_cleanup_push(free, msg);
+    pthread_cleanup_push((void (*)(void *))close_conns, conns);
+
+    set_state(&st, status_key, "connecting");
+
+    next_ns = monotonic_ns();
+    while (run_threads()) {
+
+        if(!connected) {
+            if(redis_connect(&conns[0], host, port)
+            || redis_connect(&conns[1], host, port)) {
+                close_conns(conns);
+                if(!warned) {
+                    hashpipe_warn(name,
+                            "could not connect to redis server %s:%d",
+                            host, port);
+                    set_state(&st, status_key, "disconnected");
+                    warned = 1;
+                }
+                sleep(1);
+                continue;
+            }
+
+            // Subscribe to set channels
+            cmdbuf_begin(&cb, 4);
+            cmdbuf_arg(&cb, "SUBSCRIBE");
+            for(i=0; i<3; i++) {
+                cmdbuf_arg(&cb, channels[i]);
+            }
+            if(redis_write(&conns[1], cb.buf, cb.len)) {
+                cb.len = cb.ncmds = 0;
+                close_conns(conns);
+                sleep(1);
+                continue;
+            }
+            cb.len = cb.ncmds = 0;
+
+            hashpipe_info(name, "connected to redis server %s:%d as %s",
+                    host, port, hashkey);
+            set_state(&st, status_key, "connected");
+            connected = 1;
+            warned = 0;
+            // Force full update
+            snap[cur].len = 0;
+            next_ns = monotonic_ns();
+        }
+
+        // Publish changes if it is time to do so
+        if(monotonic_ns() >= next_ns) {
+            gen = snap[cur].generation;
+            cur ^= 1;
+            // Only copy if status buffer changed (or we need a full update)
+            snap[cur].generation = snap[cur^1].len ? gen : ~gen;
+            if(hashpipe_status_snapshot(&st, &snap[cur]) == HASHPIPE_OK) {
+                if(snap[cur^1].len && snap[cur].generation == gen && st.ctrl) {
+                    // Nothing changed, but keep the hash from expiring
+                    cur ^= 1;
+                    publish_changes(&conns[0], &cb, &delta, hashkey,
+                            &snap[cur], &snap[cur], delay, name);
+                } else if(publish_changes(&conns[0], &cb, &delta, hashkey,
+                            &snap[cur], snap[cur^1].len ? &snap[cur^1] : NULL,
+                            delay, name)) {
+                    hashpipe_warn(name, "lost connection to redis server");
+                    close_conns(conns);
+                    connected = 0;
+                    set_state(&st, status_key, "disconnected");
+                    snap[cur].len = 0;
+                    continue;
+                }
+            }
+            next_ns += (int64_t)(delay * 1e9);
+            if(next_ns < monotonic_ns()) {
+                next_ns = monotonic_ns();
+            }
+        }
+
+        // Wait for set messages until next update
+        timeout_ms = (next_ns - monotonic_ns()) / 1000000;
+        pfd.fd = conns[1].fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        if(conns[1].rpos < conns[1].rlen
+        || poll(&pfd, 1, timeout_ms < 0 ? 0 : timeout_ms) > 0) {
+            if(handle_message(&conns[1], &st, msg)) {
+                hashpipe_warn(name, "lost connection to redis server");
+                close_conns(conns);
+                connected = 0;
+                set_state(&st, status_key, "disconnected");
+                snap[cur].len = 0;
+            }
+        }
+
+        /* Will exit if thread has been cancelled */
+        pthread_testcancel();
+    }
+
+    pthread_cleanup_pop(1); // close_conns
+    pthread_cleanup_pop(1); // free msg
+    free(cb.buf);
+    free(delta.set.buf);
+    free(delta.del.buf);
+    hashpipe_status_snapshot_free(&snap[0]);
+    hashpipe_status_snapshot_free(&snap[1]);
+
+    // Thread success!
+    return THREAD_OK;
+}
+
+static hashpipe_thread_desc_t redis_gateway_thread = {
+    name: "redis_gateway_thread",
+    skey: "REDISGW",
+    init: NULL,
+    run:  run,
+    ibuf_desc: {NULL},
+    obuf_desc: {NULL}
+};
+
+static __attribute__((constructor)) void ctor()
+{
+    register_hashpipe_thread(&redis_gateway_thread);
+}